@@ -9,17 +9,21 @@
 #include <assert.h>
 #include <unistd.h>
 #include <ncurses.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include "heap.h"
 #include "poke327.h"
 #include "character.h"
 #include "io.h"
 #include "db_parse.h"
-
-typedef struct queue_node {
-  int x, y;
-  struct queue_node *next;
-} queue_node_t;
+#include "mapgen.h"
+#include "worldsim.h"
+#include "timing.h"
 
 World world;
 
@@ -34,807 +38,711 @@ pair_t all_dirs[8] = {
   {  1,  1 },
 };
 
-static int32_t path_cmp(const void *key, const void *with) {
-  return ((path_t *) key)->cost - ((path_t *) with)->cost;
+void rand_pos(pair_t pos)
+{
+  pos[dim_x] = (rand() % (map_x - 2)) + 1;
+  pos[dim_y] = (rand() % (map_y - 2)) + 1;
 }
 
-static int32_t edge_penalty(int8_t x, int8_t y)
+static void rng_pos(pair_t pos, rng_t *r)
 {
-  return (x == 1 || y == 1 || x == MAP_X - 2 || y == MAP_Y - 2) ? 2 : 1;
+  pos[dim_x] = (rng_rand(r) % (map_x - 2)) + 1;
+  pos[dim_y] = (rng_rand(r) % (map_y - 2)) + 1;
 }
 
-static void dijkstra_path(Map *m, pair_t from, pair_t to)
+void new_hiker(rng_t *r)
 {
-  static path_t path[MAP_Y][MAP_X], *p;
-  static uint32_t initialized = 0;
-  heap_t h;
-  int32_t x, y;
-
-  if (!initialized) {
-    for (y = 0; y < MAP_Y; y++) {
-      for (x = 0; x < MAP_X; x++) {
-        path[y][x].pos[dim_y] = y;
-        path[y][x].pos[dim_x] = x;
-      }
-    }
-    initialized = 1;
-  }
-  
-  for (y = 0; y < MAP_Y; y++) {
-    for (x = 0; x < MAP_X; x++) {
-      path[y][x].cost = INT_MAX;
-    }
-  }
-
-  path[from[dim_y]][from[dim_x]].cost = 0;
-
-  heap_init(&h, path_cmp, NULL);
-
-  for (y = 1; y < MAP_Y - 1; y++) {
-    for (x = 1; x < MAP_X - 1; x++) {
-      path[y][x].hn = heap_insert(&h, &path[y][x]);
-    }
-  }
+  npc_store_t *s = &world.cur_map->npcs;
+  pair_t pos;
+  Npc *c;
 
-  while ((p = (path_t *) heap_remove_min(&h))) {
-    p->hn = NULL;
+  pathfind_need(char_hiker);
+  do {
+    rng_pos(pos, r);
+  } while (world.hiker_dist[pos[dim_y]][pos[dim_x]] == INT_MAX ||
+           world.cur_map->cmap[pos[dim_y]][pos[dim_x]]         ||
+           pos[dim_x] < 3 || pos[dim_x] > map_x - 4            ||
+           pos[dim_y] < 3 || pos[dim_y] > map_y - 4);
 
-    if ((p->pos[dim_y] == to[dim_y]) && p->pos[dim_x] == to[dim_x]) {
-      for (x = to[dim_x], y = to[dim_y];
-           (x != from[dim_x]) || (y != from[dim_y]);
-           p = &path[y][x], x = p->from[dim_x], y = p->from[dim_y]) {
-        mapxy(x, y) = ter_path;
-        heightxy(x, y) = 0;
-      }
-      heap_delete(&h);
-      return;
-    }
+  world.cur_map->cmap[pos[dim_y]][pos[dim_x]] = c = npc_new(s);
+  s->pos[c->slot][dim_y] = pos[dim_y];
+  s->pos[c->slot][dim_x] = pos[dim_x];
+  c->ctype = char_hiker;
+  s->mtype[c->slot] = move_hiker;
+  c->symbol = 'h';
+  c->next_turn = 0;
+  rng_split(&c->rng, r);
+  turn_schedule(&world.cur_map->turn, c);
 
-    if ((path[p->pos[dim_y] - 1][p->pos[dim_x]    ].hn) &&
-        (path[p->pos[dim_y] - 1][p->pos[dim_x]    ].cost >
-         ((p->cost + heightpair(p->pos)) *
-          edge_penalty(p->pos[dim_x], p->pos[dim_y] - 1)))) {
-      path[p->pos[dim_y] - 1][p->pos[dim_x]    ].cost =
-        ((p->cost + heightpair(p->pos)) *
-         edge_penalty(p->pos[dim_x], p->pos[dim_y] - 1));
-      path[p->pos[dim_y] - 1][p->pos[dim_x]    ].from[dim_y] = p->pos[dim_y];
-      path[p->pos[dim_y] - 1][p->pos[dim_x]    ].from[dim_x] = p->pos[dim_x];
-      heap_decrease_key_no_replace(&h, path[p->pos[dim_y] - 1]
-                                           [p->pos[dim_x]    ].hn);
-    }
-    if ((path[p->pos[dim_y]    ][p->pos[dim_x] - 1].hn) &&
-        (path[p->pos[dim_y]    ][p->pos[dim_x] - 1].cost >
-         ((p->cost + heightpair(p->pos)) *
-          edge_penalty(p->pos[dim_x] - 1, p->pos[dim_y])))) {
-      path[p->pos[dim_y]][p->pos[dim_x] - 1].cost =
-        ((p->cost + heightpair(p->pos)) *
-         edge_penalty(p->pos[dim_x] - 1, p->pos[dim_y]));
-      path[p->pos[dim_y]    ][p->pos[dim_x] - 1].from[dim_y] = p->pos[dim_y];
-      path[p->pos[dim_y]    ][p->pos[dim_x] - 1].from[dim_x] = p->pos[dim_x];
-      heap_decrease_key_no_replace(&h, path[p->pos[dim_y]    ]
-                                           [p->pos[dim_x] - 1].hn);
-    }
-    if ((path[p->pos[dim_y]    ][p->pos[dim_x] + 1].hn) &&
-        (path[p->pos[dim_y]    ][p->pos[dim_x] + 1].cost >
-         ((p->cost + heightpair(p->pos)) *
-          edge_penalty(p->pos[dim_x] + 1, p->pos[dim_y])))) {
-      path[p->pos[dim_y]][p->pos[dim_x] + 1].cost =
-        ((p->cost + heightpair(p->pos)) *
-         edge_penalty(p->pos[dim_x] + 1, p->pos[dim_y]));
-      path[p->pos[dim_y]    ][p->pos[dim_x] + 1].from[dim_y] = p->pos[dim_y];
-      path[p->pos[dim_y]    ][p->pos[dim_x] + 1].from[dim_x] = p->pos[dim_x];
-      heap_decrease_key_no_replace(&h, path[p->pos[dim_y]    ]
-                                           [p->pos[dim_x] + 1].hn);
-    }
-    if ((path[p->pos[dim_y] + 1][p->pos[dim_x]    ].hn) &&
-        (path[p->pos[dim_y] + 1][p->pos[dim_x]    ].cost >
-         ((p->cost + heightpair(p->pos)) *
-          edge_penalty(p->pos[dim_x], p->pos[dim_y] + 1)))) {
-      path[p->pos[dim_y] + 1][p->pos[dim_x]    ].cost =
-        ((p->cost + heightpair(p->pos)) *
-         edge_penalty(p->pos[dim_x], p->pos[dim_y] + 1));
-      path[p->pos[dim_y] + 1][p->pos[dim_x]    ].from[dim_y] = p->pos[dim_y];
-      path[p->pos[dim_y] + 1][p->pos[dim_x]    ].from[dim_x] = p->pos[dim_x];
-      heap_decrease_key_no_replace(&h, path[p->pos[dim_y] + 1]
-                                           [p->pos[dim_x]    ].hn);
-    }
-  }
+  //  printf("Hiker at %d,%d\n", pos[dim_x], pos[dim_y]);
 }
 
-static int build_paths(Map *m)
+void new_rival(rng_t *r)
 {
-  pair_t from, to;
+  npc_store_t *s = &world.cur_map->npcs;
+  pair_t pos;
+  Npc *c;
 
-  /*  printf("%d %d %d %d\n", m->n, m->s, m->e, m->w);*/
+  pathfind_need(char_rival);
+  do {
+    rng_pos(pos, r);
+  } while (world.rival_dist[pos[dim_y]][pos[dim_x]] == INT_MAX ||
+           world.rival_dist[pos[dim_y]][pos[dim_x]] < 0        ||
+           world.cur_map->cmap[pos[dim_y]][pos[dim_x]]         ||
+           pos[dim_x] < 3 || pos[dim_x] > map_x - 4            ||
+           pos[dim_y] < 3 || pos[dim_y] > map_y - 4);
 
-  if (m->e != -1 && m->w != -1) {
-    from[dim_x] = 1;
-    to[dim_x] = MAP_X - 2;
-    from[dim_y] = m->w;
-    to[dim_y] = m->e;
+  world.cur_map->cmap[pos[dim_y]][pos[dim_x]] = c = npc_new(s);
+  s->pos[c->slot][dim_y] = pos[dim_y];
+  s->pos[c->slot][dim_x] = pos[dim_x];
+  c->ctype = char_rival;
+  s->mtype[c->slot] = move_rival;
+  c->symbol = 'r';
+  c->next_turn = 0;
+  rng_split(&c->rng, r);
+  turn_schedule(&world.cur_map->turn, c);
+}
 
-    dijkstra_path(m, from, to);
-  }
+void new_char_other(rng_t *r)
+{
+  npc_store_t *s = &world.cur_map->npcs;
+  pair_t pos;
+  Npc *c;
+  int d;
 
-  if (m->n != -1 && m->s != -1) {
-    from[dim_y] = 1;
-    to[dim_y] = MAP_Y - 2;
-    from[dim_x] = m->n;
-    to[dim_x] = m->s;
+  pathfind_need(char_rival);
+  do {
+    rng_pos(pos, r);
+  } while (world.rival_dist[pos[dim_y]][pos[dim_x]] == INT_MAX ||
+           world.rival_dist[pos[dim_y]][pos[dim_x]] < 0        ||
+           world.cur_map->cmap[pos[dim_y]][pos[dim_x]]         ||
+           pos[dim_x] < 3 || pos[dim_x] > map_x - 4            ||
+           pos[dim_y] < 3 || pos[dim_y] > map_y - 4);
 
-    dijkstra_path(m, from, to);
+  world.cur_map->cmap[pos[dim_y]][pos[dim_x]] = c = npc_new(s);
+  s->pos[c->slot][dim_y] = pos[dim_y];
+  s->pos[c->slot][dim_x] = pos[dim_x];
+  c->ctype = char_other;
+  switch (rng_rand(r) % 4) {
+  case 0:
+    s->mtype[c->slot] = move_pace;
+    c->symbol = 'p';
+    break;
+  case 1:
+    s->mtype[c->slot] = move_wander;
+    c->symbol = 'w';
+    break;
+  case 2:
+    s->mtype[c->slot] = move_sentry;
+    c->symbol = 's';
+    break;
+  case 3:
+    s->mtype[c->slot] = move_walk;
+    c->symbol = 'n';
+    break;
   }
+  d = rng_rand(r) & 0x7;
+  s->dir[c->slot][dim_x] = all_dirs[d][dim_x];
+  s->dir[c->slot][dim_y] = all_dirs[d][dim_y];
+  c->next_turn = 0;
+  rng_split(&c->rng, r);
+  turn_schedule(&world.cur_map->turn, c);
+}
 
-  if (m->e == -1) {
-    if (m->s == -1) {
-      from[dim_x] = 1;
-      from[dim_y] = m->w;
-      to[dim_x] = m->n;
-      to[dim_y] = 1;
-    } else {
-      from[dim_x] = 1;
-      from[dim_y] = m->w;
-      to[dim_x] = m->s;
-      to[dim_y] = MAP_Y - 2;
-    }
+/* Trainers come from the map's own stream, so a map reached through its *
+ * gates always gets the same ones.  They're still only placed where the *
+ * PC can reach, so landing by teleport in a walled-off pocket can move  *
+ * them.                                                                 */
+void place_characters()
+{
+  rng_t r;
 
-    dijkstra_path(m, from, to);
-  }
+  rng_seed(&r, world.seed, world.cur_idx[dim_x], world.cur_idx[dim_y],
+           rng_characters);
+  world.cur_map->num_trainers = 2;
 
-  if (m->w == -1) {
-    if (m->s == -1) {
-      from[dim_x] = MAP_X - 2;
-      from[dim_y] = m->e;
-      to[dim_x] = m->n;
-      to[dim_y] = 1;
-    } else {
-      from[dim_x] = MAP_X - 2;
-      from[dim_y] = m->e;
-      to[dim_x] = m->s;
-      to[dim_y] = MAP_Y - 2;
+  //Always place a hiker and a rival, then place a random number of others
+  new_hiker(&r);
+  new_rival(&r);
+  do {
+    //higher probability of non- hikers and rivals
+    switch(rng_rand(&r) % 10) {
+    case 0:
+      new_hiker(&r);
+      break;
+    case 1:
+     new_rival(&r);
+      break;
+    default:
+      new_char_other(&r);
+      break;
     }
+  } while (++world.cur_map->num_trainers < MIN_TRAINERS ||
+           ((rng_rand(&r) % 100) < ADD_TRAINER_PROB));
+}
 
-    dijkstra_path(m, from, to);
-  }
+void init_pc()
+{
+  int x, y;
 
-  if (m->n == -1) {
-    if (m->e == -1) {
-      from[dim_x] = 1;
-      from[dim_y] = m->w;
-      to[dim_x] = m->s;
-      to[dim_y] = MAP_Y - 2;
-    } else {
-      from[dim_x] = MAP_X - 2;
-      from[dim_y] = m->e;
-      to[dim_x] = m->s;
-      to[dim_y] = MAP_Y - 2;
-    }
+  do {
+    x = rand() % (map_x - 2) + 1;
+    y = rand() % (map_y - 2) + 1;
+  } while (world.cur_map->map[y][x] != ter_path);
 
-    dijkstra_path(m, from, to);
-  }
+  world.pc.pos[dim_x] = x;
+  world.pc.pos[dim_y] = y;
+  world.pc.symbol = '@';
 
-  if (m->s == -1) {
-    if (m->e == -1) {
-      from[dim_x] = 1;
-      from[dim_y] = m->w;
-      to[dim_x] = m->n;
-      to[dim_y] = 1;
-    } else {
-      from[dim_x] = MAP_X - 2;
-      from[dim_y] = m->e;
-      to[dim_x] = m->n;
-      to[dim_y] = 1;
-    }
+  world.cur_map->cmap[y][x] = &world.pc;
+  world.pc.next_turn = 0;
 
-    dijkstra_path(m, from, to);
-  }
+  world.pc.bag[revive] = 5;
+  world.pc.bag[potion] = 10;
+  world.pc.bag[pokeball] = 10;
 
-  return 0;
+  turn_schedule(&world.cur_map->turn, &world.pc);
 }
 
-static int gaussian[5][5] = {
-  {  1,  4,  7,  4,  1 },
-  {  4, 16, 26, 16,  4 },
-  {  7, 26, 41, 26,  7 },
-  {  4, 16, 26, 16,  4 },
-  {  1,  4,  7,  4,  1 }
-};
-
-static int smooth_height(Map *m)
+/* Moves the PC to the nearest free cell it can stand on, off the edge */
+static void place_pc_aside()
 {
-  int32_t i, x, y;
-  int32_t s, t, p, q;
-  queue_node_t *head, *tail, *tmp;
-  /*  FILE *out;*/
-  uint8_t height[MAP_Y][MAP_X];
-
-  memset(&height, 0, sizeof (height));
-
-  /* Seed with some values */
-  for (i = 1; i < 255; i += 20) {
-    do {
-      x = rand() % MAP_X;
-      y = rand() % MAP_Y;
-    } while (height[y][x]);
-    height[y][x] = i;
-    if (i == 1) {
-      head = tail = (queue_node_t *) malloc(sizeof (*tail));
-    } else {
-      tail->next = (queue_node_t *) malloc(sizeof (*tail));
-      tail = tail->next;
-    }
-    tail->next = NULL;
-    tail->x = x;
-    tail->y = y;
-  }
-
-  /*
-  out = fopen("seeded.pgm", "w");
-  fprintf(out, "P5\n%u %u\n255\n", MAP_X, MAP_Y);
-  fwrite(&height, sizeof (height), 1, out);
-  fclose(out);
-  */
-  
-  /* Diffuse the vaules to fill the space */
-  while (head) {
-    x = head->x;
-    y = head->y;
-    i = height[y][x];
-
-    if (x - 1 >= 0 && y - 1 >= 0 && !height[y - 1][x - 1]) {
-      height[y - 1][x - 1] = i;
-      tail->next = (queue_node_t *) malloc(sizeof (*tail));
-      tail = tail->next;
-      tail->next = NULL;
-      tail->x = x - 1;
-      tail->y = y - 1;
-    }
-    if (x - 1 >= 0 && !height[y][x - 1]) {
-      height[y][x - 1] = i;
-      tail->next = (queue_node_t *) malloc(sizeof (*tail));
-      tail = tail->next;
-      tail->next = NULL;
-      tail->x = x - 1;
-      tail->y = y;
-    }
-    if (x - 1 >= 0 && y + 1 < MAP_Y && !height[y + 1][x - 1]) {
-      height[y + 1][x - 1] = i;
-      tail->next = (queue_node_t *) malloc(sizeof (*tail));
-      tail = tail->next;
-      tail->next = NULL;
-      tail->x = x - 1;
-      tail->y = y + 1;
-    }
-    if (y - 1 >= 0 && !height[y - 1][x]) {
-      height[y - 1][x] = i;
-      tail->next = (queue_node_t *) malloc(sizeof (*tail));
-      tail = tail->next;
-      tail->next = NULL;
-      tail->x = x;
-      tail->y = y - 1;
-    }
-    if (y + 1 < MAP_Y && !height[y + 1][x]) {
-      height[y + 1][x] = i;
-      tail->next = (queue_node_t *) malloc(sizeof (*tail));
-      tail = tail->next;
-      tail->next = NULL;
-      tail->x = x;
-      tail->y = y + 1;
-    }
-    if (x + 1 < MAP_X && y - 1 >= 0 && !height[y - 1][x + 1]) {
-      height[y - 1][x + 1] = i;
-      tail->next = (queue_node_t *) malloc(sizeof (*tail));
-      tail = tail->next;
-      tail->next = NULL;
-      tail->x = x + 1;
-      tail->y = y - 1;
-    }
-    if (x + 1 < MAP_X && !height[y][x + 1]) {
-      height[y][x + 1] = i;
-      tail->next = (queue_node_t *) malloc(sizeof (*tail));
-      tail = tail->next;
-      tail->next = NULL;
-      tail->x = x + 1;
-      tail->y = y;
-    }
-    if (x + 1 < MAP_X && y + 1 < MAP_Y && !height[y + 1][x + 1]) {
-      height[y + 1][x + 1] = i;
-      tail->next = (queue_node_t *) malloc(sizeof (*tail));
-      tail = tail->next;
-      tail->next = NULL;
-      tail->x = x + 1;
-      tail->y = y + 1;
-    }
-
-    tmp = head;
-    head = head->next;
-    free(tmp);
-  }
-
-  /* And smooth it a bit with a gaussian convolution */
-  for (y = 0; y < MAP_Y; y++) {
-    for (x = 0; x < MAP_X; x++) {
-      for (s = t = p = 0; p < 5; p++) {
-        for (q = 0; q < 5; q++) {
-          if (y + (p - 2) >= 0 && y + (p - 2) < MAP_Y &&
-              x + (q - 2) >= 0 && x + (q - 2) < MAP_X) {
-            s += gaussian[p][q];
-            t += height[y + (p - 2)][x + (q - 2)] * gaussian[p][q];
-          }
+  int32_t r, x, y;
+
+  for (r = 1; r < map_x || r < map_y; r++) {
+    for (y = world.pc.pos[dim_y] - r; y <= world.pc.pos[dim_y] + r; y++) {
+      for (x = world.pc.pos[dim_x] - r; x <= world.pc.pos[dim_x] + r; x++) {
+        if (x > 0 && x < map_x - 1 && y > 0 && y < map_y - 1 &&
+            !world.cur_map->cmap[y][x] &&
+            move_cost[char_pc][world.cur_map->map[y][x]] != INT_MAX) {
+          world.pc.pos[dim_x] = x;
+          world.pc.pos[dim_y] = y;
+          return;
         }
       }
-      m->height[y][x] = t / s;
     }
   }
-  /* Let's do it again, until it's smooth like Kenny G. */
-  for (y = 0; y < MAP_Y; y++) {
-    for (x = 0; x < MAP_X; x++) {
-      for (s = t = p = 0; p < 5; p++) {
-        for (q = 0; q < 5; q++) {
-          if (y + (p - 2) >= 0 && y + (p - 2) < MAP_Y &&
-              x + (q - 2) >= 0 && x + (q - 2) < MAP_X) {
-            s += gaussian[p][q];
-            t += height[y + (p - 2)][x + (q - 2)] * gaussian[p][q];
-          }
-        }
-      }
-      m->height[y][x] = t / s;
-    }
-  }
-
-  /*
-  out = fopen("diffused.pgm", "w");
-  fprintf(out, "P5\n%u %u\n255\n", MAP_X, MAP_Y);
-  fwrite(&height, sizeof (height), 1, out);
-  fclose(out);
-
-  out = fopen("smoothed.pgm", "w");
-  fprintf(out, "P5\n%u %u\n255\n", MAP_X, MAP_Y);
-  fwrite(&m->height, sizeof (m->height), 1, out);
-  fclose(out);
-  */
-
-  return 0;
-}
-
-static void find_building_location(Map *m, pair_t p)
-{
-  do {
-    p[dim_x] = rand() % (MAP_X - 5) + 3;
-    p[dim_y] = rand() % (MAP_Y - 10) + 5;
-
-    if ((((mapxy(p[dim_x] - 1, p[dim_y]    ) == ter_path)     &&
-          (mapxy(p[dim_x] - 1, p[dim_y] + 1) == ter_path))    ||
-         ((mapxy(p[dim_x] + 2, p[dim_y]    ) == ter_path)     &&
-          (mapxy(p[dim_x] + 2, p[dim_y] + 1) == ter_path))    ||
-         ((mapxy(p[dim_x]    , p[dim_y] - 1) == ter_path)     &&
-          (mapxy(p[dim_x] + 1, p[dim_y] - 1) == ter_path))    ||
-         ((mapxy(p[dim_x]    , p[dim_y] + 2) == ter_path)     &&
-          (mapxy(p[dim_x] + 1, p[dim_y] + 2) == ter_path)))   &&
-        (((mapxy(p[dim_x]    , p[dim_y]    ) != ter_mart)     &&
-          (mapxy(p[dim_x]    , p[dim_y]    ) != ter_center)   &&
-          (mapxy(p[dim_x] + 1, p[dim_y]    ) != ter_mart)     &&
-          (mapxy(p[dim_x] + 1, p[dim_y]    ) != ter_center)   &&
-          (mapxy(p[dim_x]    , p[dim_y] + 1) != ter_mart)     &&
-          (mapxy(p[dim_x]    , p[dim_y] + 1) != ter_center)   &&
-          (mapxy(p[dim_x] + 1, p[dim_y] + 1) != ter_mart)     &&
-          (mapxy(p[dim_x] + 1, p[dim_y] + 1) != ter_center))) &&
-        (((mapxy(p[dim_x]    , p[dim_y]    ) != ter_path)     &&
-          (mapxy(p[dim_x] + 1, p[dim_y]    ) != ter_path)     &&
-          (mapxy(p[dim_x]    , p[dim_y] + 1) != ter_path)     &&
-          (mapxy(p[dim_x] + 1, p[dim_y] + 1) != ter_path)))) {
-          break;
-    }
-  } while (1);
 }
 
-static int place_pokemart(Map *m)
+void place_pc()
 {
-  pair_t p;
+  Character *c;
 
-  find_building_location(m, p);
+  if (world.pc.pos[dim_x] == 1) {
+    world.pc.pos[dim_x] = map_x - 2;
+  } else if (world.pc.pos[dim_x] == map_x - 2) {
+    world.pc.pos[dim_x] = 1;
+  } else if (world.pc.pos[dim_y] == 1) {
+    world.pc.pos[dim_y] = map_y - 2;
+  } else if (world.pc.pos[dim_y] == map_y - 2) {
+    world.pc.pos[dim_y] = 1;
+  }
 
-  mapxy(p[dim_x]    , p[dim_y]    ) = ter_mart;
-  mapxy(p[dim_x] + 1, p[dim_y]    ) = ter_mart;
-  mapxy(p[dim_x]    , p[dim_y] + 1) = ter_mart;
-  mapxy(p[dim_x] + 1, p[dim_y] + 1) = ter_mart;
+  // Trainers may have moved on to where the PC comes in; step aside
+  if (world.cur_map->cmap[world.pc.pos[dim_y]][world.pc.pos[dim_x]]) {
+    place_pc_aside();
+  }
+  world.cur_map->cmap[world.pc.pos[dim_y]][world.pc.pos[dim_x]] = &world.pc;
 
-  return 0;
+  if ((c = turn_peek(&world.cur_map->turn))) {
+    world.pc.next_turn = c->next_turn;
+  } else {
+    world.pc.next_turn = 0;
+  }
 }
 
-static int place_center(Map *m)
-{  pair_t p;
+/**************************************************************************
+ * World storage.  Only the maps the PC visits are ever generated, so a  *
+ * full world_size x world_size grid of pointers is almost all NULLs.    *
+ * Instead, maps live in chunks of WORLD_CHUNK x WORLD_CHUNK pointers,    *
+ * and chunks live in a linear-probing hash table that doubles at half    *
+ * full.  A lookup is a multiply and usually a single probe, and tearing  *
+ * the world down only touches chunks that exist.                         *
+ **************************************************************************/
 
-  find_building_location(m, p);
+static uint32_t world_slot(int16_t cx, int16_t cy, uint32_t size)
+{
+  uint32_t k;
 
-  mapxy(p[dim_x]    , p[dim_y]    ) = ter_center;
-  mapxy(p[dim_x] + 1, p[dim_y]    ) = ter_center;
-  mapxy(p[dim_x]    , p[dim_y] + 1) = ter_center;
-  mapxy(p[dim_x] + 1, p[dim_y] + 1) = ter_center;
+  // Fibonacci hashing; size is a power of two
+  k = ((uint32_t) (uint16_t) cx << 16) | (uint16_t) cy;
 
-  return 0;
+  return (k * 2654435769U) >> (32 - __builtin_ctz(size));
 }
 
-static int map_terrain(Map *m, int8_t n, int8_t s, int8_t e, int8_t w)
+static world_chunk_t *world_chunk(int16_t cx, int16_t cy)
 {
-  int32_t i, x, y;
-  queue_node_t *head, *tail, *tmp;
-  //  FILE *out;
-  int num_grass, num_clearing, num_mountain, num_forest, num_total;
-  terrain_type_t type;
-  int added_current = 0;
-  
-  num_grass = rand() % 4 + 2;
-  num_clearing = rand() % 4 + 2;
-  num_mountain = rand() % 2 + 1;
-  num_forest = rand() % 2 + 1;
-  num_total = num_grass + num_clearing + num_mountain + num_forest;
-
-  memset(&m->map, 0, sizeof (m->map));
+  world_chunk_t *c;
+  uint32_t i;
 
-  /* Seed with some values */
-  for (i = 0; i < num_total; i++) {
-    do {
-      x = rand() % MAP_X;
-      y = rand() % MAP_Y;
-    } while (m->map[y][x]);
-    if (i == 0) {
-      type = ter_grass;
-    } else if (i == num_grass) {
-      type = ter_clearing;
-    } else if (i == num_grass + num_clearing) {
-      type = ter_mountain;
-    } else if (i == num_grass + num_clearing + num_mountain) {
-      type = ter_forest;
-    }
-    m->map[y][x] = type;
-    if (i == 0) {
-      head = tail = (queue_node_t *) malloc(sizeof (*tail));
-    } else {
-      tail->next = (queue_node_t *) malloc(sizeof (*tail));
-      tail = tail->next;
-    }
-    tail->next = NULL;
-    tail->x = x;
-    tail->y = y;
+  if (!world.maps.size) {
+    return NULL;
   }
 
-  /*
-  out = fopen("seeded.pgm", "w");
-  fprintf(out, "P5\n%u %u\n255\n", MAP_X, MAP_Y);
-  fwrite(&m->map, sizeof (m->map), 1, out);
-  fclose(out);
-  */
-
-  /* Diffuse the vaules to fill the space */
-  while (head) {
-    x = head->x;
-    y = head->y;
-    i = m->map[y][x];
-    
-    if (x - 1 >= 0 && !m->map[y][x - 1]) {
-      if ((rand() % 100) < 80) {
-        m->map[y][x - 1] = (terrain_type_t) i;
-        tail->next = (queue_node_t *) malloc(sizeof (*tail));
-        tail = tail->next;
-        tail->next = NULL;
-        tail->x = x - 1;
-        tail->y = y;
-      } else if (!added_current) {
-        added_current = 1;
-        m->map[y][x] = (terrain_type_t) i;
-        tail->next = (queue_node_t *) malloc(sizeof (*tail));
-        tail = tail->next;
-        tail->next = NULL;
-        tail->x = x;
-        tail->y = y;
-      }
+  for (i = world_slot(cx, cy, world.maps.size);
+       (c = world.maps.table[i]);
+       i = (i + 1) & (world.maps.size - 1)) {
+    if (c->x == cx && c->y == cy) {
+      return c;
     }
+  }
 
-    if (y - 1 >= 0 && !m->map[y - 1][x]) {
-      if ((rand() % 100) < 20) {
-        m->map[y - 1][x] = (terrain_type_t) i;
-        tail->next = (queue_node_t *) malloc(sizeof (*tail));
-        tail = tail->next;
-        tail->next = NULL;
-        tail->x = x;
-        tail->y = y - 1;
-      } else if (!added_current) {
-        added_current = 1;
-        m->map[y][x] = (terrain_type_t) i;
-        tail->next = (queue_node_t *) malloc(sizeof (*tail));
-        tail = tail->next;
-        tail->next = NULL;
-        tail->x = x;
-        tail->y = y;
-      }
-    }
+  return NULL;
+}
 
-    if (y + 1 < MAP_Y && !m->map[y + 1][x]) {
-      if ((rand() % 100) < 20) {
-        m->map[y + 1][x] = (terrain_type_t) i;
-        tail->next = (queue_node_t *) malloc(sizeof (*tail));
-        tail = tail->next;
-        tail->next = NULL;
-        tail->x = x;
-        tail->y = y + 1;
-      } else if (!added_current) {
-        added_current = 1;
-        m->map[y][x] = (terrain_type_t) i;
-        tail->next = (queue_node_t *) malloc(sizeof (*tail));
-        tail = tail->next;
-        tail->next = NULL;
-        tail->x = x;
-        tail->y = y;
+static void world_insert_chunk(world_chunk_t *c)
+{
+  world_chunk_t **old;
+  uint32_t i, old_size;
+
+  if (2 * (world.maps.num_chunks + 1) > world.maps.size) {
+    old = world.maps.table;
+    old_size = world.maps.size;
+    world.maps.size = old_size ? old_size * 2 : 16;
+    world.maps.table = (world_chunk_t **) calloc(world.maps.size,
+                                                 sizeof (*old));
+    world.maps.num_chunks = 0;
+    for (i = 0; i < old_size; i++) {
+      if (old[i]) {
+        world_insert_chunk(old[i]);
       }
     }
+    free(old);
+  }
 
-    if (x + 1 < MAP_X && !m->map[y][x + 1]) {
-      if ((rand() % 100) < 80) {
-        m->map[y][x + 1] = (terrain_type_t) i;
-        tail->next = (queue_node_t *) malloc(sizeof (*tail));
-        tail = tail->next;
-        tail->next = NULL;
-        tail->x = x + 1;
-        tail->y = y;
-      } else if (!added_current) {
-        added_current = 1;
-        m->map[y][x] = (terrain_type_t) i;
-        tail->next = (queue_node_t *) malloc(sizeof (*tail));
-        tail = tail->next;
-        tail->next = NULL;
-        tail->x = x;
-        tail->y = y;
-      }
-    }
+  for (i = world_slot(c->x, c->y, world.maps.size);
+       world.maps.table[i];
+       i = (i + 1) & (world.maps.size - 1))
+    ;
+  world.maps.table[i] = c;
+  world.maps.num_chunks++;
+}
 
-    added_current = 0;
-    tmp = head;
-    head = head->next;
-    free(tmp);
-  }
+Map *world_map(int16_t x, int16_t y)
+{
+  world_chunk_t *c;
 
-  /*
-  out = fopen("diffused.pgm", "w");
-  fprintf(out, "P5\n%u %u\n255\n", MAP_X, MAP_Y);
-  fwrite(&m->map, sizeof (m->map), 1, out);
-  fclose(out);
-  */
-  
-  for (y = 0; y < MAP_Y; y++) {
-    for (x = 0; x < MAP_X; x++) {
-      if (y == 0 || y == MAP_Y - 1 ||
-          x == 0 || x == MAP_X - 1) {
-        mapxy(x, y) = ter_boulder;
-      }
-    }
+  if (x < 0 || x >= world_size || y < 0 || y >= world_size ||
+      !(c = world_chunk(x / WORLD_CHUNK, y / WORLD_CHUNK))) {
+    return NULL;
   }
 
-  m->n = n;
-  m->s = s;
-  m->e = e;
-  m->w = w;
+  return c->map[y % WORLD_CHUNK][x % WORLD_CHUNK];
+}
 
-  if (n != -1) {
-    mapxy(n,         0        ) = ter_exit;
-    mapxy(n,         1        ) = ter_path;
-  }
-  if (s != -1) {
-    mapxy(s,         MAP_Y - 1) = ter_exit;
-    mapxy(s,         MAP_Y - 2) = ter_path;
+static void lru_unlink(Map *m)
+{
+  if (m->lru_prev) {
+    m->lru_prev->lru_next = m->lru_next;
+  } else {
+    world.maps.lru_head = m->lru_next;
   }
-  if (w != -1) {
-    mapxy(0,         w        ) = ter_exit;
-    mapxy(1,         w        ) = ter_path;
+  if (m->lru_next) {
+    m->lru_next->lru_prev = m->lru_prev;
+  } else {
+    world.maps.lru_tail = m->lru_prev;
   }
-  if (e != -1) {
-    mapxy(MAP_X - 1, e        ) = ter_exit;
-    mapxy(MAP_X - 2, e        ) = ter_path;
+}
+
+static void lru_push(Map *m)
+{
+  m->lru_prev = NULL;
+  m->lru_next = world.maps.lru_head;
+  if (world.maps.lru_head) {
+    world.maps.lru_head->lru_prev = m;
+  } else {
+    world.maps.lru_tail = m;
   }
+  world.maps.lru_head = m;
+}
 
-  return 0;
+/* Only roughly; trainers' Pokemon aren't counted */
+static size_t map_bytes(Map *m)
+{
+  return (map_alloc_size() + (m->sim ? map_sim_bytes() : 0) +
+          m->num_trainers * (sizeof (Npc) + sizeof (occupant_t)));
 }
 
-static int place_boulders(Map *m)
+static void world_set_map(int16_t x, int16_t y, Map *m)
 {
-  int i;
-  int x, y;
+  world_chunk_t *c;
 
-  for (i = 0; i < MIN_BOULDERS || rand() % 100 < BOULDER_PROB; i++) {
-    y = rand() % (MAP_Y - 2) + 1;
-    x = rand() % (MAP_X - 2) + 1;
-    if (m->map[y][x] != ter_forest && m->map[y][x] != ter_path) {
-      m->map[y][x] = ter_boulder;
-    }
+  if (!(c = world_chunk(x / WORLD_CHUNK, y / WORLD_CHUNK))) {
+    c = (world_chunk_t *) calloc(1, sizeof (*c));
+    c->x = x / WORLD_CHUNK;
+    c->y = y / WORLD_CHUNK;
+    world_insert_chunk(c);
   }
 
-  return 0;
+  c->map[y % WORLD_CHUNK][x % WORLD_CHUNK] = m;
+  m->x = x;
+  m->y = y;
+  lru_push(m);
+  world.maps.num_maps++;
 }
 
-static int place_trees(Map *m)
+void Occupants::set(int x, int y, Character *c)
 {
-  int i;
-  int x, y;
-  
-  for (i = 0; i < MIN_TREES || rand() % 100 < TREE_PROB; i++) {
-    y = rand() % (MAP_Y - 2) + 1;
-    x = rand() % (MAP_X - 2) + 1;
-    if (m->map[y][x] != ter_mountain && m->map[y][x] != ter_path) {
-      m->map[y][x] = ter_tree;
+  int i = y * map_x + x;
+  uint16_t j;
+
+  if (bits[i / 8] & (1 << (i % 8))) {
+    for (j = 0; list[j].x != x || list[j].y != y; j++)
+      ;
+    if (c) {
+      list[j].c = c;
+    } else {
+      list[j] = list[--num];
+      bits[i / 8] &= ~(1 << (i % 8));
     }
+    return;
   }
 
-  return 0;
+  if (!c) {
+    return;
+  }
+  if (num == size) {
+    size = size ? size * 2 : 16;
+    list = (occupant_t *) realloc(list, size * sizeof (*list));
+  }
+  list[num].x = x;
+  list[num].y = y;
+  list[num].c = c;
+  num++;
+  bits[i / 8] |= 1 << (i % 8);
 }
 
-void rand_pos(pair_t pos)
+/* Removes and returns what was saved of (x, y) when it was evicted */
+static map_delta_t *world_take_delta(int16_t x, int16_t y)
 {
-  pos[dim_x] = (rand() % (MAP_X - 2)) + 1;
-  pos[dim_y] = (rand() % (MAP_Y - 2)) + 1;
+  world_chunk_t *c;
+  map_delta_t *d;
+
+  if (!(c = world_chunk(x / WORLD_CHUNK, y / WORLD_CHUNK)) ||
+      !(d = c->delta[y % WORLD_CHUNK][x % WORLD_CHUNK])) {
+    return NULL;
+  }
+
+  c->delta[y % WORLD_CHUNK][x % WORLD_CHUNK] = NULL;
+  world.maps.num_evicted--;
+
+  return d;
 }
 
-void new_hiker()
+/* Frees every map, the characters on it, and the store itself */
+static void world_destroy()
 {
-  pair_t pos;
-  Npc *c;
-
-  do {
-    rand_pos(pos);
-  } while (world.hiker_dist[pos[dim_y]][pos[dim_x]] == INT_MAX ||
-           world.cur_map->cmap[pos[dim_y]][pos[dim_x]]         ||
-           pos[dim_x] < 3 || pos[dim_x] > MAP_X - 4            ||
-           pos[dim_y] < 3 || pos[dim_y] > MAP_Y - 4);
+  world_chunk_t *c;
+  uint32_t i;
+  int x, y;
 
-  world.cur_map->cmap[pos[dim_y]][pos[dim_x]] = c = new Npc;
-  c->pos[dim_y] = pos[dim_y];
-  c->pos[dim_x] = pos[dim_x];
-  c->ctype = char_hiker;
-  c->mtype = move_hiker;
-  c->dir[dim_x] = 0;
-  c->dir[dim_y] = 0;
-  c->defeated = 0;
-  c->symbol = 'h';
-  c->next_turn = 0;
-  heap_insert(&world.cur_map->turn, c);
+  for (i = 0; i < world.maps.size; i++) {
+    if (!(c = world.maps.table[i])) {
+      continue;
+    }
+    for (y = 0; y < WORLD_CHUNK; y++) {
+      for (x = 0; x < WORLD_CHUNK; x++) {
+        if (c->map[y][x]) {
+          npc_store_destroy(&c->map[y][x]->npcs);
+          map_sim_delete(c->map[y][x]);
+          c->map[y][x]->cmap.destroy();
+          free(c->map[y][x]);
+        }
+        free(c->delta[y][x]);
+      }
+    }
+    free(c);
+  }
 
-  //  printf("Hiker at %d,%d\n", pos[dim_x], pos[dim_y]);
+  free(world.maps.table);
+  memset(&world.maps, 0, sizeof (world.maps));
+  world.cur_map = NULL;
 }
 
-void new_rival()
+/**************************************************************************
+ * Map eviction.  Resident maps sit on an LRU list, and once they add up *
+ * to more than map_budget bytes, the least recently visited are boiled  *
+ * down to a map_delta_t: each trainer's position, direction, turn and    *
+ * whether they've been beaten, plus the map's encounter stream.  Going  *
+ * back rebuilds the terrain from the seed (or takes it from pregen) and *
+ * puts the trainers back where they were.  A trainer's Pokemon are made *
+ * from its own stream when it's first fought, so a trainer who was       *
+ * fought but not beaten has the same team, fully healed, after a trip    *
+ * through eviction.  The game has no item pickups, so there are none to  *
+ * save.                                                                  *
+ **************************************************************************/
+
+static void world_evict(Map *m)
 {
-  pair_t pos;
-  Npc *c;
-
-  do {
-    rand_pos(pos);
-  } while (world.rival_dist[pos[dim_y]][pos[dim_x]] == INT_MAX ||
-           world.rival_dist[pos[dim_y]][pos[dim_x]] < 0        ||
-           world.cur_map->cmap[pos[dim_y]][pos[dim_x]]         ||
-           pos[dim_x] < 3 || pos[dim_x] > MAP_X - 4            ||
-           pos[dim_y] < 3 || pos[dim_y] > MAP_Y - 4);
+  world_chunk_t *c;
+  map_delta_t *d;
+  npc_delta_t *r;
+  npc_store_t *s;
+  Character *ch;
+  Npc *n;
+  int i;
 
-  world.cur_map->cmap[pos[dim_y]][pos[dim_x]] = c = new Npc;
-  c->pos[dim_y] = pos[dim_y];
-  c->pos[dim_x] = pos[dim_x];
-  c->ctype = char_rival;
-  c->mtype = move_rival;
-  c->dir[dim_x] = 0;
-  c->dir[dim_y] = 0;
-  c->defeated = 0;
-  c->symbol = 'r';
-  c->next_turn = 0;
-  heap_insert(&world.cur_map->turn, c);
+  d = (map_delta_t *) malloc(sizeof (*d) + m->turn.size * sizeof (d->npc[0]));
+  d->encounter = m->encounter;
+  if (m->sim) {
+    d->offscreen = m->sim->rng;
+  }
+  d->num_trainers = m->num_trainers;
+  d->num_npcs = 0;
+  s = &m->npcs;
+  // In turn order, so ties still break the same way once it's rebuilt
+  while ((ch = turn_pop(&m->turn))) {
+    if (!(n = as_npc(ch))) {
+      continue;
+    }
+    r = d->npc + d->num_npcs++;
+    r->x = s->pos[n->slot][dim_x];
+    r->y = s->pos[n->slot][dim_y];
+    r->ctype = n->ctype;
+    r->mtype = s->mtype[n->slot];
+    r->dir[dim_x] = s->dir[n->slot][dim_x];
+    r->dir[dim_y] = s->dir[n->slot][dim_y];
+    r->defeated = s->defeated[n->slot];
+    r->symbol = n->symbol;
+    r->next_turn = n->next_turn;
+    r->rng = n->rng;
+    for (i = 0; i < 6; i++) {
+      delete n->pokemon[i];
+    }
+  }
+  npc_store_destroy(s);
+
+  world.maps.bytes -= map_bytes(m);
+  map_sim_delete(m);
+  lru_unlink(m);
+  c = world_chunk(m->x / WORLD_CHUNK, m->y / WORLD_CHUNK);
+  c->map[m->y % WORLD_CHUNK][m->x % WORLD_CHUNK] = NULL;
+  c->delta[m->y % WORLD_CHUNK][m->x % WORLD_CHUNK] = d;
+  world.maps.num_maps--;
+  world.maps.num_evicted++;
+  world.map_stats.evictions++;
+
+  m->cmap.destroy();
+  free(m);
 }
 
-void new_char_other()
+/* Puts an evicted map's trainers back on its freshly rebuilt terrain */
+static void world_restore(Map *m, map_delta_t *d)
 {
-  pair_t pos;
-  Npc *c;
+  npc_delta_t *r;
+  uint32_t i;
+  Npc *n;
 
-  do {
-    rand_pos(pos);
-  } while (world.rival_dist[pos[dim_y]][pos[dim_x]] == INT_MAX ||
-           world.rival_dist[pos[dim_y]][pos[dim_x]] < 0        ||
-           world.cur_map->cmap[pos[dim_y]][pos[dim_x]]         ||
-           pos[dim_x] < 3 || pos[dim_x] > MAP_X - 4            ||
-           pos[dim_y] < 3 || pos[dim_y] > MAP_Y - 4);
+  m->encounter = d->encounter;
+  if (m->sim) {
+    m->sim->rng = d->offscreen;
+  }
+  m->num_trainers = d->num_trainers;
+  for (i = 0; i < d->num_npcs; i++) {
+    r = d->npc + i;
+    n = npc_new(&m->npcs);
+    m->npcs.pos[n->slot][dim_x] = r->x;
+    m->npcs.pos[n->slot][dim_y] = r->y;
+    n->ctype = r->ctype;
+    m->npcs.mtype[n->slot] = r->mtype;
+    m->npcs.dir[n->slot][dim_x] = r->dir[dim_x];
+    m->npcs.dir[n->slot][dim_y] = r->dir[dim_y];
+    m->npcs.defeated[n->slot] = r->defeated;
+    n->symbol = r->symbol;
+    n->next_turn = r->next_turn;
+    n->rng = r->rng;
+    m->cmap[r->y][r->x] = n;
+    turn_schedule(&m->turn, n);
+  }
+}
 
-  world.cur_map->cmap[pos[dim_y]][pos[dim_x]] = c = new Npc;
-  c->pos[dim_y] = pos[dim_y];
-  c->pos[dim_x] = pos[dim_x];
-  c->ctype = char_other;
-  switch (rand() % 4) {
-  case 0:
-    c->mtype = move_pace;
-    c->symbol = 'p';
-    break;
-  case 1:
-    c->mtype = move_wander;
-    c->symbol = 'w';
-    break;
-  case 2:
-    c->mtype = move_sentry;
-    c->symbol = 's';
-    break;
-  case 3:
-    c->mtype = move_walk;
-    c->symbol = 'n';
-    break;
+/* Evicts the coldest maps until what's resident fits the budget.  The *
+ * current map is at the head of the list, so it's never evicted.      */
+static void world_trim()
+{
+  while (world.maps.bytes > world.map_budget &&
+         world.maps.lru_tail != world.cur_map) {
+    world_evict(world.maps.lru_tail);
   }
-  rand_dir(c->dir);
-  c->defeated = 0;
-  c->next_turn = 0;
-  heap_insert(&world.cur_map->turn, c);
 }
 
-void place_characters()
+/**************************************************************************
+ * Neighbour pre-generation.  While the PC is on a map, a worker thread  *
+ * runs generate_map() for its four neighbours, so crossing an edge only *
+ * has to pick up the finished map.  Characters are still placed on      *
+ * arrival, on the main thread, since they depend on where the PC is.    *
+ * Slots go empty -> queued -> running -> ready under pregen.lock, and a *
+ * map is only handed over once it's complete.  A neighbour that stops   *
+ * being one before it's claimed is thrown away; generation is pure, so  *
+ * it'll come out the same if it's ever needed again.                    *
+ **************************************************************************/
+
+#define PREGEN_SLOTS 8
+
+typedef enum pregen_state {
+  pregen_empty,
+  pregen_queued,
+  pregen_running,
+  pregen_ready,
+  pregen_cancelled
+} pregen_state_t;
+
+static struct {
+  std::thread worker;
+  std::mutex lock;
+  std::condition_variable work, done;
+  struct {
+    pregen_state_t state;
+    int16_t x, y;
+    Map *m;
+  } slot[PREGEN_SLOTS];
+  bool quit;
+} pregen;
+
+static void pregen_worker()
 {
-  world.cur_map->num_trainers = 2;
+  std::unique_lock<std::mutex> l(pregen.lock);
+  unsigned i;
+  Map *m;
+
+  while (!pregen.quit) {
+    for (i = 0; i < PREGEN_SLOTS && pregen.slot[i].state != pregen_queued; i++)
+      ;
+    if (i == PREGEN_SLOTS) {
+      pregen.work.wait(l);
+      continue;
+    }
 
-  //Always place a hiker and a rival, then place a random number of others
-  new_hiker();
-  new_rival();
-  do {
-    //higher probability of non- hikers and rivals
-    switch(rand() % 10) {
-    case 0:
-      new_hiker();
-      break;
-    case 1:
-     new_rival();
-      break;
-    default:
-      new_char_other();
-      break;
+    pregen.slot[i].state = pregen_running;
+    l.unlock();
+    m = generate_map(world.seed, pregen.slot[i].x, pregen.slot[i].y, NULL);
+    l.lock();
+
+    if (pregen.slot[i].state == pregen_cancelled) {
+      free(m);
+      pregen.slot[i].state = pregen_empty;
+    } else {
+      pregen.slot[i].m = m;
+      pregen.slot[i].state = pregen_ready;
+      pregen.done.notify_all();
     }
-  } while (++world.cur_map->num_trainers < MIN_TRAINERS ||
-           ((rand() % 100) < ADD_TRAINER_PROB));
+  }
+
+  mapgen_thread_exit();
 }
 
-void init_pc()
+static void pregen_start()
 {
-  int x, y;
-
-  do {
-    x = rand() % (MAP_X - 2) + 1;
-    y = rand() % (MAP_Y - 2) + 1;
-  } while (world.cur_map->map[y][x] != ter_path);
+  pregen.quit = false;
+  pregen.worker = std::thread(pregen_worker);
+}
 
-  world.pc.pos[dim_x] = x;
-  world.pc.pos[dim_y] = y;
-  world.pc.symbol = '@';
+static void pregen_stop()
+{
+  unsigned i;
 
-  world.cur_map->cmap[y][x] = &world.pc;
-  world.pc.next_turn = 0;
+  {
+    std::lock_guard<std::mutex> l(pregen.lock);
+    pregen.quit = true;
+  }
+  pregen.work.notify_all();
+  pregen.worker.join();
 
-  world.pc.bag[revive] = 5;
-  world.pc.bag[potion] = 10;
-  world.pc.bag[pokeball] = 10;
+  for (i = 0; i < PREGEN_SLOTS; i++) {
+    if (pregen.slot[i].state == pregen_ready) {
+      free(pregen.slot[i].m);
+    }
+    pregen.slot[i].state = pregen_empty;
+  }
+}
 
-  heap_insert(&world.cur_map->turn, &world.pc);
+static bool pregen_live(unsigned i)
+{
+  return (pregen.slot[i].state == pregen_queued  ||
+          pregen.slot[i].state == pregen_running ||
+          pregen.slot[i].state == pregen_ready);
 }
 
-void place_pc()
+/* The map at (x, y) if the worker has made it or is making it.  NULL if *
+ * it hasn't started, in which case making it here beats waiting.        */
+static Map *pregen_claim(int16_t x, int16_t y)
 {
-  Character *c;
+  std::unique_lock<std::mutex> l(pregen.lock);
+  unsigned i;
+  Map *m;
 
-  if (world.pc.pos[dim_x] == 1) {
-    world.pc.pos[dim_x] = MAP_X - 2;
-  } else if (world.pc.pos[dim_x] == MAP_X - 2) {
-    world.pc.pos[dim_x] = 1;
-  } else if (world.pc.pos[dim_y] == 1) {
-    world.pc.pos[dim_y] = MAP_Y - 2;
-  } else if (world.pc.pos[dim_y] == MAP_Y - 2) {
-    world.pc.pos[dim_y] = 1;
+  for (i = 0; i < PREGEN_SLOTS; i++) {
+    if (pregen_live(i) && pregen.slot[i].x == x && pregen.slot[i].y == y) {
+      break;
+    }
+  }
+  if (i == PREGEN_SLOTS) {
+    return NULL;
+  }
+  if (pregen.slot[i].state == pregen_queued) {
+    pregen.slot[i].state = pregen_empty;
+    return NULL;
   }
 
-  world.cur_map->cmap[world.pc.pos[dim_y]][world.pc.pos[dim_x]] = &world.pc;
+  while (pregen.slot[i].state == pregen_running) {
+    pregen.done.wait(l);
+  }
+  m = pregen.slot[i].m;
+  pregen.slot[i].state = pregen_empty;
 
-  if ((c = (Character *) heap_peek_min(&world.cur_map->turn))) {
-    world.pc.next_turn = c->next_turn;
-  } else {
-    world.pc.next_turn = 0;
+  return m;
+}
+
+/* Queues whichever neighbours of (x, y) don't exist yet, and drops *
+ * anything queued or made for a map that's no longer a neighbour.  */
+static void pregen_neighbors(int16_t x, int16_t y)
+{
+  static const int8_t dir[4][num_dims] = {
+    {  0, -1 }, {  0,  1 }, { -1,  0 }, {  1,  0 }
+  };
+  std::lock_guard<std::mutex> l(pregen.lock);
+  int16_t nx, ny;
+  unsigned i, j;
+
+  for (i = 0; i < PREGEN_SLOTS; i++) {
+    if (!pregen_live(i) ||
+        (abs(pregen.slot[i].x - x) + abs(pregen.slot[i].y - y) == 1 &&
+         !world_map(pregen.slot[i].x, pregen.slot[i].y))) {
+      continue;
+    }
+    if (pregen.slot[i].state == pregen_running) {
+      pregen.slot[i].state = pregen_cancelled;
+    } else {
+      if (pregen.slot[i].state == pregen_ready) {
+        free(pregen.slot[i].m);
+      }
+      pregen.slot[i].state = pregen_empty;
+    }
+  }
+
+  for (j = 0; j < 4; j++) {
+    nx = x + dir[j][dim_x];
+    ny = y + dir[j][dim_y];
+    if (nx < 0 || nx >= world_size || ny < 0 || ny >= world_size ||
+        world_map(nx, ny)) {
+      continue;
+    }
+    for (i = 0; i < PREGEN_SLOTS; i++) {
+      if (pregen_live(i) && pregen.slot[i].x == nx && pregen.slot[i].y == ny) {
+        break;
+      }
+    }
+    if (i != PREGEN_SLOTS) {
+      continue;
+    }
+    for (i = 0; pregen.slot[i].state != pregen_empty; i++)
+      ;
+    pregen.slot[i].state = pregen_queued;
+    pregen.slot[i].x = nx;
+    pregen.slot[i].y = ny;
   }
+
+  pregen.work.notify_one();
 }
 
 // New map expects cur_idx to refer to the index to be generated.  If that
@@ -842,78 +750,53 @@ void place_pc()
 // cur_map.
 int new_map(int teleport)
 {
-  int d, p;
-  int e, w, n, s;
-  int x, y;
-  
-  if (world.world[world.cur_idx[dim_y]][world.cur_idx[dim_x]]) {
-    world.cur_map = world.world[world.cur_idx[dim_y]][world.cur_idx[dim_x]];
-    place_pc();
+  map_delta_t *d;
+  Map *m;
 
-    return 0;
+  if (world.cur_map) {
+    world_sim_leave(world.cur_map);
   }
 
-  world.cur_map                                             =
-    world.world[world.cur_idx[dim_y]][world.cur_idx[dim_x]] =
-    (Map *) malloc(sizeof (*world.cur_map));
+  if ((m = world_map(world.cur_idx[dim_x], world.cur_idx[dim_y]))) {
+    world.cur_map = m;
+    lru_unlink(m);
+    lru_push(m);
+    world.map_stats.hits++;
+    place_pc();
+    pregen_neighbors(world.cur_idx[dim_x], world.cur_idx[dim_y]);
 
-  smooth_height(world.cur_map);
-  
-  if (!world.cur_idx[dim_y]) {
-    n = -1;
-  } else if (world.world[world.cur_idx[dim_y] - 1][world.cur_idx[dim_x]]) {
-    n = world.world[world.cur_idx[dim_y] - 1][world.cur_idx[dim_x]]->s;
-  } else {
-    n = 3 + rand() % (MAP_X - 6);
-  }
-  if (world.cur_idx[dim_y] == WORLD_SIZE - 1) {
-    s = -1;
-  } else if (world.world[world.cur_idx[dim_y] + 1][world.cur_idx[dim_x]]) {
-    s = world.world[world.cur_idx[dim_y] + 1][world.cur_idx[dim_x]]->n;
-  } else  {
-    s = 3 + rand() % (MAP_X - 6);
-  }
-  if (!world.cur_idx[dim_x]) {
-    w = -1;
-  } else if (world.world[world.cur_idx[dim_y]][world.cur_idx[dim_x] - 1]) {
-    w = world.world[world.cur_idx[dim_y]][world.cur_idx[dim_x] - 1]->e;
-  } else {
-    w = 3 + rand() % (MAP_Y - 6);
+    return 0;
   }
-  if (world.cur_idx[dim_x] == WORLD_SIZE - 1) {
-    e = -1;
-  } else if (world.world[world.cur_idx[dim_y]][world.cur_idx[dim_x] + 1]) {
-    e = world.world[world.cur_idx[dim_y]][world.cur_idx[dim_x] + 1]->w;
-  } else {
-    e = 3 + rand() % (MAP_Y - 6);
+
+  if (!(m = pregen_claim(world.cur_idx[dim_x], world.cur_idx[dim_y]))) {
+    m = generate_map(world.seed, world.cur_idx[dim_x], world.cur_idx[dim_y],
+                     NULL);
   }
-  
-  map_terrain(world.cur_map, n, s, e, w);
-     
-  place_boulders(world.cur_map);
-  place_trees(world.cur_map);
-  build_paths(world.cur_map);
-  d = (abs(world.cur_idx[dim_x] - (WORLD_SIZE / 2)) +
-       abs(world.cur_idx[dim_y] - (WORLD_SIZE / 2)));
-  p = d > 200 ? 5 : (50 - ((45 * d) / 200));
-  //  printf("d=%d, p=%d\n", d, p);
-  if ((rand() % 100) < p || !d) {
-    place_pokemart(world.cur_map);
-  }
-  if ((rand() % 100) < p || !d) {
-    place_center(world.cur_map);
-  }
-
-  for (y = 0; y < MAP_Y; y++) {
-    for (x = 0; x < MAP_X; x++) {
-      world.cur_map->cmap[y][x] = NULL;
-    }
+  d = world_take_delta(world.cur_idx[dim_x], world.cur_idx[dim_y]);
+  world.cur_map = m;
+  world_set_map(world.cur_idx[dim_x], world.cur_idx[dim_y], world.cur_map);
+  rng_seed(&world.cur_map->encounter, world.seed,
+           world.cur_idx[dim_x], world.cur_idx[dim_y], rng_encounter);
+  pathfind_invalidate();
+
+  turn_init(&world.cur_map->turn);
+  npc_store_init(&world.cur_map->npcs);
+  world.cur_map->sim = NULL;
+  if (world_sim_radius) {
+    map_sim_new(world.cur_map);
   }
 
-  heap_init(&world.cur_map->turn, cmp_char_turns, delete_character);
+  // Back before the PC, so arriving works as if it had never left
+  if (d) {
+    world_restore(world.cur_map, d);
+    free(d);
+    world.map_stats.rebuilt++;
+  } else {
+    world.map_stats.generated++;
+  }
 
-  if ((world.cur_idx[dim_x] == WORLD_SIZE / 2) &&
-      (world.cur_idx[dim_y] == WORLD_SIZE / 2)) {
+  if (!d && (world.cur_idx[dim_x] == world_size / 2) &&
+      (world.cur_idx[dim_y] == world_size / 2)) {
     init_pc();
   } else {
     place_pc();
@@ -921,10 +804,11 @@ int new_map(int teleport)
 
   pathfind(world.cur_map);
   if (teleport) {
+    pathfind_need(char_rival);
     do {
       world.cur_map->cmap[world.pc.pos[dim_y]][world.pc.pos[dim_x]] = NULL;
-      world.pc.pos[dim_x] = rand_range(1, MAP_X - 2);
-      world.pc.pos[dim_y] = rand_range(1, MAP_Y - 2);
+      world.pc.pos[dim_x] = rand_range(1, map_x - 2);
+      world.pc.pos[dim_y] = rand_range(1, map_y - 2);
     } while (world.cur_map->cmap[world.pc.pos[dim_y]][world.pc.pos[dim_x]] ||
              (move_cost[char_pc][world.cur_map->map[world.pc.pos[dim_y]]
                                                    [world.pc.pos[dim_x]]] ==
@@ -934,7 +818,12 @@ int new_map(int teleport)
     pathfind(world.cur_map);
   }
   
-  place_characters();
+  if (!d) {
+    place_characters();
+  }
+  world.maps.bytes += map_bytes(world.cur_map);
+  world_trim();
+  pregen_neighbors(world.cur_idx[dim_x], world.cur_idx[dim_y]);
 
   return 0;
 }
@@ -947,8 +836,8 @@ static void print_map()
 
   printf("\n\n\n");
 
-  for (y = 0; y < MAP_Y; y++) {
-    for (x = 0; x < MAP_X; x++) {
+  for (y = 0; y < map_y; y++) {
+    for (x = 0; x < map_x; x++) {
       if (world.cur_map->cmap[y][x]) {
         putchar(world.cur_map->cmap[y][x]->symbol);
       } else {
@@ -995,34 +884,45 @@ static void print_map()
 void init_world()
 {
   world.quit = 0;
-  world.cur_idx[dim_x] = world.cur_idx[dim_y] = WORLD_SIZE / 2;
+  world.seed = rand();
+  if (!world.map_budget) {
+    world.map_budget = (size_t) MAP_BUDGET * 1024 * 1024;
+  }
+  memset(&world.map_stats, 0, sizeof (world.map_stats));
+  world.hiker_dist.init(map_x, map_y);
+  world.rival_dist.init(map_x, map_y);
+  pregen_start();
+  if (world_sim_radius) {
+    world_sim_start();
+  }
+  world.cur_idx[dim_x] = world.cur_idx[dim_y] = world_size / 2;
   new_map(0);
 }
 
 void delete_world()
 {
-  int x, y;
+  pregen_stop();
+  if (world_sim_radius) {
+    world_sim_stop();
+  }
 
-  //Only correct because current game never leaves the initial map
-  //Need to iterate over all maps in 1.05+
-  heap_delete(&world.cur_map->turn);
+  world.map_stats.resident = world.maps.num_maps;
+  world.map_stats.evicted = world.maps.num_evicted;
+  // Every map's characters go with it, so this walks only what was visited
+  world_destroy();
 
-  for (y = 0; y < WORLD_SIZE; y++) {
-    for (x = 0; x < WORLD_SIZE; x++) {
-      if (world.world[y][x]) {
-        free(world.world[y][x]);
-        world.world[y][x] = NULL;
-      }
-    }
-  }
+  world.hiker_dist.destroy();
+  world.rival_dist.destroy();
 }
 
 void print_hiker_dist()
 {
   int x, y;
 
-  for (y = 0; y < MAP_Y; y++) {
-    for (x = 0; x < MAP_X; x++) {
+  pathfind_need(char_hiker);
+
+  for (y = 0; y < map_y; y++) {
+    for (x = 0; x < map_x; x++) {
       if (world.hiker_dist[y][x] == INT_MAX) {
         printf("   ");
       } else {
@@ -1037,8 +937,10 @@ void print_rival_dist()
 {
   int x, y;
 
-  for (y = 0; y < MAP_Y; y++) {
-    for (x = 0; x < MAP_X; x++) {
+  pathfind_need(char_rival);
+
+  for (y = 0; y < map_y; y++) {
+    for (x = 0; x < map_x; x++) {
       if (world.rival_dist[y][x] == INT_MAX || world.rival_dist[y][x] < 0) {
         printf("   ");
       } else {
@@ -1055,7 +957,7 @@ void leave_map(pair_t d)
     world.cur_idx[dim_x]--;
   } else if (d[dim_y] == 0) {
     world.cur_idx[dim_y]--;
-  } else if (d[dim_x] == MAP_X - 1) {
+  } else if (d[dim_x] == map_x - 1) {
     world.cur_idx[dim_x]++;
   } else {
     world.cur_idx[dim_y]++;
@@ -1071,10 +973,20 @@ void get_starter(){
   Pokemon *a;  
   Pokemon *b;
   Pokemon *c;
-
-  a = new Pokemon(1);
-  b = new Pokemon(1);
-  c = new Pokemon(1);
+  rng_t r;
+
+  rng_seed(&r, world.seed, world.cur_idx[dim_x], world.cur_idx[dim_y],
+           rng_starter);
+  a = new Pokemon(1, &r);
+  b = new Pokemon(1, &r);
+  c = new Pokemon(1, &r);
+
+  if (io_headless) {
+    world.pc.pokemon[0] = a;
+    delete b;
+    delete c;
+    return;
+  }
 
   clear();
   mvprintw(0, 0, "Please Select Your Starter!");
@@ -1099,62 +1011,765 @@ void get_starter(){
   }
 }
 
-void game_loop()
+/* The PC's turn, but for taking it off and putting it back on the turn *
+ * queue, which goes on whatever map it ends up on.                     */
+static void take_pc_turn()
 {
-  Character *c;
-  Npc *n;
-  Pc *p;
+  int32_t cost;
   pair_t d;
 
+  if (!io_headless) {
+    io_display();
+  }
+  io_handle_input(d);
+
+  world.cur_map->cmap[world.pc.pos[dim_y]][world.pc.pos[dim_x]] = NULL;
+  if (d[dim_x] == 0 || d[dim_x] == map_x - 1 ||
+      d[dim_y] == 0 || d[dim_y] == map_y - 1) {
+    leave_map(d);
+    d[dim_x] = world.pc.pos[dim_x];
+    d[dim_y] = world.pc.pos[dim_y];
+  }
+  world.cur_map->cmap[d[dim_y]][d[dim_x]] = &world.pc;
+
+  // Cheap when the PC hasn't moved or only stepped; see pathfind()
+  pathfind(world.cur_map);
+
+  cost = move_cost[char_pc][world.cur_map->map[d[dim_y]][d[dim_x]]];
+  world.pc.next_turn += cost;
+  // The rest of the world moves on by as much as the PC just spent
+  world_sim_pass(cost);
+
+  if ((world.pc.pos[dim_y] != d[dim_y] || world.pc.pos[dim_x] != d[dim_x]) &&
+      (world.cur_map->map[d[dim_y]][d[dim_x]] == ter_grass) &&
+      (rand() % 100 < ENCOUNTER_PROB)) {
+    io_encounter_pokemon();
+  }
+
+  world.pc.pos[dim_y] = d[dim_y];
+  world.pc.pos[dim_x] = d[dim_x];
+}
+
+/* Trainers on the PC's map move by the world's distance maps */
+static uint32_t take_cur_npc_turns(Character *c)
+{
+  move_ctx_t x = { world.cur_map, &world.hiker_dist, &world.rival_dist,
+                   NULL, false };
+
+  return take_npc_turns(&x, c);
+}
+
+/* Everything due next, up to the PC, or the PC's turn alone.  Returns *
+ * how many turns that was.                                            */
+static uint32_t take_turns()
+{
+  Character *c;
+  uint32_t n;
+
+  c = turn_pop_due(&world.cur_map->turn);
+  if (c == &world.pc) {
+    take_pc_turn();
+    n = 1;
+  } else {
+    n = take_cur_npc_turns(c);
+  }
+  turn_schedule_chain(&world.cur_map->turn, c);
+
+  return n;
+}
+
+void game_loop()
+{
   get_starter();
-  
+
   while (!world.quit) {
-    c = (Character *) heap_remove_min(&world.cur_map->turn);
-    n = dynamic_cast<Npc *> (c);
-    p = dynamic_cast<Pc *> (c);
-
-    move_func[n ? n->mtype : move_pc](c, d);
-
-    world.cur_map->cmap[c->pos[dim_y]][c->pos[dim_x]] = NULL;
-    if (p && (d[dim_x] == 0 || d[dim_x] == MAP_X - 1 ||
-              d[dim_y] == 0 || d[dim_y] == MAP_Y - 1)) {
-      leave_map(d);
-      d[dim_x] = c->pos[dim_x];
-      d[dim_y] = c->pos[dim_y];
+    take_turns();
+  }
+}
+
+/* Times one pathfind() in the given mode and saves the maps it made */
+static double timed_pathfind(pathfind_mode_t mode, int *hiker, int *rival)
+{
+  double t;
+
+  pathfind_mode = mode;
+  t = now();
+  pathfind(world.cur_map);
+  pathfind_need(char_hiker);
+  pathfind_need(char_rival);
+  t = now() - t;
+  memcpy(hiker, world.hiker_dist.cells, world.hiker_dist.bytes());
+  memcpy(rival, world.rival_dist.cells, world.rival_dist.bytes());
+
+  return t;
+}
+
+/* Differential test: every pathfind engine must produce exactly the same *
+ * distance maps.  The PC random-walks across each seed's starting map,   *
+ * with the occasional teleport, so the incremental engine sees the same  *
+ * sequence of moves it would in a game.                                  */
+static int test_pathfind(uint32_t seeds)
+{
+  MapArray<int> hiker[num_pathfind_modes], rival[num_pathfind_modes];
+  double t[num_pathfind_modes] = { 0 };
+  uint32_t seed, fail, calls;
+  int i, j, d;
+  pair_t next;
+
+  for (j = 0; j < num_pathfind_modes; j++) {
+    hiker[j].init(map_x, map_y);
+    rival[j].init(map_x, map_y);
+  }
+
+  for (calls = fail = 0, seed = 1; seed <= seeds; seed++) {
+    srand(seed);
+    init_world();
+    for (i = 0; i < 64; i++) {
+      if (i % 16 == 15) {
+        do {
+          rand_pos(next);
+        } while (move_cost[char_pc][world.cur_map->map[next[dim_y]]
+                                                      [next[dim_x]]] ==
+                 INT_MAX);
+      } else {
+        do {
+          d = rand() & 0x7;
+          next[dim_x] = world.pc.pos[dim_x] + all_dirs[d][dim_x];
+          next[dim_y] = world.pc.pos[dim_y] + all_dirs[d][dim_y];
+        } while (next[dim_x] < 1 || next[dim_x] > map_x - 2 ||
+                 next[dim_y] < 1 || next[dim_y] > map_y - 2 ||
+                 move_cost[char_pc][world.cur_map->map[next[dim_y]]
+                                                      [next[dim_x]]] ==
+                 INT_MAX);
+      }
+      world.pc.pos[dim_x] = next[dim_x];
+      world.pc.pos[dim_y] = next[dim_y];
+      for (j = 0; j < num_pathfind_modes; j++) {
+        t[j] += timed_pathfind((pathfind_mode_t) j, hiker[j].cells,
+                               rival[j].cells);
+      }
+      calls++;
+      for (j = 1; j < num_pathfind_modes; j++) {
+        if (memcmp(hiker[0].cells, hiker[j].cells, hiker[0].bytes()) ||
+            memcmp(rival[0].cells, rival[j].cells, rival[0].bytes())) {
+          printf("seed %u: mode %d differs with PC at %d,%d\n",
+                 seed, j, world.pc.pos[dim_x], world.pc.pos[dim_y]);
+          fail++;
+          break;
+        }
+      }
+      if (j != num_pathfind_modes) {
+        break;
+      }
+    }
+    delete_world();
+  }
+
+  printf("%u seeds, %u failed\n", seeds, fail);
+  printf("us per pathfind(): heap %.1f, bucket %.1f, incremental %.1f\n",
+         t[pathfind_mode_heap] * 1e6 / calls,
+         t[pathfind_mode_bucket] * 1e6 / calls,
+         t[pathfind_mode_incremental] * 1e6 / calls);
+
+  for (j = 0; j < num_pathfind_modes; j++) {
+    hiker[j].destroy();
+    rival[j].destroy();
+  }
+
+  return fail ? 1 : 0;
+}
+
+/* Cold is a full CSV parse (which also rewrites the cache), serial *
+ * and then on every core; warm is the same load from that cache.    */
+static int time_db()
+{
+  double serial, parallel, warm;
+  db_source_t source;
+
+  db_parse_threads = 1;
+  serial = now();
+  db_parse(false, false);
+  serial = now() - serial;
+
+  db_parse_threads = 0;
+  parallel = now();
+  db_parse(false, false);
+  parallel = now() - parallel;
+
+  warm = now();
+  source = db_parse(false);
+  warm = now() - warm;
+
+  printf("db_parse(): cold (CSV) %.1f ms serial, %.1f ms on %u threads, "
+         "warm (%s) %.1f ms\n", serial * 1e3, parallel * 1e3,
+         std::thread::hardware_concurrency(),
+         source == db_source_cache ? "cache" : "CSV", warm * 1e3);
+
+  return source == db_source_cache ? 0 : 1;
+}
+
+/* Terrain generation alone, over a spread of coordinates */
+static int bench_maps(uint32_t n)
+{
+  mapgen_stats_t stats;
+  double t;
+  uint32_t i;
+#ifdef COUNT_ALLOCS
+  uint64_t allocs;
+
+  allocs = malloc_count;
+#endif
+
+  world.seed = 1;
+  memset(&stats, 0, sizeof (stats));
+
+  t = now();
+  for (i = 0; i < n; i++) {
+    free(generate_map(world.seed, i % world_size,
+                      (i / world_size) % world_size, &stats));
+  }
+  t = now() - t;
+
+  printf("%u maps in %.1f ms, %.0f maps/s", n, t * 1e3, n / t);
+#ifdef COUNT_ALLOCS
+  allocs = malloc_count - allocs;
+  printf(", %.1f allocations per map", (double) allocs / n);
+#endif
+  printf("\n");
+  printf("%u paths by %s in %.1f ms, %.1f cells expanded per path\n",
+         stats.paths, mapgen_astar ? "A*" : "Dijkstra",
+         stats.stage[mapgen_paths] * 1e3,
+         stats.paths ? (double) stats.expanded / stats.paths : 0.0);
+
+  return 0;
+}
+
+/* Checks gaussian_smooth() against the reference on random heights, *
+ * from map size up, and times both.                                  */
+static int bench_smooth()
+{
+  static const int size[][2] = {
+    { map_x, map_y }, { 1, 1 }, { 3, 2 }, { 7, 5 },
+    { 256, 256 }, { 1024, 1024 }, { 4096, 4096 }
+  };
+  uint8_t *in, *fast, *slow;
+  int32_t *scratch;
+  double t[2];
+  int i, j, reps, fail;
+  bool same;
+  size_t n;
+
+  srand(1);
+  for (fail = i = 0; i < (int) (sizeof (size) / sizeof (size[0])); i++) {
+    n = (size_t) size[i][0] * size[i][1];
+    in = (uint8_t *) malloc(n);
+    fast = (uint8_t *) malloc(n);
+    slow = (uint8_t *) malloc(n);
+    scratch = (int32_t *) malloc(SMOOTH_SCRATCH(size[i][0]) *
+                                 sizeof (*scratch));
+    for (j = 0; j < (int) n; j++) {
+      in[j] = rand();
     }
-    world.cur_map->cmap[d[dim_y]][d[dim_x]] = c;
+    reps = n < (1 << 22) ? (1 << 22) / n : 1;
 
-    if (p) {
-      // Performance bug - pathfinding runs twice after generating a new map
-      pathfind(world.cur_map);
+    t[0] = now();
+    for (j = 0; j < reps; j++) {
+      gaussian_smooth_reference(in, slow, size[i][0], size[i][1]);
     }
+    t[0] = now() - t[0];
+    t[1] = now();
+    for (j = 0; j < reps; j++) {
+      gaussian_smooth(in, fast, size[i][0], size[i][1], scratch);
+    }
+    t[1] = now() - t[1];
+
+    same = !memcmp(fast, slow, n);
+    fail += !same;
+    printf("%4dx%-4d scalar %7.1f Mpixel/s, vector %7.1f Mpixel/s, %s\n",
+           size[i][0], size[i][1], n * reps / t[0] / 1e6,
+           n * reps / t[1] / 1e6, same ? "same" : "DIFFERS");
+
+    free(in);
+    free(fast);
+    free(slow);
+    free(scratch);
+  }
+
+  return fail ? 1 : 0;
+}
+
+/* Constructor throughput, including each species' first appearance */
+static int bench_pokemon(uint32_t n)
+{
+  double t;
+  uint32_t i;
+  rng_t r;
+
+  db_parse(false);
+  rng_seed(&r, 1, 0, 0, rng_encounter);
+
+  t = now();
+  for (i = 0; i < n; i++) {
+    delete new Pokemon(rng_rand(&r) % 100 + 1, &r);
+  }
+  t = now() - t;
+
+  printf("%u Pokemon in %.1f ms, %.3f us each\n", n, t * 1e3, t * 1e6 / n);
+
+  return 0;
+}
+
+/* Who bench_turns() is scheduling, and the order each was last queued */
+static Npc *bench_npc;
+static uint32_t *bench_seq;
+
+/* How the game ordered turns before the wheel */
+static int32_t cmp_turn(const void *key, const void *with)
+{
+  return ((Character *) key)->next_turn - ((Character *) with)->next_turn;
+}
+
+/* Ties go to whoever was queued first, as on the wheel */
+static int32_t cmp_turn_seq(const void *key, const void *with)
+{
+  uint32_t a, b;
+
+  if (((Character *) key)->next_turn != ((Character *) with)->next_turn) {
+    return cmp_turn(key, with);
+  }
+  a = bench_seq[(Npc *) key - bench_npc];
+  b = bench_seq[(Npc *) with - bench_npc];
+
+  return (a > b) - (a < b);
+}
+
+/* Takes actions turns, off h or, if it's NULL, off q.  Returns seconds; *
+ * who moved, in order, is hashed into hash.                             */
+static double run_turns(heap_t *h, turn_queue_t *q, uint32_t n,
+                        const uint8_t *cost, uint32_t actions, uint64_t *hash)
+{
+  Character *c;
+  uint32_t i, seq;
+  double t;
+
+  for (seq = 0; seq < n; seq++) {
+    bench_npc[seq].next_turn = 0;
+    bench_seq[seq] = seq;
+    if (h) {
+      heap_insert(h, bench_npc + seq);
+    } else {
+      turn_schedule(q, bench_npc + seq);
+    }
+  }
+
+  *hash = 5381;
+  t = now();
+  for (i = 0; i < actions; i++) {
+    c = h ? (Character *) heap_remove_min(h) : turn_pop(q);
+    *hash = *hash * 33 + ((Npc *) c - bench_npc);
+    c->next_turn += cost[i];
+    bench_seq[(Npc *) c - bench_npc] = seq++;
+    if (h) {
+      heap_insert(h, c);
+    } else {
+      turn_schedule(q, c);
+    }
+  }
+  t = now() - t;
+
+  while (h ? heap_remove_min(h) : turn_pop(q))
+    ;
+
+  return t;
+}
+
+/* Turn scheduling alone, with 10 to 10,000 trainers each paying a move  *
+ * cost per turn, on the heap the game used to use and on the wheel.     *
+ * The wheel has to pick exactly who a heap ordered by turn, then by     *
+ * scheduling order, picks.                                              */
+static int bench_turns(uint32_t actions)
+{
+  static const uint32_t count[] = { 10, 100, 1000, 10000 };
+  static const uint8_t step[] = { 10, 15, 20, 50 };
+  uint64_t want, got, old;
+  turn_queue_t *q;
+  heap_pool_t pool;
+  uint8_t *cost;
+  double t[2];
+  uint32_t i;
+  heap_t h;
+  int fail;
+
+  srand(1);
+  cost = (uint8_t *) malloc(actions);
+  for (i = 0; i < actions; i++) {
+    cost[i] = step[rand() & 0x3];
+  }
+  q = (turn_queue_t *) malloc(sizeof (*q));
+  heap_pool_init(&pool);
+
+  for (fail = i = 0; i < sizeof (count) / sizeof (count[0]); i++) {
+    bench_npc = new Npc[count[i]];
+    bench_seq = (uint32_t *) malloc(count[i] * sizeof (*bench_seq));
+
+    heap_init_pool(&h, cmp_turn_seq, NULL, &pool);
+    run_turns(&h, NULL, count[i], cost, actions, &want);
+    heap_delete(&h);
+
+    heap_init_pool(&h, cmp_turn, NULL, &pool);
+    t[0] = run_turns(&h, NULL, count[i], cost, actions, &old);
+    heap_delete(&h);
+
+    turn_init(q);
+    t[1] = run_turns(NULL, q, count[i], cost, actions, &got);
+
+    fail += got != want;
+    printf("%5u trainers: heap %6.2f M actions/s, wheel %6.2f M actions/s, "
+           "%s%s\n", count[i], actions / t[0] / 1e6, actions / t[1] / 1e6,
+           got == want ? "same order" : "ORDER DIFFERS",
+           old == want ? "" : " (heap ties differ)");
+
+    delete [] bench_npc;
+    free(bench_seq);
+  }
+
+  heap_pool_destroy(&pool);
+  free(q);
+  free(cost);
+
+  return fail ? 1 : 0;
+}
+
+/* Hardware cache events counted over a simulation, in this thread only, *
+ * so map generation on the pregen threads stays out of them.  Many VMs  *
+ * don't expose the PMU at all; those report the counters unavailable.   */
+static const struct {
+  uint32_t type;
+  uint64_t config;
+  const char *name;
+} sim_counter[] = {
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES, "cache references" },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES,     "cache misses" },
+  { PERF_TYPE_HW_CACHE, (PERF_COUNT_HW_CACHE_L1D |
+                         PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                         PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+    "L1D read misses" },
+};
+
+#define SIM_COUNTERS (sizeof (sim_counter) / sizeof (sim_counter[0]))
+
+static void sim_counters_start(int *fd)
+{
+  struct perf_event_attr a;
+  uint32_t i;
+
+  for (i = 0; i < SIM_COUNTERS; i++) {
+    memset(&a, 0, sizeof (a));
+    a.size = sizeof (a);
+    a.type = sim_counter[i].type;
+    a.config = sim_counter[i].config;
+    a.exclude_kernel = 1;
+    a.exclude_hv = 1;
+    fd[i] = syscall(SYS_perf_event_open, &a, 0, -1, -1, 0);
+  }
+}
+
+static void sim_counters_stop(int *fd)
+{
+  uint32_t i;
+
+  for (i = 0; i < SIM_COUNTERS; i++) {
+    if (fd[i] >= 0) {
+      ioctl(fd[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+  }
+}
+
+static void sim_counters_report(int *fd, uint64_t turns)
+{
+  uint64_t v;
+  uint32_t i;
+
+  for (i = 0; i < SIM_COUNTERS; i++) {
+    if (fd[i] < 0 || read(fd[i], &v, sizeof (v)) != sizeof (v)) {
+      printf("  %-16s unavailable\n", sim_counter[i].name);
+    } else {
+      printf("  %-16s %12lu, %.2f per turn\n", sim_counter[i].name, v,
+             turns ? (double) v / turns : 0.0);
+    }
+    if (fd[i] >= 0) {
+      close(fd[i]);
+    }
+  }
+}
+
+/* One batch of turns in SIM_SAMPLE has its queue operations timed.  *
+ * A pop is quicker than reading the clock, so each is followed by    *
+ * timing nothing at all, and that's taken back off.  Samples longer  *
+ * than SIM_PREEMPTED seconds were interrupted and are thrown out.    */
+#define SIM_SAMPLE    16
+#define SIM_PREEMPTED 2e-6
+
+/**************************************************************************
+ * The game with nobody playing it, for profiling and soak testing.  It  *
+ * runs the real game loop with io_headless set, so the PC walks by      *
+ * itself and nothing is drawn, for limit turns (every character's turn  *
+ * counts, and the last tick is finished), or for limit seconds if it     *
+ * ends in 's'.                                                           *
+ **************************************************************************/
+static int simulate(const char *limit, uint32_t seed, const char *script)
+{
+  uint64_t turns, pc_turns, max_turns, batches, samples;
+  double t, queue, seconds, s[6];
+  int counter[SIM_COUNTERS];
+  pathfind_stats_t pathfind;
+  Character *c;
+  bool sample;
+  char *end;
 
-    c->next_turn += move_cost[n ? n->ctype : char_pc]
-                             [world.cur_map->map[d[dim_y]][d[dim_x]]];
+  seconds = strtod(limit, &end);
+  if (*end == 's') {
+    max_turns = UINT64_MAX;
+  } else {
+    max_turns = strtoull(limit, NULL, 10);
+    seconds = 0;
+  }
+
+  srand(seed);
+  io_headless = true;
+  io_script = script;
+  db_parse(false);
+  init_world();
+  get_starter();
 
-    if (p && (c->pos[dim_y] != d[dim_y] || c->pos[dim_x] != d[dim_x]) &&
-        (world.cur_map->map[d[dim_y]][d[dim_x]] == ter_grass) &&
-        (rand() % 100 < ENCOUNTER_PROB)) {
-      io_encounter_pokemon();
+  /* Setup already pathfound for the first map; count only the run */
+  pathfind = pathfind_stats;
+  queue = 0;
+  samples = 0;
+  sim_counters_start(counter);
+  t = now();
+  for (turns = pc_turns = batches = 0;
+       turns < max_turns && !world.quit;
+       batches++) {
+    sample = !(batches % SIM_SAMPLE);
+    if (sample) {
+      s[0] = now();
+    }
+    c = turn_pop_due(&world.cur_map->turn);
+    if (sample) {
+      s[1] = now();
+      s[2] = now();
+    }
+    if (c == &world.pc) {
+      take_pc_turn();
+      turns++;
+      pc_turns++;
+    } else {
+      turns += take_cur_npc_turns(c);
+    }
+    if (sample) {
+      s[3] = now();
+    }
+    turn_schedule_chain(&world.cur_map->turn, c);
+    if (!sample) {
+      continue;
     }
-    
-    c->pos[dim_y] = d[dim_y];
-    c->pos[dim_x] = d[dim_x];
+    s[4] = now();
+    s[5] = now();
+    if (s[5] - s[3] + s[2] - s[0] < SIM_PREEMPTED) {
+      queue += (s[1] - s[0]) - (s[2] - s[1]) + (s[4] - s[3]) - (s[5] - s[4]);
+      samples++;
+    }
+    if (seconds && !(batches % 1024) && now() - t >= seconds) {
+      batches++;
+      break;
+    }
+  }
+  t = now() - t;
+  sim_counters_stop(counter);
+  queue = samples ? queue * batches / samples : 0;
+
+  printf("%lu turns (%lu by the PC) in %.2f s, %.0f turns/s\n",
+         turns, pc_turns, t, turns / t);
+  pathfind.seconds = pathfind_stats.seconds - pathfind.seconds;
+  pathfind.computed = pathfind_stats.computed - pathfind.computed;
+  pathfind.requested = pathfind_stats.requested - pathfind.requested;
+  printf("  pathfinding %8.1f ms %5.1f%%, %u of %u distance maps computed\n",
+         pathfind.seconds * 1e3, 100 * pathfind.seconds / t,
+         pathfind.computed, pathfind.requested);
+  printf("  turn queue  %8.1f ms %5.1f%% (sampled)\n",
+         queue * 1e3, 100 * queue / t);
+  printf("  %u maps generated, %u revisited; %u battles, %u wild Pokemon\n",
+         world.map_stats.generated,
+         world.map_stats.hits + world.map_stats.rebuilt,
+         io_headless_stats.battles, io_headless_stats.encounters);
+  if (world_sim_radius) {
+    printf("  living world %7.1f ms %5.1f%%, radius %d on %u threads\n",
+           world_sim_stats.seconds * 1e3, 100 * world_sim_stats.seconds / t,
+           world_sim_radius, world_sim_threads);
+    printf("    %u steps, %lu maps run for %lu map-ticks, %.0f map-ticks/s\n",
+           world_sim_stats.steps, world_sim_stats.maps,
+           world_sim_stats.map_ticks,
+           world_sim_stats.seconds ?
+           world_sim_stats.map_ticks / world_sim_stats.seconds : 0.0);
+    printf("    %lu trainer turns off screen, %lu maps stolen\n",
+           world_sim_stats.turns, world_sim_stats.steals);
+  }
+  sim_counters_report(counter, turns);
+
+  delete_world();
+
+  return 0;
+}
+
+/* What main() was asked to do; the options that pick one may only    *
+ * appear once, while the rest can be given around them in any order. */
+typedef enum run_mode {
+  run_game,
+  run_test_pathfind,
+  run_bench_maps,
+  run_bench_smooth,
+  run_bench_pokemon,
+  run_bench_turns,
+  run_time_db,
+  run_sim
+} run_mode_t;
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [--astar-paths] [--map-size WxH] "
+          "[--world-size N] [--map-budget MB]\n"
+          "       [--living-world R] [--living-threads N]\n"
+          "       [--test-pathfind [n] | --bench-maps [n] | --bench-smooth |\n"
+          "        --bench-pokemon [n] | --bench-turns [n] | --time-db |\n"
+          "        --sim LIMIT[s] [seed [script]] | seed]\n"
+          "Options may be given in any order.\n", name);
+  exit(1);
+}
 
-    heap_insert(&world.cur_map->turn, c);
+/* The argument after argv[*i], if there is one and it isn't an option */
+static char *optional_arg(int argc, char *argv[], int *i)
+{
+  if (*i + 1 < argc && argv[*i + 1][0] != '-') {
+    return argv[++*i];
   }
+
+  return NULL;
+}
+
+static uint32_t optional_count(int argc, char *argv[], int *i, uint32_t def)
+{
+  char *arg;
+
+  return (arg = optional_arg(argc, argv, i)) ? atoi(arg) : def;
 }
 
 int main(int argc, char *argv[])
 {
   struct timeval tv;
-  uint32_t seed;
-  //  char c;
-  //  int x, y;
+  uint32_t seed, n;
+  int32_t x, y;
+  char c, *sim_limit, *sim_seed, *sim_script;
+  bool have_seed, have_threads;
+  run_mode_t mode;
+  int i;
 
-  if (argc == 2) {
-    seed = atoi(argv[1]);
-  } else {
+  mode = run_game;
+  n = 0;
+  seed = 0;
+  sim_limit = sim_seed = sim_script = NULL;
+  have_seed = have_threads = false;
+
+  for (i = 1; i < argc; i++) {
+    if (argv[i][0] != '-') {
+      if (have_seed || sscanf(argv[i], "%u%c", &seed, &c) != 1) {
+        usage(argv[0]);
+      }
+      have_seed = true;
+    } else if (!strcmp(argv[i], "--astar-paths")) {
+      mapgen_astar = true;
+    } else if (i + 1 < argc && !strcmp(argv[i], "--map-size")) {
+      if (sscanf(argv[++i], "%dx%d", &x, &y) != 2 ||
+          mapgen_set_size(x, y, world_size)) {
+        fprintf(stderr, "Map size is WxH, from %dx%d up to %dx%d.\n",
+                MAP_MIN_X, MAP_MIN_Y, MAP_MAX, MAP_MAX);
+        return 1;
+      }
+    } else if (i + 1 < argc && !strcmp(argv[i], "--world-size")) {
+      if (mapgen_set_size(map_x, map_y, atoi(argv[++i]))) {
+        fprintf(stderr, "World size is from 2 up to %d maps a side.\n",
+                WORLD_MAX);
+        return 1;
+      }
+    } else if (i + 1 < argc && !strcmp(argv[i], "--map-budget")) {
+      if (sscanf(argv[++i], "%d%c", &x, &c) != 1 || x <= 0) {
+        fprintf(stderr, "Map budget is a whole number of MB, at least 1.\n");
+        return 1;
+      }
+      world.map_budget = (size_t) x * 1024 * 1024;
+    } else if (i + 1 < argc && !strcmp(argv[i], "--living-world")) {
+      world_sim_radius = atoi(argv[++i]);
+    } else if (i + 1 < argc && !strcmp(argv[i], "--living-threads")) {
+      world_sim_threads = atoi(argv[++i]);
+      have_threads = true;
+    } else if (mode != run_game) {
+      usage(argv[0]);
+    } else if (!strcmp(argv[i], "--test-pathfind")) {
+      mode = run_test_pathfind;
+      n = optional_count(argc, argv, &i, 1000);
+    } else if (!strcmp(argv[i], "--bench-maps")) {
+      mode = run_bench_maps;
+      n = optional_count(argc, argv, &i, 10000);
+    } else if (!strcmp(argv[i], "--bench-smooth")) {
+      mode = run_bench_smooth;
+    } else if (!strcmp(argv[i], "--bench-pokemon")) {
+      mode = run_bench_pokemon;
+      n = optional_count(argc, argv, &i, 1000000);
+    } else if (!strcmp(argv[i], "--bench-turns")) {
+      mode = run_bench_turns;
+      n = optional_count(argc, argv, &i, 10000000);
+    } else if (!strcmp(argv[i], "--time-db")) {
+      mode = run_time_db;
+    } else if (i + 1 < argc && !strcmp(argv[i], "--sim")) {
+      mode = run_sim;
+      sim_limit = argv[++i];
+      if ((sim_seed = optional_arg(argc, argv, &i))) {
+        sim_script = optional_arg(argc, argv, &i);
+      }
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  if (mode != run_game && have_seed) {
+    usage(argv[0]);
+  }
+
+  /* A living world runs on every core unless told otherwise */
+  if (world_sim_radius && !have_threads) {
+    world_sim_threads = std::thread::hardware_concurrency();
+  }
+
+  switch (mode) {
+  case run_test_pathfind:
+    return test_pathfind(n);
+  case run_bench_maps:
+    return bench_maps(n);
+  case run_bench_smooth:
+    return bench_smooth();
+  case run_bench_pokemon:
+    return bench_pokemon(n);
+  case run_bench_turns:
+    return bench_turns(n);
+  case run_time_db:
+    return time_db();
+  case run_sim:
+    return simulate(sim_limit, sim_seed ? atoi(sim_seed) : 1, sim_script);
+  case run_game:
+    break;
+  }
+
+  if (!have_seed) {
     gettimeofday(&tv, NULL);
     seed = (tv.tv_usec ^ (tv.tv_sec << 20)) & 0xffffffff;
   }
@@ -1175,12 +1790,12 @@ int main(int argc, char *argv[])
     print_map();  
     printf("Current position is %d%cx%d%c (%d,%d).  "
            "Enter command: ",
-           abs(world.cur_idx[dim_x] - (WORLD_SIZE / 2)),
-           world.cur_idx[dim_x] - (WORLD_SIZE / 2) >= 0 ? 'E' : 'W',
-           abs(world.cur_idx[dim_y] - (WORLD_SIZE / 2)),
-           world.cur_idx[dim_y] - (WORLD_SIZE / 2) <= 0 ? 'N' : 'S',
-           world.cur_idx[dim_x] - (WORLD_SIZE / 2),
-           world.cur_idx[dim_y] - (WORLD_SIZE / 2));
+           abs(world.cur_idx[dim_x] - (world_size / 2)),
+           world.cur_idx[dim_x] - (world_size / 2) >= 0 ? 'E' : 'W',
+           abs(world.cur_idx[dim_y] - (world_size / 2)),
+           world.cur_idx[dim_y] - (world_size / 2) <= 0 ? 'N' : 'S',
+           world.cur_idx[dim_x] - (world_size / 2),
+           world.cur_idx[dim_y] - (world_size / 2));
     scanf(" %c", &c);
     switch (c) {
     case 'n':
@@ -1190,13 +1805,13 @@ int main(int argc, char *argv[])
       }
       break;
     case 's':
-      if (world.cur_idx[dim_y] < WORLD_SIZE - 1) {
+      if (world.cur_idx[dim_y] < world_size - 1) {
         world.cur_idx[dim_y]++;
         new_map();
       }
       break;
     case 'e':
-      if (world.cur_idx[dim_x] < WORLD_SIZE - 1) {
+      if (world.cur_idx[dim_x] < world_size - 1) {
         world.cur_idx[dim_x]++;
         new_map();
       }
@@ -1211,10 +1826,10 @@ int main(int argc, char *argv[])
       break;
     case 'f':
       scanf(" %d %d", &x, &y);
-      if (x >= -(WORLD_SIZE / 2) && x <= WORLD_SIZE / 2 &&
-          y >= -(WORLD_SIZE / 2) && y <= WORLD_SIZE / 2) {
-        world.cur_idx[dim_x] = x + (WORLD_SIZE / 2);
-        world.cur_idx[dim_y] = y + (WORLD_SIZE / 2);
+      if (x >= -(world_size / 2) && x <= world_size / 2 &&
+          y >= -(world_size / 2) && y <= world_size / 2) {
+        world.cur_idx[dim_x] = x + (world_size / 2);
+        world.cur_idx[dim_y] = y + (world_size / 2);
         new_map();
       }
       break;
@@ -1235,6 +1850,18 @@ int main(int argc, char *argv[])
   delete_world();
 
   io_reset_terminal();
+
+  printf("Distance maps: %u invalidated, %u computed, %u avoided\n",
+         pathfind_stats.requested, pathfind_stats.computed,
+         pathfind_stats.requested - pathfind_stats.computed);
+  printf("Maps: %u resident, %u evicted (%u evictions), %u generated; "
+         "revisits: %u hits, %u rebuilt, %.1f%% hit rate\n",
+         world.map_stats.resident, world.map_stats.evicted,
+         world.map_stats.evictions, world.map_stats.generated,
+         world.map_stats.hits, world.map_stats.rebuilt,
+         world.map_stats.hits + world.map_stats.rebuilt ?
+         100.0 * world.map_stats.hits /
+         (world.map_stats.hits + world.map_stats.rebuilt) : 100.0);
   
   return 0;
 }
@@ -1,8 +1,11 @@
 #include <limits.h>
+#include <string.h>
+#include <vector>
 
 #include "character.h"
 #include "poke327.h"
 #include "io.h"
+#include "timing.h"
 
 /***********************************************************************
  * Hack: Avoid the "path to a building" issue by making building cells *
@@ -25,437 +28,763 @@ const char *char_type_name[num_character_types] = {
   "Trainer",
 };
 
-static void move_hiker_func(Character *c, pair_t dest)
+static void move_hiker_func(move_ctx_t *x, int i, pair_t dest)
 {
+  int16_t *pos = x->m->npcs.pos[i];
   int min;
   int base;
-  int i;
+  int d;
 
-  base = rand() & 0x7;
+  if (!x->offscreen) {
+    pathfind_need(char_hiker);
+  }
+  base = move_rand(x) & 0x7;
 
-  dest[dim_x] = c->pos[dim_x];
-  dest[dim_y] = c->pos[dim_y];
+  dest[dim_x] = pos[dim_x];
+  dest[dim_y] = pos[dim_y];
   min = INT_MAX;
   
-  for (i = base; i < 8 + base; i++) {
-    if ((world.hiker_dist[c->pos[dim_y] + all_dirs[i & 0x7][dim_y]]
-                         [c->pos[dim_x] + all_dirs[i & 0x7][dim_x]] <=
+  // Ties go to the last found, but never onto anything impassable, or a
+  // battle that cuts the search short could leave the hiker on a boulder
+  for (d = base; d < 8 + base; d++) {
+    if (((*x->hiker_dist)[pos[dim_y] + all_dirs[d & 0x7][dim_y]]
+                         [pos[dim_x] + all_dirs[d & 0x7][dim_x]] <=
          min) &&
-        !world.cur_map->cmap[c->pos[dim_y] + all_dirs[i & 0x7][dim_y]]
-                            [c->pos[dim_x] + all_dirs[i & 0x7][dim_x]]) {
-      dest[dim_x] = c->pos[dim_x] + all_dirs[i & 0x7][dim_x];
-      dest[dim_y] = c->pos[dim_y] + all_dirs[i & 0x7][dim_y];
-      min = world.hiker_dist[dest[dim_y]][dest[dim_x]];
+        ((*x->hiker_dist)[pos[dim_y] + all_dirs[d & 0x7][dim_y]]
+                         [pos[dim_x] + all_dirs[d & 0x7][dim_x]] !=
+         INT_MAX) &&
+        !x->m->cmap[pos[dim_y] + all_dirs[d & 0x7][dim_y]]
+                   [pos[dim_x] + all_dirs[d & 0x7][dim_x]]) {
+      dest[dim_x] = pos[dim_x] + all_dirs[d & 0x7][dim_x];
+      dest[dim_y] = pos[dim_y] + all_dirs[d & 0x7][dim_y];
+      min = (*x->hiker_dist)[dest[dim_y]][dest[dim_x]];
     }
-    if (world.hiker_dist[c->pos[dim_y] + all_dirs[i & 0x7][dim_y]]
-                        [c->pos[dim_x] + all_dirs[i & 0x7][dim_x]] == 0) {
-      io_battle(c);
+    // Off screen, 0 is only where the PC was, so there's nobody to fight
+    if (!x->offscreen &&
+        (*x->hiker_dist)[pos[dim_y] + all_dirs[d & 0x7][dim_y]]
+                         [pos[dim_x] + all_dirs[d & 0x7][dim_x]] == 0) {
+      io_battle(x->m->npcs.npc[i]);
       break;
     }
   }
 }
 
-static void move_rival_func(Character *c, pair_t dest)
+static void move_rival_func(move_ctx_t *x, int i, pair_t dest)
 {
+  int16_t *pos = x->m->npcs.pos[i];
   int min;
   int base;
-  int i;
+  int d;
   
-  base = rand() & 0x7;
+  if (!x->offscreen) {
+    pathfind_need(char_rival);
+  }
+  base = move_rand(x) & 0x7;
 
-  dest[dim_x] = c->pos[dim_x];
-  dest[dim_y] = c->pos[dim_y];
+  dest[dim_x] = pos[dim_x];
+  dest[dim_y] = pos[dim_y];
   min = INT_MAX;
   
-  for (i = base; i < 8 + base; i++) {
-    if ((world.rival_dist[c->pos[dim_y] + all_dirs[i & 0x7][dim_y]]
-                         [c->pos[dim_x] + all_dirs[i & 0x7][dim_x]] <
+  for (d = base; d < 8 + base; d++) {
+    if (((*x->rival_dist)[pos[dim_y] + all_dirs[d & 0x7][dim_y]]
+                         [pos[dim_x] + all_dirs[d & 0x7][dim_x]] <
          min) &&
-        !world.cur_map->cmap[c->pos[dim_y] + all_dirs[i & 0x7][dim_y]]
-                            [c->pos[dim_x] + all_dirs[i & 0x7][dim_x]]) {
-      dest[dim_x] = c->pos[dim_x] + all_dirs[i & 0x7][dim_x];
-      dest[dim_y] = c->pos[dim_y] + all_dirs[i & 0x7][dim_y];
-      min = world.rival_dist[dest[dim_y]][dest[dim_x]];
+        !x->m->cmap[pos[dim_y] + all_dirs[d & 0x7][dim_y]]
+                   [pos[dim_x] + all_dirs[d & 0x7][dim_x]]) {
+      dest[dim_x] = pos[dim_x] + all_dirs[d & 0x7][dim_x];
+      dest[dim_y] = pos[dim_y] + all_dirs[d & 0x7][dim_y];
+      min = (*x->rival_dist)[dest[dim_y]][dest[dim_x]];
     }
-    if (world.rival_dist[c->pos[dim_y] + all_dirs[i & 0x7][dim_y]]
-                        [c->pos[dim_x] + all_dirs[i & 0x7][dim_x]] == 0) {
-      io_battle(c);
+    // Off screen, 0 is only where the PC was, so there's nobody to fight
+    if (!x->offscreen &&
+        (*x->rival_dist)[pos[dim_y] + all_dirs[d & 0x7][dim_y]]
+                         [pos[dim_x] + all_dirs[d & 0x7][dim_x]] == 0) {
+      io_battle(x->m->npcs.npc[i]);
       break;
     }
   }
 }
 
-static void move_pacer_func(Character *c, pair_t dest)
+static void move_pacer_func(move_ctx_t *x, int i, pair_t dest)
 {
-  Npc *n = dynamic_cast<Npc *>(c);
-  
-  dest[dim_x] = c->pos[dim_x];
-  dest[dim_y] = c->pos[dim_y];
+  int16_t *pos = x->m->npcs.pos[i];
+  int8_t *dir = x->m->npcs.dir[i];
+
+  dest[dim_x] = pos[dim_x];
+  dest[dim_y] = pos[dim_y];
 
-  if (!n->defeated &&
-      world.cur_map->cmap[c->pos[dim_y] + n->dir[dim_y]]
-                         [c->pos[dim_x] + n->dir[dim_x]] ==
+  if (!x->m->npcs.defeated[i] &&
+      x->m->cmap[pos[dim_y] + dir[dim_y]]
+                [pos[dim_x] + dir[dim_x]] ==
       &world.pc) {
-      io_battle(c);
+      io_battle(x->m->npcs.npc[i]);
       return;
   }
 
-  if ((world.cur_map->map[c->pos[dim_y] + n->dir[dim_y]]
-                         [c->pos[dim_x] + n->dir[dim_x]] !=
-       world.cur_map->map[c->pos[dim_y]][c->pos[dim_x]]) ||
-      world.cur_map->cmap[c->pos[dim_y] + n->dir[dim_y]]
-                         [c->pos[dim_x] + n->dir[dim_x]]) {
-    n->dir[dim_x] *= -1;
-    n->dir[dim_y] *= -1;
+  if ((x->m->map[pos[dim_y] + dir[dim_y]]
+                [pos[dim_x] + dir[dim_x]] !=
+       x->m->map[pos[dim_y]][pos[dim_x]]) ||
+      x->m->cmap[pos[dim_y] + dir[dim_y]]
+                [pos[dim_x] + dir[dim_x]]) {
+    dir[dim_x] *= -1;
+    dir[dim_y] *= -1;
   }
 
-  if ((world.cur_map->map[c->pos[dim_y] + n->dir[dim_y]]
-                         [c->pos[dim_x] + n->dir[dim_x]] ==
-       world.cur_map->map[c->pos[dim_y]][c->pos[dim_x]]) &&
-      !world.cur_map->cmap[c->pos[dim_y] + n->dir[dim_y]]
-                          [c->pos[dim_x] + n->dir[dim_x]]) {
-    dest[dim_x] = c->pos[dim_x] + n->dir[dim_x];
-    dest[dim_y] = c->pos[dim_y] + n->dir[dim_y];
+  if ((x->m->map[pos[dim_y] + dir[dim_y]]
+                [pos[dim_x] + dir[dim_x]] ==
+       x->m->map[pos[dim_y]][pos[dim_x]]) &&
+      !x->m->cmap[pos[dim_y] + dir[dim_y]]
+                 [pos[dim_x] + dir[dim_x]]) {
+    dest[dim_x] = pos[dim_x] + dir[dim_x];
+    dest[dim_y] = pos[dim_y] + dir[dim_y];
   }
 }
 
-static void move_wanderer_func(Character *c, pair_t dest)
+static void move_wanderer_func(move_ctx_t *x, int i, pair_t dest)
 {
-  Npc *n = dynamic_cast<Npc *>(c);
-  
-  dest[dim_x] = c->pos[dim_x];
-  dest[dim_y] = c->pos[dim_y];
+  int16_t *pos = x->m->npcs.pos[i];
+  int8_t *dir = x->m->npcs.dir[i];
+  int d;
+
+  dest[dim_x] = pos[dim_x];
+  dest[dim_y] = pos[dim_y];
 
-  if (!n->defeated &&
-      world.cur_map->cmap[c->pos[dim_y] + n->dir[dim_y]]
-                         [c->pos[dim_x] + n->dir[dim_x]] ==
+  if (!x->m->npcs.defeated[i] &&
+      x->m->cmap[pos[dim_y] + dir[dim_y]]
+                [pos[dim_x] + dir[dim_x]] ==
       &world.pc) {
-      io_battle(c);
+      io_battle(x->m->npcs.npc[i]);
       return;
   }
 
-  if ((world.cur_map->map[c->pos[dim_y] + n->dir[dim_y]]
-                         [c->pos[dim_x] + n->dir[dim_x]] !=
-       world.cur_map->map[c->pos[dim_y]][c->pos[dim_x]]) ||
-      world.cur_map->cmap[c->pos[dim_y] + n->dir[dim_y]]
-                         [c->pos[dim_x] + n->dir[dim_x]]) {
-    rand_dir(n->dir);
+  if ((x->m->map[pos[dim_y] + dir[dim_y]]
+                [pos[dim_x] + dir[dim_x]] !=
+       x->m->map[pos[dim_y]][pos[dim_x]]) ||
+      x->m->cmap[pos[dim_y] + dir[dim_y]]
+                [pos[dim_x] + dir[dim_x]]) {
+    d = move_rand(x) & 0x7;
+    dir[dim_x] = all_dirs[d][dim_x];
+    dir[dim_y] = all_dirs[d][dim_y];
   }
 
-  if ((world.cur_map->map[c->pos[dim_y] + n->dir[dim_y]]
-                         [c->pos[dim_x] + n->dir[dim_x]] ==
-       world.cur_map->map[c->pos[dim_y]][c->pos[dim_x]]) &&
-      !world.cur_map->cmap[c->pos[dim_y] + n->dir[dim_y]]
-                          [c->pos[dim_x] + n->dir[dim_x]]) {
-    dest[dim_x] = c->pos[dim_x] + n->dir[dim_x];
-    dest[dim_y] = c->pos[dim_y] + n->dir[dim_y];
+  if ((x->m->map[pos[dim_y] + dir[dim_y]]
+                [pos[dim_x] + dir[dim_x]] ==
+       x->m->map[pos[dim_y]][pos[dim_x]]) &&
+      !x->m->cmap[pos[dim_y] + dir[dim_y]]
+                 [pos[dim_x] + dir[dim_x]]) {
+    dest[dim_x] = pos[dim_x] + dir[dim_x];
+    dest[dim_y] = pos[dim_y] + dir[dim_y];
   }
 }
 
-static void move_sentry_func(Character *c, pair_t dest)
+static void move_sentry_func(move_ctx_t *x, int i, pair_t dest)
 {
   // Not a bug.  Sentries are non-aggro.
-  dest[dim_x] = c->pos[dim_x];
-  dest[dim_y] = c->pos[dim_y];
+  dest[dim_x] = x->m->npcs.pos[i][dim_x];
+  dest[dim_y] = x->m->npcs.pos[i][dim_y];
 }
 
-static void move_walker_func(Character *c, pair_t dest)
+static void move_walker_func(move_ctx_t *x, int i, pair_t dest)
 {
-  Npc *n = dynamic_cast<Npc *>(c);
-  
-  dest[dim_x] = c->pos[dim_x];
-  dest[dim_y] = c->pos[dim_y];
+  int16_t *pos = x->m->npcs.pos[i];
+  int8_t *dir = x->m->npcs.dir[i];
 
-  if (!n->defeated &&
-      world.cur_map->cmap[c->pos[dim_y] + n->dir[dim_y]]
-                         [c->pos[dim_x] + n->dir[dim_x]] ==
+  dest[dim_x] = pos[dim_x];
+  dest[dim_y] = pos[dim_y];
+
+  if (!x->m->npcs.defeated[i] &&
+      x->m->cmap[pos[dim_y] + dir[dim_y]]
+                [pos[dim_x] + dir[dim_x]] ==
       &world.pc) {
-      io_battle(c);
+      io_battle(x->m->npcs.npc[i]);
       return;
   }
 
-  if ((move_cost[char_other][world.cur_map->map[c->pos[dim_y] +
-                                                n->dir[dim_y]]
-                                               [c->pos[dim_x] +
-                                                n->dir[dim_x]]] ==
-       INT_MAX) || world.cur_map->cmap[c->pos[dim_y] + n->dir[dim_y]]
-                                      [c->pos[dim_x] + n->dir[dim_x]]) {
-    n->dir[dim_x] *= -1;
-    n->dir[dim_y] *= -1;
+  if ((move_cost[char_other][x->m->map[pos[dim_y] +
+                                       dir[dim_y]]
+                                      [pos[dim_x] +
+                                       dir[dim_x]]] ==
+       INT_MAX) || x->m->cmap[pos[dim_y] + dir[dim_y]]
+                             [pos[dim_x] + dir[dim_x]]) {
+    dir[dim_x] *= -1;
+    dir[dim_y] *= -1;
   }
 
-  if ((move_cost[char_other][world.cur_map->map[c->pos[dim_y] +
-                                                n->dir[dim_y]]
-                                               [c->pos[dim_x] +
-                                                n->dir[dim_x]]] !=
+  if ((move_cost[char_other][x->m->map[pos[dim_y] +
+                                       dir[dim_y]]
+                                      [pos[dim_x] +
+                                       dir[dim_x]]] !=
        INT_MAX) &&
-      !world.cur_map->cmap[c->pos[dim_y] + n->dir[dim_y]]
-                          [c->pos[dim_x] + n->dir[dim_x]]) {
-    dest[dim_x] = c->pos[dim_x] + n->dir[dim_x];
-    dest[dim_y] = c->pos[dim_y] + n->dir[dim_y];
+      !x->m->cmap[pos[dim_y] + dir[dim_y]]
+                 [pos[dim_x] + dir[dim_x]]) {
+    dest[dim_x] = pos[dim_x] + dir[dim_x];
+    dest[dim_y] = pos[dim_y] + dir[dim_y];
   }
 }
 
-static void move_pc_func(Character *c, pair_t dest)
-{
-  io_display();
-  io_handle_input(dest);
-}
-
-void (*move_func[num_movement_types])(Character *, pair_t) = {
+void (*move_func[num_movement_types])(move_ctx_t *x, int i, pair_t dest) = {
   move_hiker_func,
   move_rival_func,
   move_pacer_func,
   move_wanderer_func,
   move_sentry_func,
   move_walker_func,
-  move_pc_func,
 };
 
-int32_t cmp_char_turns(const void *key, const void *with)
+uint32_t take_npc_turns(move_ctx_t *x, Character *c)
 {
-  return ((Character *) key)->next_turn - ((Character *) with)->next_turn;
+  npc_store_t *s;
+  uint32_t n;
+  pair_t d;
+  int i;
+
+  s = &x->m->npcs;
+  for (n = 0; c; c = c->turn_next, n++) {
+    i = static_cast<Npc *>(c)->slot;
+    move_func[s->mtype[i]](x, i, d);
+
+    x->m->cmap[s->pos[i][dim_y]][s->pos[i][dim_x]] = NULL;
+    x->m->cmap[d[dim_y]][d[dim_x]] = c;
+    c->next_turn += move_cost[c->ctype][x->m->map[d[dim_y]][d[dim_x]]];
+    s->pos[i][dim_y] = d[dim_y];
+    s->pos[i][dim_x] = d[dim_x];
+  }
+
+  return n;
 }
 
-void delete_character(void *v)
+/**************************************************************************
+ * The turn queue.  Move costs are all small, so nearly everyone is due  *
+ * within the block of TURN_SLOTS ticks that now is in or the one after, *
+ * and a tick's slot is just its low bits.  Popping is a find-first-set  *
+ * over busy from now's slot; when the block runs dry, the next one is   *
+ * moved in off later, in order, so the first scheduled stays first.     *
+ * Only those who are due in some later block get walked again, and no  *
+ * character goes onto later more than once per block it waits through. *
+ **************************************************************************/
+
+#define turn_block(t) ((t) & ~(TURN_SLOTS - 1))
+
+/* Appends c to the circular list whose tail is *tail */
+static inline void turn_append(Character **tail, Character *c)
 {
-  if (v != &world.pc) {
-    delete (Npc *) v;
+  if (*tail) {
+    c->turn_next = (*tail)->turn_next;
+    (*tail)->turn_next = c;
+  } else {
+    c->turn_next = c;
   }
+  *tail = c;
 }
 
-#define ter_cost(x, y, c) move_cost[c][m->map[y][x]]
+/* c is due in now's block */
+static inline void turn_slot_append(turn_queue_t *q, Character *c)
+{
+  int s;
 
-static int32_t hiker_cmp(const void *key, const void *with) {
-  return (world.hiker_dist[((path_t *) key)->pos[dim_y]]
-                          [((path_t *) key)->pos[dim_x]] -
-          world.hiker_dist[((path_t *) with)->pos[dim_y]]
-                          [((path_t *) with)->pos[dim_x]]);
+  s = c->next_turn & (TURN_SLOTS - 1);
+  turn_append(q->slot + s, c);
+  q->busy[s / 64] |= 1ULL << (s % 64);
 }
 
-static int32_t rival_cmp(const void *key, const void *with) {
-  return (world.rival_dist[((path_t *) key)->pos[dim_y]]
-                          [((path_t *) key)->pos[dim_x]] -
-          world.rival_dist[((path_t *) with)->pos[dim_y]]
-                          [((path_t *) with)->pos[dim_x]]);
+void turn_init(turn_queue_t *q)
+{
+  memset(q, 0, sizeof (*q));
 }
 
-void pathfind(Map *m)
+void turn_schedule(turn_queue_t *q, Character *c)
 {
-  heap_t h;
-  uint32_t x, y;
-  static path_t p[MAP_Y][MAP_X], *c;
-  static uint32_t initialized = 0;
-
-  if (!initialized) {
-    initialized = 1;
-    for (y = 0; y < MAP_Y; y++) {
-      for (x = 0; x < MAP_X; x++) {
-        p[y][x].pos[dim_y] = y;
-        p[y][x].pos[dim_x] = x;
-      }
+  q->size++;
+  if (c->next_turn - turn_block(q->now) < TURN_SLOTS) {
+    turn_slot_append(q, c);
+  } else {
+    turn_append(&q->later, c);
+  }
+}
+
+/* The wheel is empty; skips to the block of the earliest on later */
+static void turn_next_block(turn_queue_t *q)
+{
+  Character *c, *next, *tail, *rest;
+  int32_t first;
+
+  tail = q->later;
+  for (first = INT_MAX, c = tail->turn_next; ; c = c->turn_next) {
+    if (c->next_turn < first) {
+      first = c->next_turn;
+    }
+    if (c == tail) {
+      break;
     }
   }
 
-  for (y = 0; y < MAP_Y; y++) {
-    for (x = 0; x < MAP_X; x++) {
-      world.hiker_dist[y][x] = world.rival_dist[y][x] = INT_MAX;
+  q->now = turn_block(first);
+  for (rest = NULL, c = tail->turn_next; ; c = next) {
+    next = c->turn_next;
+    if (c->next_turn - q->now < TURN_SLOTS) {
+      turn_slot_append(q, c);
+    } else {
+      turn_append(&rest, c);
+    }
+    if (c == tail) {
+      break;
     }
   }
-  world.hiker_dist[world.pc.pos[dim_y]][world.pc.pos[dim_x]] = 
-    world.rival_dist[world.pc.pos[dim_y]][world.pc.pos[dim_x]] = 0;
+  q->later = rest;
+}
 
-  heap_init(&h, hiker_cmp, NULL);
+/* Leaves now at the head's turn and returns the head */
+Character *turn_peek(turn_queue_t *q)
+{
+  uint64_t b;
+  int s, w;
 
-  for (y = 1; y < MAP_Y - 1; y++) {
-    for (x = 1; x < MAP_X - 1; x++) {
-      if (ter_cost(x, y, char_hiker) != INT_MAX) {
-        p[y][x].hn = heap_insert(&h, &p[y][x]);
-      } else {
-        p[y][x].hn = NULL;
+  if (!q->size) {
+    return NULL;
+  }
+
+  for (;;) {
+    s = q->now & (TURN_SLOTS - 1);
+    for (w = s / 64; w < TURN_SLOTS / 64; w++) {
+      b = q->busy[w];
+      if (w == s / 64) {
+        b &= ~0ULL << (s % 64);
+      }
+      if (b) {
+        s = w * 64 + __builtin_ctzll(b);
+        q->now = turn_block(q->now) + s;
+        return q->slot[s]->turn_next;
       }
     }
+    turn_next_block(q);
   }
+}
 
-  while ((c = (path_t *) heap_remove_min(&h))) {
-    c->hn = NULL;
-    if ((p[c->pos[dim_y] - 1][c->pos[dim_x] - 1].hn) &&
-        (world.hiker_dist[c->pos[dim_y] - 1][c->pos[dim_x] - 1] >
-         world.hiker_dist[c->pos[dim_y]][c->pos[dim_x]] +
-         ter_cost(c->pos[dim_x], c->pos[dim_y], char_hiker))) {
-      world.hiker_dist[c->pos[dim_y] - 1][c->pos[dim_x] - 1] =
-        world.hiker_dist[c->pos[dim_y]][c->pos[dim_x]] +
-        ter_cost(c->pos[dim_x], c->pos[dim_y], char_hiker);
-      heap_decrease_key_no_replace(&h,
-                                   p[c->pos[dim_y] - 1][c->pos[dim_x] - 1].hn);
-    }
-    if ((p[c->pos[dim_y] - 1][c->pos[dim_x]    ].hn) &&
-        (world.hiker_dist[c->pos[dim_y] - 1][c->pos[dim_x]    ] >
-         world.hiker_dist[c->pos[dim_y]][c->pos[dim_x]] +
-         ter_cost(c->pos[dim_x], c->pos[dim_y], char_hiker))) {
-      world.hiker_dist[c->pos[dim_y] - 1][c->pos[dim_x]    ] =
-        world.hiker_dist[c->pos[dim_y]][c->pos[dim_x]] +
-        ter_cost(c->pos[dim_x], c->pos[dim_y], char_hiker);
-      heap_decrease_key_no_replace(&h,
-                                   p[c->pos[dim_y] - 1][c->pos[dim_x]    ].hn);
-    }
-    if ((p[c->pos[dim_y] - 1][c->pos[dim_x] + 1].hn) &&
-        (world.hiker_dist[c->pos[dim_y] - 1][c->pos[dim_x] + 1] >
-         world.hiker_dist[c->pos[dim_y]][c->pos[dim_x]] +
-         ter_cost(c->pos[dim_x], c->pos[dim_y], char_hiker))) {
-      world.hiker_dist[c->pos[dim_y] - 1][c->pos[dim_x] + 1] =
-        world.hiker_dist[c->pos[dim_y]][c->pos[dim_x]] +
-        ter_cost(c->pos[dim_x], c->pos[dim_y], char_hiker);
-      heap_decrease_key_no_replace(&h,
-                                   p[c->pos[dim_y] - 1][c->pos[dim_x] + 1].hn);
-    }
-    if ((p[c->pos[dim_y]    ][c->pos[dim_x] - 1].hn) &&
-        (world.hiker_dist[c->pos[dim_y]    ][c->pos[dim_x] - 1] >
-         world.hiker_dist[c->pos[dim_y]][c->pos[dim_x]] +
-         ter_cost(c->pos[dim_x], c->pos[dim_y], char_hiker))) {
-      world.hiker_dist[c->pos[dim_y]    ][c->pos[dim_x] - 1] =
-        world.hiker_dist[c->pos[dim_y]][c->pos[dim_x]] +
-        ter_cost(c->pos[dim_x], c->pos[dim_y], char_hiker);
-      heap_decrease_key_no_replace(&h,
-                                   p[c->pos[dim_y]    ][c->pos[dim_x] - 1].hn);
-    }
-    if ((p[c->pos[dim_y]    ][c->pos[dim_x] + 1].hn) &&
-        (world.hiker_dist[c->pos[dim_y]    ][c->pos[dim_x] + 1] >
-         world.hiker_dist[c->pos[dim_y]][c->pos[dim_x]] +
-         ter_cost(c->pos[dim_x], c->pos[dim_y], char_hiker))) {
-      world.hiker_dist[c->pos[dim_y]    ][c->pos[dim_x] + 1] =
-        world.hiker_dist[c->pos[dim_y]][c->pos[dim_x]] +
-        ter_cost(c->pos[dim_x], c->pos[dim_y], char_hiker);
-      heap_decrease_key_no_replace(&h,
-                                   p[c->pos[dim_y]    ][c->pos[dim_x] + 1].hn);
-    }
-    if ((p[c->pos[dim_y] + 1][c->pos[dim_x] - 1].hn) &&
-        (world.hiker_dist[c->pos[dim_y] + 1][c->pos[dim_x] - 1] >
-         world.hiker_dist[c->pos[dim_y]][c->pos[dim_x]] +
-         ter_cost(c->pos[dim_x], c->pos[dim_y], char_hiker))) {
-      world.hiker_dist[c->pos[dim_y] + 1][c->pos[dim_x] - 1] =
-        world.hiker_dist[c->pos[dim_y]][c->pos[dim_x]] +
-        ter_cost(c->pos[dim_x], c->pos[dim_y], char_hiker);
-      heap_decrease_key_no_replace(&h,
-                                   p[c->pos[dim_y] + 1][c->pos[dim_x] - 1].hn);
-    }
-    if ((p[c->pos[dim_y] + 1][c->pos[dim_x]    ].hn) &&
-        (world.hiker_dist[c->pos[dim_y] + 1][c->pos[dim_x]    ] >
-         world.hiker_dist[c->pos[dim_y]][c->pos[dim_x]] +
-         ter_cost(c->pos[dim_x], c->pos[dim_y], char_hiker))) {
-      world.hiker_dist[c->pos[dim_y] + 1][c->pos[dim_x]    ] =
-        world.hiker_dist[c->pos[dim_y]][c->pos[dim_x]] +
-        ter_cost(c->pos[dim_x], c->pos[dim_y], char_hiker);
-      heap_decrease_key_no_replace(&h,
-                                   p[c->pos[dim_y] + 1][c->pos[dim_x]    ].hn);
-    }
-    if ((p[c->pos[dim_y] + 1][c->pos[dim_x] + 1].hn) &&
-        (world.hiker_dist[c->pos[dim_y] + 1][c->pos[dim_x] + 1] >
-         world.hiker_dist[c->pos[dim_y]][c->pos[dim_x]] +
-         ter_cost(c->pos[dim_x], c->pos[dim_y], char_hiker))) {
-      world.hiker_dist[c->pos[dim_y] + 1][c->pos[dim_x] + 1] =
-        world.hiker_dist[c->pos[dim_y]][c->pos[dim_x]] +
-        ter_cost(c->pos[dim_x], c->pos[dim_y], char_hiker);
-      heap_decrease_key_no_replace(&h,
-                                   p[c->pos[dim_y] + 1][c->pos[dim_x] + 1].hn);
-    }
+Character *turn_pop(turn_queue_t *q)
+{
+  Character *c, **tail;
+  int s;
+
+  if (!(c = turn_peek(q))) {
+    return NULL;
   }
-  heap_delete(&h);
 
-  heap_init(&h, rival_cmp, NULL);
+  s = q->now & (TURN_SLOTS - 1);
+  tail = q->slot + s;
+  if (*tail == c) {
+    *tail = NULL;
+    q->busy[s / 64] &= ~(1ULL << (s % 64));
+  } else {
+    (*tail)->turn_next = c->turn_next;
+  }
+  q->size--;
+
+  return c;
+}
+
+/* Everyone due at the head's turn, up to the PC, chained through      *
+ * turn_next and ending in NULL; or the PC alone if it's first.  None  *
+ * of these turns can move the PC to another map, so they can all be   *
+ * taken before any is put back.                                       */
+Character *turn_pop_due(turn_queue_t *q)
+{
+  Character *head, *c, **tail;
+  int s;
+
+  if (!(head = turn_peek(q))) {
+    return NULL;
+  }
+
+  s = q->now & (TURN_SLOTS - 1);
+  tail = q->slot + s;
+  if (head == &world.pc) {
+    turn_pop(q);
+    head->turn_next = NULL;
+    return head;
+  }
+
+  for (c = head, q->size--; c != *tail && c->turn_next != &world.pc;
+       c = c->turn_next, q->size--)
+    ;
+  if (c == *tail) {
+    *tail = NULL;
+    q->busy[s / 64] &= ~(1ULL << (s % 64));
+  } else {
+    (*tail)->turn_next = c->turn_next;
+  }
+  c->turn_next = NULL;
+
+  return head;
+}
+
+/* Puts back a chain from turn_pop_due() once its turns are taken */
+void turn_schedule_chain(turn_queue_t *q, Character *c)
+{
+  Character *next;
+
+  for (; c; c = next) {
+    next = c->turn_next;
+    turn_schedule(q, c);
+  }
+}
+
+void npc_store_init(npc_store_t *s)
+{
+  memset(s, 0, sizeof (*s));
+}
+
+/* A new trainer in the next slot, with its fields zeroed */
+Npc *npc_new(npc_store_t *s)
+{
+  struct npc_chunk *k;
+  Npc *n;
+
+  if (s->num == s->alloc) {
+    s->alloc = s->alloc ? s->alloc * 2 : NPC_CHUNK;
+    s->pos = (pair_t *) realloc(s->pos, s->alloc * sizeof (*s->pos));
+    s->dir = (int8_t (*)[num_dims]) realloc(s->dir,
+                                            s->alloc * sizeof (*s->dir));
+    s->mtype = (movement_type_t *) realloc(s->mtype,
+                                           s->alloc * sizeof (*s->mtype));
+    s->defeated = (uint8_t *) realloc(s->defeated,
+                                      s->alloc * sizeof (*s->defeated));
+    s->npc = (Npc **) realloc(s->npc, s->alloc * sizeof (*s->npc));
+  }
+  if (!(s->num % NPC_CHUNK)) {
+    k = (struct npc_chunk *) calloc(1, sizeof (*k));
+    k->next = s->chunks;
+    s->chunks = k;
+  }
+
+  n = s->chunks->npc + s->num % NPC_CHUNK;
+  n->slot = s->num;
+  s->npc[s->num] = n;
+  memset(s->pos + s->num, 0, sizeof (*s->pos));
+  memset(s->dir + s->num, 0, sizeof (*s->dir));
+  s->mtype[s->num] = (movement_type_t) 0;
+  s->defeated[s->num] = 0;
+  s->num++;
+
+  return n;
+}
+
+/* Frees the store and its trainers, but not their Pokemon */
+void npc_store_destroy(npc_store_t *s)
+{
+  struct npc_chunk *k;
+
+  while ((k = s->chunks)) {
+    s->chunks = k->next;
+    free(k);
+  }
+  free(s->pos);
+  free(s->dir);
+  free(s->mtype);
+  free(s->defeated);
+  free(s->npc);
+  npc_store_init(s);
+}
+
+#define ter_cost(x, y, c) move_cost[c][m->map[y][x]]
+
+/* The distances heap_dist() orders its heap by */
+static int *heap_order;
+
+static int32_t dist_cmp(const void *key, const void *with) {
+  return (heap_order[((path_t *) key)->pos[dim_y] * map_x +
+                     ((path_t *) key)->pos[dim_x]] -
+          heap_order[((path_t *) with)->pos[dim_y] * map_x +
+                     ((path_t *) with)->pos[dim_x]]);
+}
 
-  for (y = 1; y < MAP_Y - 1; y++) {
-    for (x = 1; x < MAP_X - 1; x++) {
-      if (ter_cost(x, y, char_rival) != INT_MAX) {
-        p[y][x].hn = heap_insert(&h, &p[y][x]);
+pathfind_mode_t pathfind_mode = pathfind_mode_incremental;
+
+/* Dijkstra's over p, a map's worth of cells, into dist, which holds 0 *
+ * at the source and INT_MAX everywhere else.                           */
+template <class D>
+static void heap_dist(D d, Map *m, character_type_t ct, int *dist,
+                      path_t *p, heap_pool_t *pool)
+{
+  const int32_t step[8] = {
+    -d.x - 1, -d.x, -d.x + 1, -1, 1, d.x - 1, d.x, d.x + 1
+  };
+  heap_t h;
+  int32_t x, y, i, cost;
+  path_t *c, *n;
+
+  heap_order = dist;
+  heap_pool_reset(pool);
+  heap_init_pool(&h, dist_cmp, NULL, pool);
+
+  for (y = 1; y < d.y - 1; y++) {
+    for (x = 1; x < d.x - 1; x++) {
+      if (move_cost[ct][m->map.at(d, x, y)] != INT_MAX) {
+        p[y * d.x + x].hn = heap_insert(&h, p + y * d.x + x);
       } else {
-        p[y][x].hn = NULL;
+        p[y * d.x + x].hn = NULL;
       }
     }
   }
 
   while ((c = (path_t *) heap_remove_min(&h))) {
     c->hn = NULL;
-    if ((p[c->pos[dim_y] - 1][c->pos[dim_x] - 1].hn) &&
-        (world.rival_dist[c->pos[dim_y] - 1][c->pos[dim_x] - 1] >
-         world.rival_dist[c->pos[dim_y]][c->pos[dim_x]] +
-         ter_cost(c->pos[dim_x], c->pos[dim_y], char_rival))) {
-      world.rival_dist[c->pos[dim_y] - 1][c->pos[dim_x] - 1] =
-        world.rival_dist[c->pos[dim_y]][c->pos[dim_x]] +
-        ter_cost(c->pos[dim_x], c->pos[dim_y], char_rival);
-      heap_decrease_key_no_replace(&h,
-                                   p[c->pos[dim_y] - 1][c->pos[dim_x] - 1].hn);
+    if (dist[c - p] == INT_MAX) {
+      // Everything left is unreachable; relaxing from here would overflow
+      break;
     }
-    if ((p[c->pos[dim_y] - 1][c->pos[dim_x]    ].hn) &&
-        (world.rival_dist[c->pos[dim_y] - 1][c->pos[dim_x]    ] >
-         world.rival_dist[c->pos[dim_y]][c->pos[dim_x]] +
-         ter_cost(c->pos[dim_x], c->pos[dim_y], char_rival))) {
-      world.rival_dist[c->pos[dim_y] - 1][c->pos[dim_x]    ] =
-        world.rival_dist[c->pos[dim_y]][c->pos[dim_x]] +
-        ter_cost(c->pos[dim_x], c->pos[dim_y], char_rival);
-      heap_decrease_key_no_replace(&h,
-                                   p[c->pos[dim_y] - 1][c->pos[dim_x]    ].hn);
+    cost = dist[c - p] + move_cost[ct][m->map.at(d, c->pos[dim_x],
+                                                 c->pos[dim_y])];
+    for (i = 0; i < 8; i++) {
+      n = c + step[i];
+      if (n->hn && dist[n - p] > cost) {
+        dist[n - p] = cost;
+        heap_decrease_key_no_replace(&h, n->hn);
+      }
     }
-    if ((p[c->pos[dim_y] - 1][c->pos[dim_x] + 1].hn) &&
-        (world.rival_dist[c->pos[dim_y] - 1][c->pos[dim_x] + 1] >
-         world.rival_dist[c->pos[dim_y]][c->pos[dim_x]] +
-         ter_cost(c->pos[dim_x], c->pos[dim_y], char_rival))) {
-      world.rival_dist[c->pos[dim_y] - 1][c->pos[dim_x] + 1] =
-        world.rival_dist[c->pos[dim_y]][c->pos[dim_x]] +
-        ter_cost(c->pos[dim_x], c->pos[dim_y], char_rival);
-      heap_decrease_key_no_replace(&h,
-                                   p[c->pos[dim_y] - 1][c->pos[dim_x] + 1].hn);
+  }
+  heap_delete(&h);
+}
+
+static void pathfind_heap(Map *m, pair_t src)
+{
+  static path_t *p;
+  static heap_pool_t pool;
+  int32_t x, y;
+
+  if (!p) {
+    heap_pool_init(&pool);
+    p = (path_t *) malloc((size_t) map_x * map_y * sizeof (*p));
+    for (y = 0; y < map_y; y++) {
+      for (x = 0; x < map_x; x++) {
+        p[y * map_x + x].pos[dim_y] = y;
+        p[y * map_x + x].pos[dim_x] = x;
+        p[y * map_x + x].hn = NULL;
+      }
     }
-    if ((p[c->pos[dim_y]    ][c->pos[dim_x] - 1].hn) &&
-        (world.rival_dist[c->pos[dim_y]    ][c->pos[dim_x] - 1] >
-         world.rival_dist[c->pos[dim_y]][c->pos[dim_x]] +
-         ter_cost(c->pos[dim_x], c->pos[dim_y], char_rival))) {
-      world.rival_dist[c->pos[dim_y]    ][c->pos[dim_x] - 1] =
-        world.rival_dist[c->pos[dim_y]][c->pos[dim_x]] +
-        ter_cost(c->pos[dim_x], c->pos[dim_y], char_rival);
-      heap_decrease_key_no_replace(&h,
-                                   p[c->pos[dim_y]    ][c->pos[dim_x] - 1].hn);
+  }
+
+  for (y = 0; y < map_y; y++) {
+    for (x = 0; x < map_x; x++) {
+      world.hiker_dist[y][x] = world.rival_dist[y][x] = INT_MAX;
     }
-    if ((p[c->pos[dim_y]    ][c->pos[dim_x] + 1].hn) &&
-        (world.rival_dist[c->pos[dim_y]    ][c->pos[dim_x] + 1] >
-         world.rival_dist[c->pos[dim_y]][c->pos[dim_x]] +
-         ter_cost(c->pos[dim_x], c->pos[dim_y], char_rival))) {
-      world.rival_dist[c->pos[dim_y]    ][c->pos[dim_x] + 1] =
-        world.rival_dist[c->pos[dim_y]][c->pos[dim_x]] +
-        ter_cost(c->pos[dim_x], c->pos[dim_y], char_rival);
-      heap_decrease_key_no_replace(&h,
-                                   p[c->pos[dim_y]    ][c->pos[dim_x] + 1].hn);
+  }
+  world.hiker_dist[src[dim_y]][src[dim_x]] =
+    world.rival_dist[src[dim_y]][src[dim_x]] = 0;
+
+  with_dims([&](auto d) {
+    heap_dist(d, m, char_hiker, world.hiker_dist.cells, p, &pool);
+    heap_dist(d, m, char_rival, world.rival_dist.cells, p, &pool);
+  });
+}
+
+/**************************************************************************
+ * Dial's algorithm.  Finite move costs are small integers, so a circular *
+ * array of max_cost + 1 buckets replaces the heap: every relaxation from *
+ * distance d lands in (d, d + max_cost], which never wraps onto the      *
+ * bucket being drained.  Entries are never removed on decrease; stale    *
+ * ones are recognized because dist no longer matches the bucket's value. *
+ * Produces exactly the distances the heap version does.                  *
+ **************************************************************************/
+template <class D>
+static inline int dial_valid(D d, Map *m, character_type_t ct,
+                             int32_t x, int32_t y)
+{
+  return (x > 0 && x < d.x - 1 && y > 0 && y < d.y - 1 &&
+          move_cost[ct][m->map.at(d, x, y)] != INT_MAX);
+}
+
+/* Runs the search outward from src, which must already hold distance 0. *
+ * Only ever lowers entries of dist, so dist may start out as any upper  *
+ * bound that satisfies the triangle inequality, not just INT_MAX.        */
+template <class D>
+static void dial_run(D d, Map *m, pair_t src, character_type_t ct, int *dist)
+{
+  // Per thread, since off-screen maps are searched on several at once
+  static thread_local std::vector<uint32_t> bucket[64];
+  int32_t x, y, i, cur, nd, cost, max_cost, num_buckets, pending;
+  uint32_t idx;
+
+  if (!dial_valid(d, m, ct, src[dim_x], src[dim_y])) {
+    return;
+  }
+
+  for (max_cost = i = 0; i < num_terrain_types; i++) {
+    if (move_cost[ct][i] != INT_MAX && move_cost[ct][i] > max_cost) {
+      max_cost = move_cost[ct][i];
     }
-    if ((p[c->pos[dim_y] + 1][c->pos[dim_x] - 1].hn) &&
-        (world.rival_dist[c->pos[dim_y] + 1][c->pos[dim_x] - 1] >
-         world.rival_dist[c->pos[dim_y]][c->pos[dim_x]] +
-         ter_cost(c->pos[dim_x], c->pos[dim_y], char_rival))) {
-      world.rival_dist[c->pos[dim_y] + 1][c->pos[dim_x] - 1] =
-        world.rival_dist[c->pos[dim_y]][c->pos[dim_x]] +
-        ter_cost(c->pos[dim_x], c->pos[dim_y], char_rival);
-      heap_decrease_key_no_replace(&h,
-                                   p[c->pos[dim_y] + 1][c->pos[dim_x] - 1].hn);
+  }
+  num_buckets = max_cost + 1;
+  assert(num_buckets <= (int32_t) (sizeof (bucket) / sizeof (bucket[0])));
+
+  for (i = 0; i < num_buckets; i++) {
+    bucket[i].clear();
+  }
+  bucket[0].push_back(src[dim_y] * d.x + src[dim_x]);
+  pending = 1;
+
+  for (cur = 0; pending; cur++) {
+    std::vector<uint32_t> &b = bucket[cur % num_buckets];
+    while (!b.empty()) {
+      idx = b.back();
+      b.pop_back();
+      pending--;
+      x = idx % d.x;
+      y = idx / d.x;
+      if (dist[idx] != cur) {
+        continue;
+      }
+      cost = move_cost[ct][m->map.at(d, x, y)];
+      for (i = 0; i < 8; i++) {
+        int32_t nx = x + all_dirs[i][dim_x];
+        int32_t ny = y + all_dirs[i][dim_y];
+        if (dial_valid(d, m, ct, nx, ny) &&
+            dist[ny * d.x + nx] > (nd = cur + cost)) {
+          dist[ny * d.x + nx] = nd;
+          bucket[nd % num_buckets].push_back(ny * d.x + nx);
+          pending++;
+        }
+      }
     }
-    if ((p[c->pos[dim_y] + 1][c->pos[dim_x]    ].hn) &&
-        (world.rival_dist[c->pos[dim_y] + 1][c->pos[dim_x]    ] >
-         world.rival_dist[c->pos[dim_y]][c->pos[dim_x]] +
-         ter_cost(c->pos[dim_x], c->pos[dim_y], char_rival))) {
-      world.rival_dist[c->pos[dim_y] + 1][c->pos[dim_x]    ] =
-        world.rival_dist[c->pos[dim_y]][c->pos[dim_x]] +
-        ter_cost(c->pos[dim_x], c->pos[dim_y], char_rival);
-      heap_decrease_key_no_replace(&h,
-                                   p[c->pos[dim_y] + 1][c->pos[dim_x]    ].hn);
+  }
+}
+
+static void dial_dist(Map *m, pair_t src, character_type_t ct,
+                      MapArray<int> &dist)
+{
+  int32_t x, y;
+
+  for (y = 0; y < map_y; y++) {
+    for (x = 0; x < map_x; x++) {
+      dist[y][x] = INT_MAX;
     }
-    if ((p[c->pos[dim_y] + 1][c->pos[dim_x] + 1].hn) &&
-        (world.rival_dist[c->pos[dim_y] + 1][c->pos[dim_x] + 1] >
-         world.rival_dist[c->pos[dim_y]][c->pos[dim_x]] +
-         ter_cost(c->pos[dim_x], c->pos[dim_y], char_rival))) {
-      world.rival_dist[c->pos[dim_y] + 1][c->pos[dim_x] + 1] =
-        world.rival_dist[c->pos[dim_y]][c->pos[dim_x]] +
-        ter_cost(c->pos[dim_x], c->pos[dim_y], char_rival);
-      heap_decrease_key_no_replace(&h,
-                                   p[c->pos[dim_y] + 1][c->pos[dim_x] + 1].hn);
+  }
+  dist[src[dim_y]][src[dim_x]] = 0;
+
+  with_dims([&](auto d) {
+    dial_run(d, m, src, ct, dist.cells);
+  });
+}
+
+void pathfind_from(Map *m, pair_t src, MapArray<int> &hiker,
+                   MapArray<int> &rival)
+{
+  dial_dist(m, src, char_hiker, hiker);
+  dial_dist(m, src, char_rival, rival);
+}
+
+/**************************************************************************
+ * Incremental repair.  Terrain never changes once a map exists, so       *
+ * between two calls on the same map the only change is the PC moving,    *
+ * normally by one cell.  When the old source s and new source s' are     *
+ * adjacent and both passable, the direct step makes d'(s) = cost(s'), so *
+ * d(v) + cost(s') is a consistent upper bound on every new distance d'.  *
+ * Seeding the map with that bound and running a decrease-only search     *
+ * from s' touches just the cells that found a shorter way around s, and  *
+ * the result is exactly what a full recompute would give.  Anything else *
+ * (a teleport, a new map) falls back to the full search.                 *
+ **************************************************************************/
+class dist_field {
+ public:
+  character_type_t ct;
+  Map *m;
+  pair_t src;
+  MapArray<int> *out;
+  MapArray<int> g;
+};
+
+static dist_field hiker_field = { char_hiker, NULL, { 0, 0 },
+                                  &world.hiker_dist, { } };
+static dist_field rival_field = { char_rival, NULL, { 0, 0 },
+                                  &world.rival_dist, { } };
+
+static void field_update(dist_field *f, Map *m, pair_t src)
+{
+  runtime_dims here = { map_x, map_y };
+  int32_t i, cost;
+
+  if (!f->g.cells) {
+    f->g.init(map_x, map_y);
+  }
+
+  if (f->m != m ||
+      f->src[dim_x] != src[dim_x] || f->src[dim_y] != src[dim_y]) {
+    if (f->m == m &&
+        abs(f->src[dim_x] - src[dim_x]) <= 1 &&
+        abs(f->src[dim_y] - src[dim_y]) <= 1 &&
+        dial_valid(here, m, f->ct, f->src[dim_x], f->src[dim_y]) &&
+        dial_valid(here, m, f->ct, src[dim_x], src[dim_y])) {
+      cost = ter_cost(src[dim_x], src[dim_y], f->ct);
+      for (i = 0; i < map_x * map_y; i++) {
+        if (f->g.cells[i] != INT_MAX) {
+          f->g.cells[i] += cost;
+        }
+      }
+      f->g[src[dim_y]][src[dim_x]] = 0;
+      with_dims([&](auto d) {
+        dial_run(d, m, src, f->ct, f->g.cells);
+      });
+    } else {
+      dial_dist(m, src, f->ct, f->g);
     }
+
+    f->m = m;
+    f->src[dim_x] = src[dim_x];
+    f->src[dim_y] = src[dim_y];
   }
-  heap_delete(&h);
+
+  memcpy(f->out->cells, f->g.cells, f->g.bytes());
+}
+
+void pathfind_invalidate()
+{
+  hiker_field.m = rival_field.m = NULL;
+}
+
+/**************************************************************************
+ * Distance maps are lazy.  pathfind() only records the map and the PC's  *
+ * position and marks both fields stale; each field is computed the first *
+ * time pathfind_need() asks for it.  Turns spent by pacers, wanderers    *
+ * and the like, and maps with no hikers or rivals, cost nothing.         *
+ **************************************************************************/
+pathfind_stats_t pathfind_stats;
+
+static Map *pending_map;
+static pair_t pending_src;
+static int stale[num_character_types];
+
+void pathfind(Map *m)
+{
+  pathfind_stats.requested += !stale[char_hiker] + !stale[char_rival];
+  pending_map = m;
+  pending_src[dim_x] = world.pc.pos[dim_x];
+  pending_src[dim_y] = world.pc.pos[dim_y];
+  stale[char_hiker] = stale[char_rival] = 1;
+}
+
+void pathfind_need(character_type_t ct)
+{
+  double t;
+
+  if (!stale[ct]) {
+    return;
+  }
+
+  t = now();
+  if (pathfind_mode == pathfind_mode_heap) {
+    // Fills in both at once
+    pathfind_heap(pending_map, pending_src);
+    pathfind_stats.computed += stale[char_hiker] + stale[char_rival];
+    stale[char_hiker] = stale[char_rival] = 0;
+  } else {
+    if (pathfind_mode == pathfind_mode_bucket) {
+      dial_dist(pending_map, pending_src, ct,
+                ct == char_hiker ? world.hiker_dist : world.rival_dist);
+    } else {
+      field_update(ct == char_hiker ? &hiker_field : &rival_field,
+                   pending_map, pending_src);
+    }
+    pathfind_stats.computed++;
+    stale[ct] = 0;
+  }
+  pathfind_stats.seconds += now() - t;
 }
@@ -14,9 +14,51 @@ class Character;
 /* character is defined in poke327.h to allow an instance of character
  * in world without including character.h in poke327.h                 */
 
-int32_t cmp_char_turns(const void *key, const void *with);
-void delete_character(void *v);
+typedef enum pathfind_mode {
+  pathfind_mode_heap,
+  pathfind_mode_bucket,
+  pathfind_mode_incremental,
+  num_pathfind_modes
+} pathfind_mode_t;
+
+/* Which shortest-path engine pathfind() uses.  All produce identical   *
+ * distance maps.  Heap and bucket recompute from scratch every call;   *
+ * incremental repairs the previous maps when only the PC has moved and *
+ * does nothing at all when the PC hasn't.                              */
+extern pathfind_mode_t pathfind_mode;
+
+typedef struct turn_queue turn_queue_t;
+
+/* Who moves next is whoever has the lowest next_turn, and among equals, *
+ * whoever was scheduled first.  next_turn must be no earlier than the  *
+ * turn last popped.  Popping and peeking are NULL on an empty queue.   */
+void turn_init(turn_queue_t *q);
+void turn_schedule(turn_queue_t *q, Character *c);
+Character *turn_peek(turn_queue_t *q);
+Character *turn_pop(turn_queue_t *q);
+Character *turn_pop_due(turn_queue_t *q);
+void turn_schedule_chain(turn_queue_t *q, Character *c);
+
+typedef struct npc_store npc_store_t;
+class Npc;
+
+void npc_store_init(npc_store_t *s);
+Npc *npc_new(npc_store_t *s);
+void npc_store_destroy(npc_store_t *s);
+/* Counts distance-map fields invalidated by pathfind() against the ones *
+ * pathfind_need() actually had to compute; the difference was avoided. *
+ * seconds is the time spent computing them.                            */
+typedef struct pathfind_stats {
+  uint32_t requested;
+  uint32_t computed;
+  double seconds;
+} pathfind_stats_t;
+
+extern pathfind_stats_t pathfind_stats;
+
 void pathfind(Map *m);
+/* Forget cached distance maps; needed whenever a Map is (re)allocated */
+void pathfind_invalidate();
 
 int pc_move(char);
 
@@ -1,50 +1,150 @@
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
+#include <cstddef>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <ctime>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "db_parse.h"
 
-static char *next_token(char *start, char delim)
+/**************************************************************************
+ * CSV tokenizing.  A cursor walks a line, or a whole buffer of lines;    *
+ * each call consumes one field and the ',' or '\n' after it.  There is  *
+ * no hidden state, so any number of threads can tokenize at once.       *
+ *                                                                        *
+ * csv_delim() looks for the end of a field 16 (SSE2) or 32 (AVX2) bytes *
+ * at a time.  Its loads are aligned, so they never cross into another   *
+ * page even when they read past the end of the string.  Integer fields  *
+ * are mostly a digit or two, so csv_int() converts as it goes and only  *
+ * falls back to csv_delim() if something other than a digit follows.   *
+ **************************************************************************/
+
+#if defined(__AVX2__)
+# include <immintrin.h>
+# define CSV_VECTOR 32
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+# define CSV_VECTOR 16
+#endif
+
+#ifdef CSV_VECTOR
+/* Bit i is set where p[i] is ',', '\n' or '\0'; p must be aligned */
+static inline uint32_t csv_delim_mask(const char *p)
 {
-  int i;
-  static char *s;
+# if CSV_VECTOR == 32
+  __m256i v = _mm256_load_si256((const __m256i *) p);
+
+  return _mm256_movemask_epi8(
+    _mm256_or_si256(_mm256_or_si256(
+                      _mm256_cmpeq_epi8(v, _mm256_set1_epi8(',')),
+                      _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))),
+                    _mm256_cmpeq_epi8(v, _mm256_setzero_si256())));
+# else
+  __m128i v = _mm_load_si128((const __m128i *) p);
+
+  return _mm_movemask_epi8(
+    _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(',')),
+                              _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))),
+                 _mm_cmpeq_epi8(v, _mm_setzero_si128())));
+# endif
+}
+#endif
+
+/* First ',', '\n' or '\0' at or after p */
+static char *csv_delim(char *p)
+{
+#ifdef CSV_VECTOR
+  uintptr_t off = (uintptr_t) p & (CSV_VECTOR - 1);
+  uint32_t mask;
+
+  p -= off;
+  for (mask = csv_delim_mask(p) & (~0U << off); !mask;
+       mask = csv_delim_mask(p)) {
+    p += CSV_VECTOR;
+  }
 
-  if (start) {
-    s = start;
+  return p + __builtin_ctz(mask);
+#else
+  while (*p && *p != ',' && *p != '\n') {
+    p++;
   }
 
-  start = s;
+  return p;
+#endif
+}
+
+/* Terminates the field in place and returns it */
+static char *csv_field(char **cur)
+{
+  char *start = *cur;
+  char *end = csv_delim(start);
 
-  for (i = 0; s[i] && s[i] != delim; i++)
-    ;
-  s[i] = '\0';
-  s = s + i + 1;
+  *cur = end + (*end != '\0');
+  *end = '\0';
 
   return start;
 }
 
-pokemon_move_db pokemon_moves[528239];
-pokemon_db pokemon[1093];
-char *types[19];
-move_db moves[845];
-pokemon_species_db species[899];
-experience_db experience[601];
-pokemon_stats_db pokemon_stats[6553];
-pokemon_types_db pokemon_types[1676];
+/* Like atoi(), but an empty field reads as empty.  Leaves the text alone. */
+static inline int csv_int(char **cur, int empty)
+{
+  char *p = *cur;
+  unsigned v, d;
+  int neg;
+
+  neg = (*p == '-');
+  p += neg;
+  for (v = 0; (d = (unsigned char) *p - '0') < 10; p++) {
+    v = v * 10 + d;
+  }
+  if (*p != ',' && *p != '\n' && *p) {
+    p = csv_delim(p);
+  }
+
+  d = (p == *cur);
+  *cur = p + (*p != '\0');
+
+  return d ? empty : (neg ? -(int) v : (int) v);
+}
+
 
-void db_parse(bool print)
+/* Every table is 1-indexed; like sizeof did, num_<table> counts slot 0 */
+const pokemon_move_db *pokemon_moves;
+pokemon_db *pokemon;
+char **types;
+move_db *moves;
+pokemon_species_db *species;
+experience_db *experience;
+pokemon_stats_db *pokemon_stats;
+pokemon_types_db *pokemon_types;
+type_name_db *type_names;
+unsigned num_pokemon_moves;
+unsigned num_pokemon;
+unsigned num_types;
+unsigned num_moves;
+unsigned num_species;
+unsigned num_experience;
+unsigned num_pokemon_stats;
+unsigned num_pokemon_types;
+unsigned num_type_names;
+
+unsigned db_parse_threads = 0;
+
+/* Returns the malloc()ed CSV directory, with the trailing slash */
+static char *db_prefix()
 {
-  FILE *f;
-  char line[800];
-  int i;
-  char *tmp;
   struct stat buf;
   char *prefix;
-  int prefix_len;
-  int j;
-  int count;
-  
+  int i;
+
   i = (strlen(getenv("HOME")) +
        strlen("/.poke327/pokedex/pokedex/data/csv/") + 1);
   prefix = (char *) malloc(i);
@@ -63,381 +163,804 @@ void db_parse(bool print)
     // prefix is freed later, so be sure you malloc it
   }
 
-  //No error checking on file load from here on out.  Missing
-  //files are "user error".
-  prefix_len = strlen(prefix);
-
-  prefix = (char *) realloc(prefix, prefix_len + strlen("pokemon.csv") + 1);
-  strcpy(prefix + prefix_len, "pokemon.csv");
-  
-  f = fopen(prefix, "r");
-
-  //No null byte copied here, so prefix is not technically a string anymore.
-  prefix = (char *) realloc(prefix, prefix_len + 1);
-
-  fgets(line, 80, f);
-  
-  for (i = 1; i <= 1092; i++) {
-    fgets(line, 80, f);
-    pokemon[i].id = atoi(next_token(line, ','));
-    strncpy(pokemon[i].identifier, next_token(NULL, ','), 30);
-    pokemon[i].species_id = atoi(next_token(NULL, ','));
-    pokemon[i].height = atoi(next_token(NULL, ','));
-    pokemon[i].weight = atoi(next_token(NULL, ','));
-    pokemon[i].base_experience = atoi(next_token(NULL, ','));
-    pokemon[i].order = atoi(next_token(NULL, ','));
-    pokemon[i].is_default = atoi(next_token(NULL, ','));
-  }  
-
-  fclose(f);
-  
-  if (print) {
-    for (i = 0; i < 1092; i++) {
-      printf("%d %s %d %d %d %d %d %d\n", pokemon[i].id, pokemon[i].identifier,
-             pokemon[i].species_id, pokemon[i].height, pokemon[i].weight,
-             pokemon[i].base_experience, pokemon[i].order, pokemon[i].is_default);
+  return prefix;
+}
+
+/**************************************************************************
+ * The schema.  Each table is a CSV file whose columns map, in order, to *
+ * fields of its record struct.  Nothing here knows how many rows a file *
+ * has; the loader counts them.  db_field_int is atoi(), so an empty    *
+ * field reads 0; db_field_opt is the -1-for-empty convention.           *
+ **************************************************************************/
+
+typedef enum db_field_type {
+  db_field_int,
+  db_field_opt,
+  db_field_string
+} db_field_type_t;
+
+typedef struct db_field {
+  db_field_type_t type;
+  size_t offset;
+  size_t size;
+} db_field_t;
+
+#define DB_INT(s, f)    { db_field_int, offsetof(s, f), 0 }
+#define DB_OPT(s, f)    { db_field_opt, offsetof(s, f), 0 }
+#define DB_STRING(s, f) { db_field_string, offsetof(s, f), sizeof (s::f) }
+
+static const db_field_t pokemon_fields[] = {
+  DB_INT(pokemon_db, id),
+  DB_STRING(pokemon_db, identifier),
+  DB_INT(pokemon_db, species_id),
+  DB_INT(pokemon_db, height),
+  DB_INT(pokemon_db, weight),
+  DB_INT(pokemon_db, base_experience),
+  DB_INT(pokemon_db, order),
+  DB_INT(pokemon_db, is_default),
+};
+
+static const db_field_t move_fields[] = {
+  DB_INT(move_db, id),
+  DB_STRING(move_db, identifier),
+  DB_OPT(move_db, generation_id),
+  DB_OPT(move_db, type_id),
+  DB_OPT(move_db, power),
+  DB_OPT(move_db, pp),
+  DB_OPT(move_db, accuracy),
+  DB_OPT(move_db, priority),
+  DB_OPT(move_db, target_id),
+  DB_OPT(move_db, damage_class_id),
+  DB_OPT(move_db, effect_id),
+  DB_OPT(move_db, effect_chance),
+  DB_OPT(move_db, contest_type_id),
+  DB_OPT(move_db, contest_effect_id),
+  DB_OPT(move_db, super_contest_effect_id),
+};
+
+static const db_field_t pokemon_move_fields[] = {
+  DB_OPT(pokemon_move_db, pokemon_id),
+  DB_OPT(pokemon_move_db, version_group_id),
+  DB_OPT(pokemon_move_db, move_id),
+  DB_OPT(pokemon_move_db, pokemon_move_method_id),
+  DB_OPT(pokemon_move_db, level),
+  DB_OPT(pokemon_move_db, order),
+};
+
+static const db_field_t species_fields[] = {
+  DB_INT(pokemon_species_db, id),
+  DB_STRING(pokemon_species_db, identifier),
+  DB_OPT(pokemon_species_db, generation_id),
+  DB_OPT(pokemon_species_db, evolves_from_species_id),
+  DB_OPT(pokemon_species_db, evolution_chain_id),
+  DB_OPT(pokemon_species_db, color_id),
+  DB_OPT(pokemon_species_db, shape_id),
+  DB_OPT(pokemon_species_db, habitat_id),
+  DB_OPT(pokemon_species_db, gender_rate),
+  DB_OPT(pokemon_species_db, capture_rate),
+  DB_OPT(pokemon_species_db, base_happiness),
+  DB_OPT(pokemon_species_db, is_baby),
+  DB_OPT(pokemon_species_db, hatch_counter),
+  DB_OPT(pokemon_species_db, has_gender_differences),
+  DB_OPT(pokemon_species_db, growth_rate_id),
+  DB_OPT(pokemon_species_db, forms_switchable),
+  DB_OPT(pokemon_species_db, is_legendary),
+  DB_OPT(pokemon_species_db, is_mythical),
+  DB_OPT(pokemon_species_db, order),
+  DB_OPT(pokemon_species_db, conquest_order),
+};
+
+static const db_field_t experience_fields[] = {
+  DB_INT(experience_db, growth_rate_id),
+  DB_OPT(experience_db, level),
+  DB_OPT(experience_db, experience),
+};
+
+static const db_field_t pokemon_type_fields[] = {
+  DB_INT(pokemon_types_db, pokemon_id),
+  DB_OPT(pokemon_types_db, type_id),
+  DB_OPT(pokemon_types_db, slot),
+};
+
+static const db_field_t type_name_fields[] = {
+  DB_INT(type_name_db, type_id),
+  DB_INT(type_name_db, local_language_id),
+  DB_STRING(type_name_db, name),
+};
+
+static const db_field_t pokemon_stat_fields[] = {
+  DB_INT(pokemon_stats_db, pokemon_id),
+  DB_OPT(pokemon_stats_db, stat_id),
+  DB_OPT(pokemon_stats_db, base_stat),
+  DB_OPT(pokemon_stats_db, effort),
+};
+
+typedef struct db_table {
+  const char *file;
+  const db_field_t *fields;
+  unsigned num_fields;
+  size_t record_size;
+  // Address of the table's global pointer and count
+  void *table;
+  unsigned *count;
+  // Served straight out of the cache mapping instead of copied
+  bool mapped;
+} db_table_t;
+
+#define DB_TABLE(file, fields, type, table, count, mapped)         \
+  { file, fields, sizeof (fields) / sizeof (fields[0]), sizeof (type), \
+    (void *) &table, &count, mapped }
+
+static const db_table_t db_tables[] = {
+  DB_TABLE("pokemon.csv", pokemon_fields, pokemon_db,
+           pokemon, num_pokemon, false),
+  DB_TABLE("moves.csv", move_fields, move_db,
+           moves, num_moves, false),
+  DB_TABLE("pokemon_moves.csv", pokemon_move_fields, pokemon_move_db,
+           pokemon_moves, num_pokemon_moves, true),
+  DB_TABLE("pokemon_species.csv", species_fields, pokemon_species_db,
+           species, num_species, false),
+  DB_TABLE("experience.csv", experience_fields, experience_db,
+           experience, num_experience, false),
+  DB_TABLE("pokemon_types.csv", pokemon_type_fields, pokemon_types_db,
+           pokemon_types, num_pokemon_types, false),
+  DB_TABLE("type_names.csv", type_name_fields, type_name_db,
+           type_names, num_type_names, false),
+  DB_TABLE("pokemon_stats.csv", pokemon_stat_fields, pokemon_stats_db,
+           pokemon_stats, num_pokemon_stats, false),
+};
+
+#define DB_NUM_TABLES (sizeof (db_tables) / sizeof (db_tables[0]))
+
+static inline char *&db_table_data(const db_table_t *t)
+{
+  return *(char **) t->table;
+}
+
+static struct {
+  void *base;
+  size_t len;
+} db_cache_map;
+
+/* Frees whatever the last load allocated or mapped */
+static void db_release()
+{
+  unsigned i;
+
+  for (i = 0; i < DB_NUM_TABLES; i++) {
+    if (!db_tables[i].mapped || !db_cache_map.base) {
+      free(db_table_data(db_tables + i));
     }
+    db_table_data(db_tables + i) = NULL;
+    *db_tables[i].count = 0;
   }
+  if (db_cache_map.base) {
+    munmap(db_cache_map.base, db_cache_map.len);
+    db_cache_map.base = NULL;
+  }
+}
 
-
-  prefix = (char *) realloc(prefix, prefix_len + strlen("moves.csv") + 1);
-  strcpy(prefix + prefix_len, "moves.csv");
-  
-  f = fopen(prefix, "r");
-
-  //No null byte copied here, so prefix is not technically a string anymore.
-  prefix = (char *) realloc(prefix, prefix_len + 1);
-
-  fgets(line, 800, f);
-  
-  for (i = 1; i <= 844; i++) {
-    fgets(line, 800, f);
-    moves[i].id = atoi((tmp = next_token(line, ',')));
-    strcpy(moves[i].identifier, (tmp = next_token(NULL, ',')));
-    tmp = next_token(NULL, ',');
-    moves[i].generation_id = *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    moves[i].type_id =  *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    moves[i].power =  *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    moves[i].pp =  *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    moves[i].accuracy =  *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    moves[i].priority =  *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    moves[i].target_id =  *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    moves[i].damage_class_id =  *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    moves[i].effect_id =  *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    moves[i].effect_chance =  *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    moves[i].contest_type_id =  *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    moves[i].contest_effect_id =  *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    moves[i].super_contest_effect_id =  *tmp ? atoi(tmp) : -1;
-  }
-
-  fclose(f);
-  
-  if (print) {
-    for (i = 0; i < 844; i++) {
-      printf("%d %s %d %d %d %d %d %d %d %d %d %d %d %d %d\n",
-             moves[i].id,
-             moves[i].identifier,
-             moves[i].generation_id,
-             moves[i].type_id,
-             moves[i].power,
-             moves[i].pp,
-             moves[i].accuracy,
-             moves[i].priority,
-             moves[i].target_id,
-             moves[i].damage_class_id,
-             moves[i].effect_id,
-             moves[i].effect_chance,
-             moves[i].contest_type_id,
-             moves[i].contest_effect_id,
-             moves[i].super_contest_effect_id);
+/* Fills one zeroed record from one line */
+static void db_parse_row(const db_table_t *t, char *line, char *record)
+{
+  char *cur = line;
+  unsigned i;
+
+  for (i = 0; i < t->num_fields; i++) {
+    switch (t->fields[i].type) {
+    case db_field_int:
+      *(int *) (record + t->fields[i].offset) = csv_int(&cur, 0);
+      break;
+    case db_field_opt:
+      *(int *) (record + t->fields[i].offset) = csv_int(&cur, -1);
+      break;
+    case db_field_string:
+      strncpy(record + t->fields[i].offset, csv_field(&cur),
+              t->fields[i].size - 1);
+      break;
     }
   }
+}
 
-  prefix = (char *) realloc(prefix, prefix_len + strlen("pokemon_moves.csv") + 1);
-  strcpy(prefix + prefix_len, "pokemon_moves.csv");
-  
-  f = fopen(prefix, "r");
+/**************************************************************************
+ * Streaming.  Files are read through a fixed DB_BUFFER-byte window with  *
+ * pread(), never whole.  A file may be cut into byte ranges; a range     *
+ * owns every line that starts inside it, wherever that line ends.  Each *
+ * range is read twice, once to count its rows and once to parse them,   *
+ * so every table is allocated at exactly the size its file needs.       *
+ * Ranges and tables are independent, so both passes run on a pool of    *
+ * threads.                                                               *
+ **************************************************************************/
+
+#define DB_BUFFER (64 * 1024)
+// Files bigger than this are cut into ranges when loading in parallel
+#define DB_SPLIT  (1024 * 1024)
+
+typedef struct db_range {
+  const db_table_t *table;
+  int fd;
+  off_t begin, end;
+  unsigned row;
+  unsigned rows;
+} db_range_t;
+
+/* Counts the range's rows, or parses them when parse is set.  Line 0 of  *
+ * the file is the header.  Backing up a byte from begin tells us whether *
+ * begin starts a line; either way the first thing read is skipped.       */
+static void db_stream(db_range_t *r, bool parse)
+{
+  char *buf, *p, *eol, *record;
+  size_t have;
+  ssize_t n;
+  off_t off;
+  bool skip;
+
+  // Room for a newline after an unterminated last line, and a NUL
+  buf = (char *) malloc(DB_BUFFER + 2);
+  off = r->begin ? r->begin - 1 : 0;
+  record = NULL;
+  if (parse) {
+    record = (db_table_data(r->table) +
+              (size_t) r->row * r->table->record_size);
+  } else {
+    r->rows = 0;
+  }
 
-  //No null byte copied here, so prefix is not technically a string anymore.
-  prefix = (char *) realloc(prefix, prefix_len + 1);
+  for (skip = true, have = 0; ; ) {
+    n = pread(r->fd, buf + have, DB_BUFFER - have, off + have);
+    if (n > 0) {
+      have += n;
+    } else if (have && buf[have - 1] != '\n') {
+      buf[have++] = '\n';
+    }
+    buf[have] = '\0';
+
+    for (p = buf; (eol = (char *) memchr(p, '\n', buf + have - p));
+         p = eol + 1) {
+      if (off + (p - buf) >= r->end) {
+        n = 0;
+        break;
+      }
+      if (skip) {
+        skip = false;
+      } else if (parse) {
+        db_parse_row(r->table, p, record);
+        record += r->table->record_size;
+      } else {
+        r->rows++;
+      }
+    }
 
-  fgets(line, 800, f);
-  
-  for (i = 1; i <= 528238; i++) {
-    fgets(line, 800, f);
-    tmp = next_token(line, ',');
-    pokemon_moves[i].pokemon_id = *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    pokemon_moves[i].version_group_id = *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    pokemon_moves[i].move_id = *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    pokemon_moves[i].pokemon_move_method_id = *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    pokemon_moves[i].level = *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    pokemon_moves[i].order = (*tmp != '\n') ? atoi(tmp) : -1;
+    if (n <= 0) {
+      break;
+    }
+
+    have = buf + have - p;
+    off += p - buf;
+    memmove(buf, p, have);
+    if (have == DB_BUFFER) {
+      // No line is this long; drop it rather than spin
+      off += have;
+      have = 0;
+      skip = true;
+    }
   }
 
-  fclose(f);
+  free(buf);
+}
 
-  if (print) {
-    for (i = 0; i < 528238; i++) {
-      printf("%d %d %d %d %d %d\n",
-             pokemon_moves[i].pokemon_id,
-             pokemon_moves[i].version_group_id,
-             pokemon_moves[i].move_id,
-             pokemon_moves[i].pokemon_move_method_id,
-             pokemon_moves[i].level,
-             pokemon_moves[i].order);
+static void db_run(db_range_t *ranges, unsigned num_ranges, bool parse,
+                   unsigned num_threads)
+{
+  std::atomic<unsigned> next(0);
+  std::vector<std::thread> pool;
+  unsigned i;
+
+  auto work = [&]() {
+    unsigned r;
+
+    while ((r = next++) < num_ranges) {
+      db_stream(ranges + r, parse);
     }
+  };
+
+  for (i = 1; i < num_threads; i++) {
+    pool.push_back(std::thread(work));
+  }
+  work();
+  for (i = 0; i < pool.size(); i++) {
+    pool[i].join();
   }
+}
 
-  prefix = (char *) realloc(prefix, prefix_len + strlen("pokemon_species.csv") + 1);
-  strcpy(prefix + prefix_len, "pokemon_species.csv");
-  
-  f = fopen(prefix, "r");
-
-  //No null byte copied here, so prefix is not technically a string anymore.
-  prefix = (char *) realloc(prefix, prefix_len + 1);
-
-  fgets(line, 800, f);
-  
-  for (i = 1; i <= 898; i++) {
-    fgets(line, 800, f);
-    species[i].id = atoi((tmp = next_token(line, ',')));
-    strcpy(species[i].identifier, (tmp = next_token(NULL, ',')));
-    tmp = next_token(NULL, ',');
-    species[i].generation_id = *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    species[i].evolves_from_species_id =  *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    species[i].evolution_chain_id =  *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    species[i].color_id =  *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    species[i].shape_id =  *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    species[i].habitat_id =  *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    species[i].gender_rate =  *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    species[i].capture_rate =  *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    species[i].base_happiness =  *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    species[i].is_baby =  *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    species[i].hatch_counter =  *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    species[i].has_gender_differences =  *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    species[i].growth_rate_id =  *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    species[i].forms_switchable =  *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    species[i].is_legendary =  *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    species[i].is_mythical =  *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    species[i].order =  *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    species[i].conquest_order =  *tmp ? atoi(tmp) : -1;
-    species[i].levelup_moves = 0;
-    species[i].num_levelup_moves = 0;
-    species[i].base_stat[0] = species[i].base_stat[1] =
-      species[i].base_stat[2] = species[i].base_stat[3] =
-      species[i].base_stat[4] = species[i].base_stat[5] = 0;
-    
-  }
-
-  fclose(f);
+/* English names, indexed by type id, pointing into type_names */
+static void db_index_types()
+{
+  unsigned i;
 
-  if (print) {
-    for (i = 0; i <= 898; i++) {
-      printf("%d %s %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d\n",
-             species[i].id,
-             species[i].identifier,
-             species[i].generation_id,
-             species[i].evolves_from_species_id,
-             species[i].evolution_chain_id,
-             species[i].color_id,
-             species[i].shape_id,
-             species[i].habitat_id,
-             species[i].gender_rate,
-             species[i].capture_rate,
-             species[i].base_happiness,
-             species[i].is_baby,
-             species[i].hatch_counter,
-             species[i].has_gender_differences,
-             species[i].growth_rate_id,
-             species[i].forms_switchable,
-             species[i].is_legendary,
-             species[i].is_mythical,
-             species[i].order,
-             species[i].conquest_order);
+  free(types);
+  for (num_types = 0, i = 1; i < num_type_names; i++) {
+    if (type_names[i].type_id >= (int) num_types) {
+      num_types = type_names[i].type_id + 1;
+    }
+  }
+  types = (char **) calloc(num_types, sizeof (*types));
+  for (i = 1; i < num_type_names; i++) {
+    if (type_names[i].local_language_id == 9 && type_names[i].type_id > 0) {
+      types[type_names[i].type_id] = type_names[i].name;
     }
   }
+}
 
+/* Frees prefix when done */
+static void db_parse_csv(char *prefix)
+{
+  std::vector<db_range_t> ranges;
+  unsigned threads, pieces, row;
+  unsigned i, j, k;
+  struct stat buf;
+  char *path;
+  int fd[DB_NUM_TABLES];
 
-  prefix = (char *) realloc(prefix, prefix_len + strlen("experience.csv") + 1);
-  strcpy(prefix + prefix_len, "experience.csv");
-  
-  f = fopen(prefix, "r");
+  //No error checking on file load from here on out.  Missing
+  //files are "user error".
 
-  //No null byte copied here, so prefix is not technically a string anymore.
-  prefix = (char *) realloc(prefix, prefix_len + 1);
+  threads = db_parse_threads;
+  if (!threads) {
+    threads = std::thread::hardware_concurrency();
+  }
+  if (!threads) {
+    threads = 1;
+  }
 
-  fgets(line, 800, f);
-  
-  for (i = 1; i <= 600; i++) {
-    fgets(line, 800, f);
-    experience[i].growth_rate_id = atoi((tmp = next_token(line, ',')));
-    tmp = next_token(NULL, ',');
-    experience[i].level = *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    experience[i].experience =  *tmp ? atoi(tmp) : -1;
+  db_release();
+
+  path = (char *) malloc(strlen(prefix) + strlen("pokemon_species.csv") + 1);
+  for (i = 0; i < DB_NUM_TABLES; i++) {
+    strcpy(path, prefix);
+    strcat(path, db_tables[i].file);
+    fd[i] = open(path, O_RDONLY);
+    fstat(fd[i], &buf);
+    // A few ranges per thread evens out the load
+    pieces = std::min<off_t>(threads > 1 ? threads * 4 : 1,
+                             buf.st_size / DB_SPLIT + 1);
+    for (j = 0; j < pieces; j++) {
+      ranges.push_back(db_range_t());
+      ranges.back().table = db_tables + i;
+      ranges.back().fd = fd[i];
+      ranges.back().begin = buf.st_size * j / pieces;
+      ranges.back().end = buf.st_size * (j + 1) / pieces;
+    }
   }
+  free(path);
 
-  fclose(f);
+  db_run(ranges.data(), ranges.size(), false, threads);
 
-  if (print) {
-    for (i = 0; i <= 600; i++) {
-      printf("%d %d %d\n",
-             experience[i].growth_rate_id,
-             experience[i].level,
-             experience[i].experience);
+  for (i = k = 0; i < DB_NUM_TABLES; i++) {
+    for (row = 1; k < ranges.size() && ranges[k].table == db_tables + i; k++) {
+      ranges[k].row = row;
+      row += ranges[k].rows;
     }
+    *db_tables[i].count = row;
+    db_table_data(db_tables + i) = (char *) calloc(row,
+                                                   db_tables[i].record_size);
   }
 
-  prefix = (char *) realloc(prefix, prefix_len + strlen("pokemon_types.csv") + 1);
-  strcpy(prefix + prefix_len, "pokemon_types.csv");
-  
-  f = fopen(prefix, "r");
+  db_run(ranges.data(), ranges.size(), true, threads);
 
-  //No null byte copied here, so prefix is not technically a string anymore.
-  prefix = (char *) realloc(prefix, prefix_len + 1);
-
-  fgets(line, 800, f);
-  
-  for (i = 1; i <= 1675; i++) {
-    fgets(line, 800, f);
-    pokemon_types[i].pokemon_id = atoi((tmp = next_token(line, ',')));
-    tmp = next_token(NULL, ',');
-    pokemon_types[i].type_id = *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    pokemon_types[i].slot =  *tmp ? atoi(tmp) : -1;
+  for (i = 0; i < DB_NUM_TABLES; i++) {
+    close(fd[i]);
   }
 
-  fclose(f);
+  free(prefix);
+}
 
-  if (print) {
-    for (i = 0; i <= 600; i++) {
-      printf("%d %d %d\n",
-             pokemon_types[i].pokemon_id,
-             pokemon_types[i].type_id,
-             pokemon_types[i].slot);
+/**************************************************************************
+ * Level-up movesets for every species, built once per load as a CSR    *
+ * index: species i's moves are levelup_index[start[i]] onward, so a    *
+ * Pokemon is just a slice lookup.  A counting pass sizes each species'  *
+ * slice, a second pass drops method 1 rows into their slices in file    *
+ * order, then each slice is deduplicated by move (first row wins) and  *
+ * sorted by level.                                                      *
+ **************************************************************************/
+static levelup_move *levelup_index;
+
+static bool compare_move(const levelup_move &m1, const levelup_move &m2)
+{
+  return m1.level < m2.level;
+}
+
+static void db_index_species()
+{
+  std::vector<unsigned> start(num_species + 1), fill;
+  unsigned *seen, num_seen;
+  unsigned i, j, n, id;
+  levelup_move *l;
+
+  for (num_seen = 0, i = 1; i < num_pokemon_moves; i++) {
+    id = pokemon_moves[i].pokemon_id;
+    if (pokemon_moves[i].pokemon_move_method_id == 1 &&
+        id > 0 && id < num_species) {
+      start[id + 1]++;
+      if (pokemon_moves[i].move_id >= (int) num_seen) {
+        num_seen = pokemon_moves[i].move_id + 1;
+      }
     }
   }
+  for (i = 1; i <= num_species; i++) {
+    start[i] += start[i - 1];
+  }
 
-  prefix = (char *) realloc(prefix, prefix_len + strlen("type_names.csv") + 1);
-  strcpy(prefix + prefix_len, "type_names.csv");
-  
-  f = fopen(prefix, "r");
-
-  //No null byte copied here, so prefix is not technically a string anymore.
-  prefix = (char *) realloc(prefix, prefix_len + 1);
-
-  fgets(line, 800, f);
-  
-  for (i = 1; i <= 18; i++) {
-    fgets(line, 800, f); //  1
-    fgets(line, 800, f); //  3
-    fgets(line, 800, f); //  4
-    fgets(line, 800, f); //  5
-    fgets(line, 800, f); //  6
-    fgets(line, 800, f); //  7
-    fgets(line, 800, f); //  8
-    fgets(line, 800, f); //  9 - English
-    for (j = count = 0; count < 2; j++) {
-      if (line[j] == ',') {
-        count++;
+  free(levelup_index);
+  levelup_index = (levelup_move *) malloc((start[num_species] + 1) *
+                                          sizeof (*levelup_index));
+  fill = start;
+  for (i = 1; i < num_pokemon_moves; i++) {
+    id = pokemon_moves[i].pokemon_id;
+    if (pokemon_moves[i].pokemon_move_method_id == 1 &&
+        id > 0 && id < num_species) {
+      levelup_index[fill[id]].level = pokemon_moves[i].level;
+      levelup_index[fill[id]].move = pokemon_moves[i].move_id;
+      fill[id]++;
+    }
+  }
+
+  // seen[move] == species id marks a move already kept for that species
+  seen = (unsigned *) calloc(num_seen + 1, sizeof (*seen));
+  for (i = 0; i < num_species; i++) {
+    l = levelup_index + start[i];
+    for (n = 0, j = 0; j < start[i + 1] - start[i]; j++) {
+      if (l[j].move >= 0 && seen[l[j].move] != i) {
+        seen[l[j].move] = i;
+        l[n++] = l[j];
       }
     }
-    line[strlen(line) - 1] = '\0';
-    types[i] = strdup(line + j);
-    fgets(line, 800, f); // 11
-    fgets(line, 800, f); // 12
+    // Stable, so equal levels keep file order as qsort() did here
+    std::stable_sort(l, l + n, compare_move);
+    species[i].levelup_moves = l;
+    species[i].num_levelup_moves = n;
+
+    // pokemon_stats has six rows per species, 1-indexed
+    for (j = 0; i && j < 6 && i * 6 - 5 + j < num_pokemon_stats; j++) {
+      species[i].base_stat[j] = pokemon_stats[i * 6 - 5 + j].base_stat;
+    }
   }
+  free(seen);
+}
 
-  fclose(f);
+static void db_print()
+{
+  unsigned i;
 
-  if (print) {
-    for (i = 1; i <= 18; i++) {
-      printf("%s\n", types[i]);
-    }
+  for (i = 0; i < num_pokemon; i++) {
+    printf("%d %s %d %d %d %d %d %d\n", pokemon[i].id, pokemon[i].identifier,
+           pokemon[i].species_id, pokemon[i].height, pokemon[i].weight,
+           pokemon[i].base_experience, pokemon[i].order, pokemon[i].is_default);
+  }
+
+  for (i = 0; i < num_moves; i++) {
+    printf("%d %s %d %d %d %d %d %d %d %d %d %d %d %d %d\n",
+           moves[i].id,
+           moves[i].identifier,
+           moves[i].generation_id,
+           moves[i].type_id,
+           moves[i].power,
+           moves[i].pp,
+           moves[i].accuracy,
+           moves[i].priority,
+           moves[i].target_id,
+           moves[i].damage_class_id,
+           moves[i].effect_id,
+           moves[i].effect_chance,
+           moves[i].contest_type_id,
+           moves[i].contest_effect_id,
+           moves[i].super_contest_effect_id);
   }
 
-  
+  for (i = 0; i < num_pokemon_moves; i++) {
+    printf("%d %d %d %d %d %d\n",
+           pokemon_moves[i].pokemon_id,
+           pokemon_moves[i].version_group_id,
+           pokemon_moves[i].move_id,
+           pokemon_moves[i].pokemon_move_method_id,
+           pokemon_moves[i].level,
+           pokemon_moves[i].order);
+  }
 
-  prefix = (char *) realloc(prefix, prefix_len + strlen("pokemon_stats.csv") + 1);
-  strcpy(prefix + prefix_len, "pokemon_stats.csv");
-  
-  f = fopen(prefix, "r");
+  for (i = 0; i < num_species; i++) {
+    printf("%d %s %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d\n",
+           species[i].id,
+           species[i].identifier,
+           species[i].generation_id,
+           species[i].evolves_from_species_id,
+           species[i].evolution_chain_id,
+           species[i].color_id,
+           species[i].shape_id,
+           species[i].habitat_id,
+           species[i].gender_rate,
+           species[i].capture_rate,
+           species[i].base_happiness,
+           species[i].is_baby,
+           species[i].hatch_counter,
+           species[i].has_gender_differences,
+           species[i].growth_rate_id,
+           species[i].forms_switchable,
+           species[i].is_legendary,
+           species[i].is_mythical,
+           species[i].order,
+           species[i].conquest_order);
+  }
+
+  for (i = 0; i < num_experience; i++) {
+    printf("%d %d %d\n",
+           experience[i].growth_rate_id,
+           experience[i].level,
+           experience[i].experience);
+  }
 
-  //No null byte copied here, so prefix is not technically a string anymore.
-  prefix = (char *) realloc(prefix, prefix_len + 1);
+  for (i = 0; i < num_pokemon_types; i++) {
+    printf("%d %d %d\n",
+           pokemon_types[i].pokemon_id,
+           pokemon_types[i].type_id,
+           pokemon_types[i].slot);
+  }
 
-  fgets(line, 800, f);
-  
-  for (i = 1; i <= 6552; i++) {
-    fgets(line, 800, f);
-    pokemon_stats[i].pokemon_id = atoi((tmp = next_token(line, ',')));
-    tmp = next_token(NULL, ',');
-    pokemon_stats[i].stat_id = *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    pokemon_stats[i].base_stat =  *tmp ? atoi(tmp) : -1;
-    tmp = next_token(NULL, ',');
-    pokemon_stats[i].effort =  *tmp ? atoi(tmp) : -1;
+  for (i = 1; i < num_types; i++) {
+    printf("%s\n", types[i] ? types[i] : "");
   }
 
-  fclose(f);
+  for (i = 0; i < num_pokemon_stats; i++) {
+    printf("%d %d %d %d\n",
+           pokemon_stats[i].pokemon_id,
+           pokemon_stats[i].stat_id,
+           pokemon_stats[i].base_stat,
+           pokemon_stats[i].effort);
+  }
+}
 
-  if (print) {
-    for (i = 0; i <= 6552; i++) {
-      printf("%d %d %d %d\n",
-             pokemon_stats[i].pokemon_id,
-             pokemon_stats[i].stat_id,
-             pokemon_stats[i].base_stat,
-             pokemon_stats[i].effort);
+/**************************************************************************
+ * The binary cache is every table in db_tables dumped back to back,     *
+ * after a header recording each one's row count, record size and       *
+ * offset.  It is only ever read by the machine that wrote it, so the    *
+ * records are raw structs; the version, record sizes and checksum catch *
+ * a stale or truncated file, and any mismatch just means we parse the   *
+ * CSVs again.  Mapped tables are used straight out of the read-only     *
+ * mapping.  The others are small and some get written to at runtime, so *
+ * they are copied.                                                       *
+ **************************************************************************/
+
+#define DB_CACHE_MAGIC   "P327DB\0"
+#define DB_CACHE_VERSION 2
+
+typedef struct db_cache_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t count[DB_NUM_TABLES];
+  uint32_t record_size[DB_NUM_TABLES];
+  uint64_t offset[DB_NUM_TABLES];
+  uint64_t size;
+  uint64_t checksum;
+} db_cache_header_t;
+
+/* FNV-1a a word at a time, continuing from h; a short last word is *
+ * zero-padded, the same as the padding after each table.           */
+static uint64_t db_checksum(uint64_t h, const void *p, size_t len)
+{
+  const uint64_t *w = (const uint64_t *) p;
+  uint64_t tail;
+  size_t i;
+
+  for (i = 0; i < len / sizeof (*w); i++) {
+    h ^= w[i];
+    h *= 1099511628211ULL;
+  }
+  if (len % sizeof (*w)) {
+    tail = 0;
+    memcpy(&tail, w + i, len % sizeof (*w));
+    h ^= tail;
+    h *= 1099511628211ULL;
+  }
+
+  return h;
+}
+
+/* Given counts, fills in everything else but the checksum */
+static void db_cache_layout(db_cache_header_t *h)
+{
+  uint64_t off;
+  unsigned t;
+
+  memcpy(h->magic, DB_CACHE_MAGIC, sizeof (h->magic));
+  h->version = DB_CACHE_VERSION;
+  for (off = sizeof (*h), t = 0; t < DB_NUM_TABLES; t++) {
+    h->record_size[t] = db_tables[t].record_size;
+    h->offset[t] = off;
+    off += ((uint64_t) h->count[t] * h->record_size[t] + 7) & ~7ULL;
+  }
+  h->size = off;
+}
+
+static char *db_cache_path()
+{
+  char *path;
+
+  path = (char *) malloc(strlen(getenv("HOME")) +
+                         strlen("/.poke327/pokedex.cache") + 1);
+  strcpy(path, getenv("HOME"));
+  strcat(path, "/.poke327/pokedex.cache");
+
+  return path;
+}
+
+static bool newer(const struct timespec *a, const struct timespec *b)
+{
+  return a->tv_sec > b->tv_sec ||
+         (a->tv_sec == b->tv_sec && a->tv_nsec > b->tv_nsec);
+}
+
+/* Stale if the cache is missing or any CSV was touched after it */
+static bool db_cache_fresh(const char *prefix, const char *path)
+{
+  struct stat cache, csv;
+  char *name;
+  unsigned i;
+  bool fresh;
+
+  if (stat(path, &cache)) {
+    return false;
+  }
+
+  name = (char *) malloc(strlen(prefix) + strlen("pokemon_species.csv") + 1);
+  for (fresh = true, i = 0; fresh && i < DB_NUM_TABLES; i++) {
+    strcpy(name, prefix);
+    strcat(name, db_tables[i].file);
+    if (stat(name, &csv) || newer(&csv.st_mtim, &cache.st_mtim)) {
+      fresh = false;
     }
   }
+  free(name);
+
+  return fresh;
+}
 
-  /*
-  for (i = 0; i < 6; i++) {
-    printf("%d ", pokemon_stats[(150) * 6 - 5 + i].base_stat);
+static int db_cache_load(const char *path)
+{
+  db_cache_header_t want, *h;
+  struct stat buf;
+  const char *base;
+  uint64_t sum;
+  size_t len;
+  void *p;
+  unsigned i;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    return -1;
   }
-  printf("\n");
-  */
-  
-  free(prefix);
+  if (fstat(fd, &buf) || (size_t) buf.st_size < sizeof (*h)) {
+    close(fd);
+    return -1;
+  }
+  p = mmap(NULL, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    return -1;
+  }
+
+  h = (db_cache_header_t *) p;
+  base = (const char *) p;
+  memcpy(want.count, h->count, sizeof (want.count));
+  db_cache_layout(&want);
+  for (sum = 14695981039346656037ULL, i = 0;
+       want.size == (uint64_t) buf.st_size && i < DB_NUM_TABLES;
+       i++) {
+    sum = db_checksum(sum, base + want.offset[i],
+                      (size_t) want.count[i] * want.record_size[i]);
+  }
+  if (memcmp(h->magic, want.magic, sizeof (want.magic))                 ||
+      h->version != want.version                                        ||
+      memcmp(h->record_size, want.record_size, sizeof (want.record_size)) ||
+      memcmp(h->offset, want.offset, sizeof (want.offset))              ||
+      h->size != want.size || want.size != (uint64_t) buf.st_size       ||
+      h->checksum != sum) {
+    munmap(p, buf.st_size);
+    return -1;
+  }
+
+  db_release();
+  db_cache_map.base = p;
+  db_cache_map.len = buf.st_size;
+
+  for (i = 0; i < DB_NUM_TABLES; i++) {
+    *db_tables[i].count = h->count[i];
+    len = (size_t) h->count[i] * h->record_size[i];
+    if (db_tables[i].mapped) {
+      db_table_data(db_tables + i) = (char *) base + h->offset[i];
+    } else {
+      db_table_data(db_tables + i) = (char *) malloc(len);
+      memcpy(db_table_data(db_tables + i), base + h->offset[i], len);
+    }
+  }
+
+  return 0;
+}
+
+/* Best effort.  Streamed out table by table, so it costs no extra copy *
+ * of the data.  Written to a temporary and renamed into place, so a    *
+ * concurrent or interrupted run never sees half a cache.               */
+static void db_cache_save(const char *path)
+{
+  static const char pad[8] = { 0 };
+  db_cache_header_t h;
+  char *tmp;
+  size_t len;
+  FILE *f;
+  bool ok;
+  unsigned i;
+
+  memset(&h, 0, sizeof (h));
+  for (i = 0; i < DB_NUM_TABLES; i++) {
+    h.count[i] = *db_tables[i].count;
+  }
+  db_cache_layout(&h);
+
+  tmp = (char *) malloc(strlen(path) + strlen(".tmp") + 1);
+  strcpy(tmp, path);
+  strcat(tmp, ".tmp");
+  if (!(f = fopen(tmp, "w"))) {
+    free(tmp);
+    return;
+  }
+
+  // Header goes in last, once the checksum is known
+  ok = fwrite(&h, sizeof (h), 1, f) == 1;
+  for (h.checksum = 14695981039346656037ULL, i = 0;
+       ok && i < DB_NUM_TABLES;
+       i++) {
+    len = (size_t) h.count[i] * h.record_size[i];
+    h.checksum = db_checksum(h.checksum, db_table_data(db_tables + i), len);
+    ok = ((!len || fwrite(db_table_data(db_tables + i), len, 1, f) == 1) &&
+          (!(len % 8) || fwrite(pad, 8 - len % 8, 1, f) == 1));
+  }
+  ok = ok && !fseek(f, 0, SEEK_SET) && fwrite(&h, sizeof (h), 1, f) == 1;
+  ok = !fclose(f) && ok;
+  if (!ok || rename(tmp, path)) {
+    unlink(tmp);
+  }
+
+  free(tmp);
 }
 
-pokemon_species_db::~pokemon_species_db()
+db_source_t db_parse(bool print, bool use_cache)
 {
-  if (levelup_moves) {
-    free(levelup_moves);
+  char *prefix, *path, *dir;
+  db_source_t source;
+
+  prefix = db_prefix();
+  path = db_cache_path();
+
+  if (use_cache && db_cache_fresh(prefix, path) && !db_cache_load(path)) {
+    free(prefix);
+    source = db_source_cache;
+  } else {
+    db_parse_csv(prefix);
+    // The CSVs may live in /share, in which case this may not exist yet
+    dir = strdup(path);
+    *strrchr(dir, '/') = '\0';
+    mkdir(dir, 0700);
+    free(dir);
+    db_cache_save(path);
+    source = db_source_csv;
   }
+
+  free(path);
+
+  db_index_types();
+  db_index_species();
+
+  if (print) {
+    db_print();
+  }
+
+  return source;
 }
@@ -68,10 +68,11 @@ struct pokemon_species_db {
   int order;
   int conquest_order;
 
+  /* Filled in by db_parse(); levelup_moves is this species' slice of *
+   * one shared array, deduplicated and sorted by level.              */
   levelup_move *levelup_moves;
   unsigned num_levelup_moves;
   int base_stat[6];
-  ~pokemon_species_db();
 };
 
 struct experience_db {
@@ -93,16 +94,45 @@ struct pokemon_types_db {
   int slot;
 };
 
-extern pokemon_move_db pokemon_moves[528239];
-extern pokemon_db pokemon[1093];
-extern char *types[19];
-extern move_db moves[845];
-extern pokemon_species_db species[899];
-extern experience_db experience[601];
-extern pokemon_stats_db pokemon_stats[6553];
-extern pokemon_types_db pokemon_types[1676];
+struct type_name_db {
+  int type_id;
+  int local_language_id;
+  char name[30];
+};
+
+/* Sized from the files at load time.  Every table is 1-indexed, and *
+ * num_<table> counts the unused slot 0, as sizeof used to.           *
+ * pokemon_moves points into the mapped cache when db_parse() used it. */
+extern const pokemon_move_db *pokemon_moves;
+extern pokemon_db *pokemon;
+extern char **types;
+extern move_db *moves;
+extern pokemon_species_db *species;
+extern experience_db *experience;
+extern pokemon_stats_db *pokemon_stats;
+extern pokemon_types_db *pokemon_types;
+extern type_name_db *type_names;
+extern unsigned num_pokemon_moves;
+extern unsigned num_pokemon;
+extern unsigned num_types;
+extern unsigned num_moves;
+extern unsigned num_species;
+extern unsigned num_experience;
+extern unsigned num_pokemon_stats;
+extern unsigned num_pokemon_types;
+extern unsigned num_type_names;
+
+/* Threads for loading the CSVs: 0 means one per core, 1 the serial loader */
+extern unsigned db_parse_threads;
 
+typedef enum db_source {
+  db_source_csv,
+  db_source_cache
+} db_source_t;
 
-void db_parse(bool print);
+/* Loads every table, from the binary cache in ~/.poke327 when it is *
+ * newer than all of the CSVs and from the CSVs (refreshing the      *
+ * cache) otherwise.  use_cache = false forces the CSV path.         */
+db_source_t db_parse(bool print, bool use_cache = true);
 
 #endif
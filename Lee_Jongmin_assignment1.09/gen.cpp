@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "heap.h"
+#include "poke327.h"
+#include "mapgen.h"
+#include "timing.h"
+
+/**************************************************************************
+ * poke327-gen: bakes a block of maps offline, without a terminal.  Maps *
+ * are generated on every core and written to one file:                 *
+ *                                                                        *
+ *   gen_header_t, then width * height records in row-major order, each  *
+ *   the map's gates (n, s, e, w as int16_t; -1 where there is none)      *
+ *   followed by its terrain as Map packs it: row by row, two cells to a  *
+ *   byte, low nibble first, an odd last cell in a byte of its own.       *
+ *                                                                        *
+ * Maps are map_x by map_y, MAP_X by MAP_Y unless -m says otherwise, in  *
+ * a world of world_size by world_size maps (-w).                        *
+ *                                                                        *
+ * Heights only steer path building, so they aren't kept.  Maps are the  *
+ * same ones the game makes for the same seed, and with -a, the ones it  *
+ * makes with --astar-paths; the header's flags say which.               *
+ **************************************************************************/
+
+#define GEN_MAGIC   "P327MAP"
+#define GEN_VERSION 3
+#define GEN_RECORD  (4 * sizeof (int16_t) + TerrainGrid::bytes())
+
+#define GEN_FLAG_ASTAR 0x1
+
+typedef struct gen_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t seed;
+  int32_t x, y;
+  uint32_t width, height;
+  uint32_t map_x, map_y;
+  uint32_t world_size;
+  uint32_t flags;
+} gen_header_t;
+
+static void write_map(const Map *m, uint8_t *out)
+{
+  int16_t gate[4] = { m->n, m->s, m->e, m->w };
+
+  memcpy(out, gate, sizeof (gate));
+  memcpy(out + sizeof (gate), m->map.packed, TerrainGrid::bytes());
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-a] [-j threads] [-m WxH] [-w world] [-o file] "
+          "seed width height [x y]\n"
+          "Generates the width x height block of maps whose top left is "
+          "(x, y),\ncentred on the middle of the world by default, and "
+          "writes it to file\n(maps.bin by default).  -a lays paths with "
+          "A*; -m and -w set the map\nand world size.\n", name);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *file;
+  unsigned threads, i, n;
+  std::atomic<unsigned> next(0);
+  std::vector<std::thread> pool;
+  std::vector<mapgen_stats_t> stats;
+  mapgen_stats_t total;
+  gen_header_t h;
+  uint8_t *out;
+  double t, sum;
+  FILE *f;
+  int o, mx, my;
+
+  file = "maps.bin";
+  threads = std::thread::hardware_concurrency();
+  while ((o = getopt(argc, argv, "aj:m:o:w:")) != -1) {
+    switch (o) {
+    case 'a':
+      mapgen_astar = true;
+      break;
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    case 'm':
+      if (sscanf(optarg, "%dx%d", &mx, &my) != 2 ||
+          mapgen_set_size(mx, my, world_size)) {
+        fprintf(stderr, "Map size is WxH, from %dx%d up to %dx%d.\n",
+                MAP_MIN_X, MAP_MIN_Y, MAP_MAX, MAP_MAX);
+        return 1;
+      }
+      break;
+    case 'o':
+      file = optarg;
+      break;
+    case 'w':
+      if (mapgen_set_size(map_x, map_y, atoi(optarg))) {
+        fprintf(stderr, "World size is from 2 up to %d maps a side.\n",
+                WORLD_MAX);
+        return 1;
+      }
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if ((argc - optind != 3 && argc - optind != 5) || !threads) {
+    usage(argv[0]);
+  }
+
+  memset(&h, 0, sizeof (h));
+  memcpy(h.magic, GEN_MAGIC, sizeof (h.magic));
+  h.version = GEN_VERSION;
+  h.seed = strtoul(argv[optind], NULL, 0);
+  h.width = atoi(argv[optind + 1]);
+  h.height = atoi(argv[optind + 2]);
+  if (argc - optind == 5) {
+    h.x = atoi(argv[optind + 3]);
+    h.y = atoi(argv[optind + 4]);
+  } else {
+    h.x = world_size / 2 - h.width / 2;
+    h.y = world_size / 2 - h.height / 2;
+  }
+  h.map_x = map_x;
+  h.map_y = map_y;
+  h.world_size = world_size;
+  h.flags = mapgen_astar ? GEN_FLAG_ASTAR : 0;
+  if (!h.width || !h.height || h.x < 0 || h.y < 0 ||
+      h.x + h.width > h.world_size || h.y + h.height > h.world_size) {
+    fprintf(stderr, "Block must be non-empty and within the %dx%d world.\n",
+            world_size, world_size);
+    return 1;
+  }
+
+  n = h.width * h.height;
+  out = (uint8_t *) malloc((size_t) n * GEN_RECORD);
+  stats.resize(threads);
+  memset(stats.data(), 0, threads * sizeof (stats[0]));
+
+  auto work = [&](mapgen_stats_t *mine) {
+    unsigned i;
+    Map *m;
+
+    while ((i = next++) < n) {
+      m = generate_map(h.seed, h.x + i % h.width, h.y + i / h.width, mine);
+      write_map(m, out + (size_t) i * GEN_RECORD);
+      free(m);
+    }
+    mapgen_thread_exit();
+  };
+
+  t = now();
+  for (i = 1; i < threads; i++) {
+    pool.push_back(std::thread(work, &stats[i]));
+  }
+  work(&stats[0]);
+  for (i = 0; i < pool.size(); i++) {
+    pool[i].join();
+  }
+  t = now() - t;
+
+  if (!(f = fopen(file, "w"))) {
+    perror(file);
+    return 1;
+  }
+  if (fwrite(&h, sizeof (h), 1, f) != 1 ||
+      fwrite(out, GEN_RECORD, n, f) != n || fclose(f)) {
+    perror(file);
+    return 1;
+  }
+  free(out);
+
+  printf("%u maps in %.1f ms on %u threads, %.0f maps/s, %zu bytes to %s\n",
+         n, t * 1e3, threads, n / t, sizeof (h) + (size_t) n * GEN_RECORD,
+         file);
+
+  // Stage times are summed over threads, so they add up to CPU time
+  memset(&total, 0, sizeof (total));
+  for (sum = 0, o = 0; o < num_mapgen_stages; o++) {
+    for (i = 0; i < threads; i++) {
+      total.stage[o] += stats[i].stage[o];
+    }
+    sum += total.stage[o];
+  }
+  for (i = 0; i < threads; i++) {
+    total.paths += stats[i].paths;
+    total.expanded += stats[i].expanded;
+  }
+  for (o = 0; o < num_mapgen_stages; o++) {
+    printf("  %-10s %9.1f ms %5.1f%%  %7.1f us/map\n", mapgen_stage_name[o],
+           total.stage[o] * 1e3, sum ? 100 * total.stage[o] / sum : 0.0,
+           total.stage[o] * 1e6 / n);
+  }
+  printf("%u paths by %s, %.1f cells expanded per path\n", total.paths,
+         mapgen_astar ? "A*" : "Dijkstra",
+         total.paths ? (double) total.expanded / total.paths : 0.0);
+
+  return 0;
+}
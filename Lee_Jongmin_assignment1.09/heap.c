@@ -5,6 +5,16 @@
 
 #include "heap.h"
 
+#ifdef HEAP_DARY
+
+struct heap_node {
+  heap_node_t *next;
+  void *datum;
+  uint32_t index;
+};
+
+#else
+
 struct heap_node {
   heap_node_t *next;
   heap_node_t *prev;
@@ -15,6 +25,114 @@ struct heap_node {
   uint32_t mark;
 };
 
+#endif
+
+#define HEAP_SLAB_NODES 1024
+
+struct heap_slab {
+  struct heap_slab *next;
+  heap_node_t node[HEAP_SLAB_NODES];
+};
+
+void heap_pool_init(heap_pool_t *p)
+{
+  p->slabs = p->cur = NULL;
+  p->used = 0;
+  p->free = NULL;
+  p->num_slabs = 0;
+}
+
+/* Invalidates every node handed out by this pool.  Only call it when no *
+ * heap using the pool has any nodes left in it.                          */
+void heap_pool_reset(heap_pool_t *p)
+{
+  p->cur = p->slabs;
+  p->used = 0;
+  p->free = NULL;
+}
+
+void heap_pool_destroy(heap_pool_t *p)
+{
+  struct heap_slab *s;
+
+  while ((s = p->slabs)) {
+    p->slabs = s->next;
+    free(s);
+  }
+  heap_pool_init(p);
+}
+
+static heap_node_t *heap_node_alloc(heap_t *h)
+{
+  heap_pool_t *p;
+  heap_node_t *n;
+  struct heap_slab *s;
+
+  if (!(p = h->pool)) {
+    assert((n = calloc(1, sizeof (*n))));
+    return n;
+  }
+
+  if ((n = p->free)) {
+    p->free = n->next;
+  } else {
+    if (!p->cur || p->used == HEAP_SLAB_NODES) {
+      if (p->cur && p->cur->next) {
+        p->cur = p->cur->next;
+      } else {
+        assert((s = malloc(sizeof (*s))));
+        s->next = NULL;
+        if (p->cur) {
+          p->cur->next = s;
+        } else {
+          p->slabs = s;
+        }
+        p->cur = s;
+        p->num_slabs++;
+      }
+      p->used = 0;
+    }
+    n = p->cur->node + p->used++;
+  }
+  memset(n, 0, sizeof (*n));
+
+  return n;
+}
+
+static void heap_node_free(heap_t *h, heap_node_t *n)
+{
+  if (h->pool) {
+    n->next = h->pool->free;
+    h->pool->free = n;
+  } else {
+    free(n);
+  }
+}
+
+void heap_init(heap_t *h,
+               int32_t (*compare)(const void *key, const void *with),
+               void (*datum_delete)(void *))
+{
+  heap_init_pool(h, compare, datum_delete, NULL);
+}
+
+int heap_decrease_key(heap_t *h, heap_node_t *n, void *v)
+{
+  if (h->compare(n->datum, v) <= 0) {
+    return 1;
+  }
+
+  if (h->datum_delete) {
+    h->datum_delete(n->datum);
+  }
+  n->datum = v;
+
+  return heap_decrease_key_no_replace(h, n);
+}
+
+#ifndef HEAP_DARY
+
+
 #define swap(a, b) ({    \
   typeof (a) _tmp = (a); \
   (a) = (b);             \
@@ -91,14 +209,16 @@ void print_heap_node_list(heap_node_t *n)
   printf("\n");
 }
 
-void heap_init(heap_t *h,
-               int32_t (*compare)(const void *key, const void *with),
-               void (*datum_delete)(void *))
+void heap_init_pool(heap_t *h,
+                    int32_t (*compare)(const void *key, const void *with),
+                    void (*datum_delete)(void *),
+                    heap_pool_t *pool)
 {
   h->min = NULL;
   h->size = 0;
   h->compare = compare;
   h->datum_delete = datum_delete;
+  h->pool = pool;
 }
 
 void heap_node_delete(heap_t *h, heap_node_t *hn)
@@ -114,7 +234,7 @@ void heap_node_delete(heap_t *h, heap_node_t *hn)
     if (h->datum_delete) {
       h->datum_delete(hn->datum);
     }
-    free(hn);
+    heap_node_free(h, hn);
     hn = next;
   }
 }
@@ -128,13 +248,14 @@ void heap_delete(heap_t *h)
   h->size = 0;
   h->compare = NULL;
   h->datum_delete = NULL;
+  h->pool = NULL;
 }
 
 heap_node_t *heap_insert(heap_t *h, void *v)
 {
   heap_node_t *n;
 
-  assert((n = calloc(1, sizeof (*n))));
+  n = heap_node_alloc(h);
   n->datum = v;
 
   if (h->min) {
@@ -220,7 +341,7 @@ void *heap_remove_min(heap_t *h)
   if (h->min) {
     v = h->min->datum;
     if (h->size == 1) {
-      free(h->min);
+      heap_node_free(h, h->min);
       h->min = NULL;
     } else {
       if ((n = h->min->child)) {
@@ -234,7 +355,7 @@ void *heap_remove_min(heap_t *h)
       n = h->min;
       remove_heap_node_from_list(n);
       h->min = n->next;
-      free(n);
+      heap_node_free(h, n);
 
       heap_consolidate(h);
     }
@@ -248,12 +369,14 @@ void *heap_remove_min(heap_t *h)
 int heap_combine(heap_t *h, heap_t *h1, heap_t *h2)
 {
   if (h1->compare != h2->compare ||
-      h1->datum_delete != h2->datum_delete) {
+      h1->datum_delete != h2->datum_delete ||
+      h1->pool != h2->pool) {
     return 1;
   }
 
   h->compare = h1->compare;
   h->datum_delete = h1->datum_delete;
+  h->pool = h1->pool;
 
   if (!h1->min) {
     h->min = h2->min;
@@ -302,20 +425,6 @@ static void heap_cascading_cut(heap_t *h, heap_node_t *n)
   }
 }
 
-int heap_decrease_key(heap_t *h, heap_node_t *n, void *v)
-{
-  if (h->compare(n->datum, v) <= 0) {
-    return 1;
-  }
-
-  if (h->datum_delete) {
-    h->datum_delete(n->datum);
-  }
-  n->datum = v;
-
-  return heap_decrease_key_no_replace(h, n);
-}
-
 int heap_decrease_key_no_replace(heap_t *h, heap_node_t *n)
 {
   /* No tests that the value hasn't actually increased.  Change *
@@ -338,8 +447,211 @@ int heap_decrease_key_no_replace(heap_t *h, heap_node_t *n)
   return 0;
 }
 
+#else
+
+/* Implicit 4-ary heap.  The array holds node pointers rather than data  *
+ * so that the handles returned by heap_insert() stay valid as entries    *
+ * move; each node records its current slot for decrease-key.  Children  *
+ * of slot i live in slots 4i+1 through 4i+4.                              */
+
+#define HEAP_ARITY 4
+
+void print_heap(heap_t *h, char *(*print)(const void *v))
+{
+  uint32_t i;
+
+  if (h->size) {
+    printf("size = %u\n", h->size);
+    for (i = 0; i < h->size; i++) {
+      printf("%*s%s\n", 2 * (i ? 1 : 0), "", print(h->a[i]->datum));
+    }
+  } else {
+    printf("(null)\n");
+  }
+}
+
+void heap_init_pool(heap_t *h,
+                    int32_t (*compare)(const void *key, const void *with),
+                    void (*datum_delete)(void *),
+                    heap_pool_t *pool)
+{
+  h->a = NULL;
+  h->alloc = 0;
+  h->size = 0;
+  h->compare = compare;
+  h->datum_delete = datum_delete;
+  h->pool = pool;
+}
+
+void heap_delete(heap_t *h)
+{
+  uint32_t i;
+
+  for (i = 0; i < h->size; i++) {
+    if (h->datum_delete) {
+      h->datum_delete(h->a[i]->datum);
+    }
+    heap_node_free(h, h->a[i]);
+  }
+  free(h->a);
+  h->a = NULL;
+  h->alloc = 0;
+  h->size = 0;
+  h->compare = NULL;
+  h->datum_delete = NULL;
+  h->pool = NULL;
+}
+
+static void heap_sift_up(heap_t *h, uint32_t i)
+{
+  heap_node_t *n;
+  uint32_t p;
+
+  n = h->a[i];
+  while (i) {
+    p = (i - 1) / HEAP_ARITY;
+    if (h->compare(n->datum, h->a[p]->datum) >= 0) {
+      break;
+    }
+    h->a[i] = h->a[p];
+    h->a[i]->index = i;
+    i = p;
+  }
+  h->a[i] = n;
+  n->index = i;
+}
+
+static void heap_sift_down(heap_t *h, uint32_t i)
+{
+  heap_node_t *n;
+  uint32_t c, m, end;
+
+  n = h->a[i];
+  while ((c = HEAP_ARITY * i + 1) < h->size) {
+    end = c + HEAP_ARITY < h->size ? c + HEAP_ARITY : h->size;
+    for (m = c++; c < end; c++) {
+      if (h->compare(h->a[c]->datum, h->a[m]->datum) < 0) {
+        m = c;
+      }
+    }
+    if (h->compare(h->a[m]->datum, n->datum) >= 0) {
+      break;
+    }
+    h->a[i] = h->a[m];
+    h->a[i]->index = i;
+    i = m;
+  }
+  h->a[i] = n;
+  n->index = i;
+}
+
+static void heap_reserve(heap_t *h, uint32_t size)
+{
+  if (size > h->alloc) {
+    h->alloc = h->alloc ? h->alloc : 64;
+    while (h->alloc < size) {
+      h->alloc *= 2;
+    }
+    assert((h->a = realloc(h->a, h->alloc * sizeof (*h->a))));
+  }
+}
+
+heap_node_t *heap_insert(heap_t *h, void *v)
+{
+  heap_node_t *n;
+
+  heap_reserve(h, h->size + 1);
+
+  n = heap_node_alloc(h);
+  n->datum = v;
+  h->a[h->size] = n;
+  heap_sift_up(h, h->size++);
+
+  return n;
+}
+
+void *heap_peek_min(heap_t *h)
+{
+  return h->size ? h->a[0]->datum : NULL;
+}
+
+void *heap_remove_min(heap_t *h)
+{
+  void *v;
+  heap_node_t *n;
+
+  if (!h->size) {
+    return NULL;
+  }
+
+  n = h->a[0];
+  v = n->datum;
+  heap_node_free(h, n);
+
+  if (--h->size) {
+    h->a[0] = h->a[h->size];
+    heap_sift_down(h, 0);
+  }
+
+  return v;
+}
+
+int heap_combine(heap_t *h, heap_t *h1, heap_t *h2)
+{
+  uint32_t i, size2;
+  heap_node_t **a2;
+
+  if (h1 == h2 ||
+      h1->compare != h2->compare ||
+      h1->datum_delete != h2->datum_delete ||
+      h1->pool != h2->pool) {
+    return 1;
+  }
+
+  /* h may be h2; take what we need from it before *h is written */
+  size2 = h2->size;
+  a2 = h2->a;
+
+  heap_reserve(h1, h1->size + size2);
+  memcpy(h1->a + h1->size, a2, size2 * sizeof (*a2));
+  free(a2);
+
+  *h = *h1;
+  h->size += size2;
+
+  /* Floyd's heapify; cheaper than h2->size sift-ups */
+  for (i = h->size; i--; ) {
+    heap_sift_down(h, i);
+  }
+
+  if (h != h1) {
+    memset(h1, 0, sizeof (*h1));
+  }
+  if (h != h2) {
+    memset(h2, 0, sizeof (*h2));
+  }
+
+  return 0;
+}
+
+int heap_decrease_key_no_replace(heap_t *h, heap_node_t *n)
+{
+  /* Same contract as the Fibonacci heap: the caller guarantees the *
+   * key did not increase.                                          */
+
+  heap_sift_up(h, n->index);
+
+  return 0;
+}
+
+#endif
+
 #ifdef TESTING
 
+#include <limits.h>
+
+#include "timing.h"
+
 int32_t compare(const void *key, const void *with)
 {
   return *((int *) key) - *((int *) with);
@@ -354,6 +666,135 @@ char *print_int(const void *v)
   return out;
 }
 
+/* One simulated game turn: a full-grid Dijkstra over a w x h map, built *
+ * the same way pathfind() builds its heaps.  Returns heap_insert calls. */
+static uint32_t bench_turn(heap_pool_t *pool, int w, int h, int *cost,
+                           int *dist, heap_node_t **hn)
+{
+  static const int dx[4] = { -1, 1, 0, 0 };
+  static const int dy[4] = { 0, 0, -1, 1 };
+  heap_t hp;
+  int *c;
+  int i, x, y, d, inserts;
+
+  if (pool) {
+    heap_pool_reset(pool);
+  }
+  heap_init_pool(&hp, compare, NULL, pool);
+
+  for (i = 0; i < w * h; i++) {
+    dist[i] = INT_MAX;
+  }
+  dist[0] = 0;
+  for (inserts = i = 0; i < w * h; i++, inserts++) {
+    hn[i] = heap_insert(&hp, dist + i);
+  }
+
+  while ((c = heap_remove_min(&hp))) {
+    i = c - dist;
+    hn[i] = NULL;
+    for (d = 0; d < 4; d++) {
+      x = i % w + dx[d];
+      y = i / w + dy[d];
+      if (x >= 0 && x < w && y >= 0 && y < h && hn[y * w + x] &&
+          dist[y * w + x] > dist[i] + cost[i]) {
+        dist[y * w + x] = dist[i] + cost[i];
+        heap_decrease_key_no_replace(&hp, hn[y * w + x]);
+      }
+    }
+  }
+  heap_delete(&hp);
+
+  return inserts;
+}
+
+static void bench(int turns)
+{
+  heap_pool_t pool;
+  int w = 78, h = 19;
+  int *cost, *dist;
+  heap_node_t **hn;
+  double t;
+  uint64_t allocs;
+  int i;
+
+  assert((cost = malloc(w * h * sizeof (*cost))));
+  assert((dist = malloc(w * h * sizeof (*dist))));
+  assert((hn = malloc(w * h * sizeof (*hn))));
+  for (i = 0; i < w * h; i++) {
+    cost[i] = 10 + 5 * (rand() % 9);
+  }
+
+  printf("%d turns, %d nodes per turn\n", turns, w * h);
+
+  t = now();
+  for (allocs = i = 0; i < turns; i++) {
+    allocs += bench_turn(NULL, w, h, cost, dist, hn);
+  }
+  t = now() - t;
+  printf("calloc: %8.2f allocs/turn %8.2f us/turn\n",
+         (double) allocs / turns, t * 1e6 / turns);
+
+  heap_pool_init(&pool);
+  t = now();
+  for (i = 0; i < turns; i++) {
+    bench_turn(&pool, w, h, cost, dist, hn);
+  }
+  t = now() - t;
+  printf("pool:   %8.2f allocs/turn %8.2f us/turn (%u slabs total)\n",
+         (double) pool.num_slabs / turns, t * 1e6 / turns, pool.num_slabs);
+  heap_pool_destroy(&pool);
+
+  free(cost);
+  free(dist);
+  free(hn);
+}
+
+static void bench_ops(int n)
+{
+  heap_pool_t pool;
+  heap_t h;
+  int *keys;
+  heap_node_t **a;
+  double t[3];
+  int i, j;
+
+  assert((keys = malloc(n * sizeof (*keys))));
+  assert((a = malloc(n * sizeof (*a))));
+  heap_pool_init(&pool);
+  heap_init_pool(&h, compare, NULL, &pool);
+
+  t[0] = now();
+  for (i = 0; i < n; i++) {
+    keys[i] = rand() % (n * 16);
+    a[i] = heap_insert(&h, keys + i);
+  }
+  t[0] = now() - t[0];
+
+  t[1] = now();
+  for (i = 0; i < n; i++) {
+    j = rand() % n;
+    keys[j] -= rand() % 16;
+    heap_decrease_key_no_replace(&h, a[j]);
+  }
+  t[1] = now() - t[1];
+
+  t[2] = now();
+  for (i = 0, j = INT_MIN; i < n; i++) {
+    assert(*(int *) heap_peek_min(&h) >= j);
+    j = *(int *) heap_remove_min(&h);
+  }
+  t[2] = now() - t[2];
+
+  printf("%7d  %12.0f %12.0f %12.0f\n", n,
+         n / t[0], n / t[1], n / t[2]);
+
+  heap_delete(&h);
+  heap_pool_destroy(&pool);
+  free(keys);
+  free(a);
+}
+
 int main(int argc, char *argv[])
 {
   heap_t h;
@@ -363,6 +804,24 @@ int main(int argc, char *argv[])
   int i, j;
   int n;
 
+  if (argc >= 2 && !strcmp(argv[1], "bench")) {
+    bench(argc == 3 ? atoi(argv[2]) : 1000);
+    return 0;
+  }
+
+  if (argc >= 2 && !strcmp(argv[1], "ops")) {
+#ifdef HEAP_DARY
+    printf("4-ary heap, ops/sec\n");
+#else
+    printf("Fibonacci heap, ops/sec\n");
+#endif
+    printf("%7s  %12s %12s %12s\n", "n", "insert", "decrease", "remove_min");
+    bench_ops(1000);
+    bench_ops(10000);
+    bench_ops(100000);
+    return 0;
+  }
+
   if (argc == 2) {
     n = atoi(argv[1]);
   } else {
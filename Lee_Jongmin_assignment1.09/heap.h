@@ -10,16 +10,46 @@ extern "C" {
 struct heap_node;
 typedef struct heap_node heap_node_t;
 
+struct heap_slab;
+
+/* Optional node allocator.  Nodes are carved out of large slabs, recycled *
+ * through a free list, and the whole pool can be reset in O(1) once no   *
+ * heap is using it.  Slabs are kept across resets, so a heap that is     *
+ * rebuilt every turn stops touching malloc after the first turn.         */
+typedef struct heap_pool {
+  struct heap_slab *slabs;
+  struct heap_slab *cur;
+  uint32_t used;
+  heap_node_t *free;
+  uint32_t num_slabs;
+} heap_pool_t;
+
+/* Define HEAP_DARY to swap the Fibonacci heap for an array-backed 4-ary *
+ * heap.  The API is identical; only the representation changes.         */
 typedef struct heap {
+# ifdef HEAP_DARY
+  heap_node_t **a;
+  uint32_t alloc;
+# else
   heap_node_t *min;
+# endif
   uint32_t size;
   int32_t (*compare)(const void *key, const void *with);
   void (*datum_delete)(void *);
+  heap_pool_t *pool;
 } heap_t;
 
+void heap_pool_init(heap_pool_t *p);
+void heap_pool_reset(heap_pool_t *p);
+void heap_pool_destroy(heap_pool_t *p);
+
 void heap_init(heap_t *h,
                int32_t (*compare)(const void *key, const void *with),
                void (*datum_delete)(void *));
+void heap_init_pool(heap_t *h,
+                    int32_t (*compare)(const void *key, const void *with),
+                    void (*datum_delete)(void *),
+                    heap_pool_t *pool);
 void heap_delete(heap_t *h);
 heap_node_t *heap_insert(heap_t *h, void *v);
 void *heap_peek_min(heap_t *h);
@@ -20,6 +20,10 @@ typedef struct io_message {
 
 static io_message_t *io_head, *io_tail;
 
+bool io_headless;
+const char *io_script;
+io_headless_stats_t io_headless_stats;
+
 void io_init_terminal(void)
 {
   initscr();
@@ -105,52 +109,70 @@ static void io_print_message_queue(uint32_t y, uint32_t x)
  **************************************************************************/
 static int compare_trainer_distance(const void *v1, const void *v2)
 {
-  const Character *const *c1 = (const Character *const *) v1;
-  const Character *const *c2 = (const Character *const *) v2;
-
-  return (world.rival_dist[(*c1)->pos[dim_y]][(*c1)->pos[dim_x]] -
-          world.rival_dist[(*c2)->pos[dim_y]][(*c2)->pos[dim_x]]);
+  const int16_t *p1 = world.cur_map->npcs.pos[*(const uint16_t *) v1];
+  const int16_t *p2 = world.cur_map->npcs.pos[*(const uint16_t *) v2];
+  int d1, d2;
+
+  d1 = world.rival_dist[p1[dim_y]][p1[dim_x]];
+  d2 = world.rival_dist[p2[dim_y]][p2[dim_x]];
+  if (d1 != d2) {
+    return d1 < d2 ? -1 : 1;
+  }
+  // Ties go as they did when the list came off the grid: top to bottom
+  if (p1[dim_y] != p2[dim_y]) {
+    return p1[dim_y] - p2[dim_y];
+  }
+  return p1[dim_x] - p2[dim_x];
 }
 
-static Character *io_nearest_visible_trainer()
+/* Slot of the trainer nearest the PC, or -1.  Only needs the least, so *
+ * it's one pass over the map's trainers rather than a sort.           */
+static int io_nearest_visible_trainer()
 {
-  Character **c, *n;
-  uint32_t x, y, count;
+  uint16_t i, n;
 
-  c = (Character **) malloc(world.cur_map->num_trainers * sizeof (*c));
+  if (!world.cur_map->npcs.num) {
+    return -1;
+  }
 
-  /* Get a linear list of trainers */
-  for (count = 0, y = 1; y < MAP_Y - 1; y++) {
-    for (x = 1; x < MAP_X - 1; x++) {
-      if (world.cur_map->cmap[y][x] && world.cur_map->cmap[y][x] !=
-          &world.pc) {
-        c[count++] = world.cur_map->cmap[y][x];
-      }
+  pathfind_need(char_rival);
+  for (n = 0, i = 1; i < world.cur_map->npcs.num; i++) {
+    if (compare_trainer_distance(&i, &n) < 0) {
+      n = i;
     }
   }
 
-  /* Sort it by distance from PC */
-  qsort(c, count, sizeof (*c), compare_trainer_distance);
-
-  n = c[0];
+  return n;
+}
 
-  free(c);
+/* Clamps the start of a view of length n onto a map of length len so *
+ * that it's centred on pc where it can be.                            */
+static int32_t io_view_origin(int32_t pc, int32_t n, int32_t len)
+{
+  if (len <= n || pc < n / 2) {
+    return 0;
+  }
 
-  return n;
+  return pc - n / 2 > len - n ? len - n : pc - n / 2;
 }
 
 void io_display()
 {
-  uint32_t y, x;
-  Character *c;
+  int32_t y, x, ox, oy;
+  const int16_t *p;
+  int i;
+
+  // Maps bigger than the screen scroll to keep the PC in view
+  ox = io_view_origin(world.pc.pos[dim_x], MAP_X, map_x);
+  oy = io_view_origin(world.pc.pos[dim_y], MAP_Y, map_y);
 
   clear();
-  for (y = 0; y < MAP_Y; y++) {
-    for (x = 0; x < MAP_X; x++) {
-      if (world.cur_map->cmap[y][x]) {
-        mvaddch(y + 1, x, world.cur_map->cmap[y][x]->symbol);
+  for (y = 0; y < MAP_Y && y < map_y; y++) {
+    for (x = 0; x < MAP_X && x < map_x; x++) {
+      if (world.cur_map->cmap[oy + y][ox + x]) {
+        mvaddch(y + 1, x, world.cur_map->cmap[oy + y][ox + x]->symbol);
       } else {
-        switch (world.cur_map->map[y][x]) {
+        switch (world.cur_map->map[oy + y][ox + x]) {
         case ter_boulder:
         case ter_mountain:
           attron(COLOR_PAIR(COLOR_MAGENTA));
@@ -203,22 +225,23 @@ void io_display()
   mvprintw(23, 1, "PC position is (%2d,%2d) on map %d%cx%d%c.",
            world.pc.pos[dim_x],
            world.pc.pos[dim_y],
-           abs(world.cur_idx[dim_x] - (WORLD_SIZE / 2)),
-           world.cur_idx[dim_x] - (WORLD_SIZE / 2) >= 0 ? 'E' : 'W',
-           abs(world.cur_idx[dim_y] - (WORLD_SIZE / 2)),
-           world.cur_idx[dim_y] - (WORLD_SIZE / 2) <= 0 ? 'N' : 'S');
+           abs(world.cur_idx[dim_x] - (world_size / 2)),
+           world.cur_idx[dim_x] - (world_size / 2) >= 0 ? 'E' : 'W',
+           abs(world.cur_idx[dim_y] - (world_size / 2)),
+           world.cur_idx[dim_y] - (world_size / 2) <= 0 ? 'N' : 'S');
   mvprintw(22, 1, "%d known %s.", world.cur_map->num_trainers,
            world.cur_map->num_trainers > 1 ? "trainers" : "trainer");
   mvprintw(22, 30, "Nearest visible trainer: ");
-  if ((c = io_nearest_visible_trainer())) {
+  if ((i = io_nearest_visible_trainer()) >= 0) {
+    p = world.cur_map->npcs.pos[i];
     attron(COLOR_PAIR(COLOR_RED));
     mvprintw(22, 55, "%c at %d %c by %d %c.",
-             c->symbol,
-             abs(c->pos[dim_y] - world.pc.pos[dim_y]),
-             ((c->pos[dim_y] - world.pc.pos[dim_y]) <= 0 ?
+             world.cur_map->npcs.npc[i]->symbol,
+             abs(p[dim_y] - world.pc.pos[dim_y]),
+             ((p[dim_y] - world.pc.pos[dim_y]) <= 0 ?
               'N' : 'S'),
-             abs(c->pos[dim_x] - world.pc.pos[dim_x]),
-             ((c->pos[dim_x] - world.pc.pos[dim_x]) <= 0 ?
+             abs(p[dim_x] - world.pc.pos[dim_x]),
+             ((p[dim_x] - world.pc.pos[dim_x]) <= 0 ?
               'W' : 'E'));
     attroff(COLOR_PAIR(COLOR_RED));
   } else {
@@ -236,9 +259,11 @@ uint32_t io_teleport_pc(pair_t dest)
 {
   /* Just for fun. And debugging.  Mostly debugging. */
 
+  pathfind_need(char_rival);
+
   do {
-    dest[dim_x] = rand_range(1, MAP_X - 2);
-    dest[dim_y] = rand_range(1, MAP_Y - 2);
+    dest[dim_x] = rand_range(1, map_x - 2);
+    dest[dim_y] = rand_range(1, map_y - 2);
   } while (world.cur_map->cmap[dest[dim_y]][dest[dim_x]]                  ||
            move_cost[char_pc][world.cur_map->map[dest[dim_y]]
                                                 [dest[dim_x]]] == INT_MAX ||
@@ -276,9 +301,10 @@ static void io_scroll_trainer_list(char (*s)[40], uint32_t count)
   }
 }
 
-static void io_list_trainers_display(Npc **c,
+static void io_list_trainers_display(uint16_t *c,
                                      uint32_t count)
 {
+  npc_store_t *n = &world.cur_map->npcs;
   uint32_t i;
   char (*s)[40]; /* pointer to array of 40 char */
 
@@ -292,13 +318,13 @@ static void io_list_trainers_display(Npc **c,
 
   for (i = 0; i < count; i++) {
     snprintf(s[i], 40, "%16s %c: %2d %s by %2d %s",
-             char_type_name[c[i]->ctype],
-             c[i]->symbol,
-             abs(c[i]->pos[dim_y] - world.pc.pos[dim_y]),
-             ((c[i]->pos[dim_y] - world.pc.pos[dim_y]) <= 0 ?
+             char_type_name[n->npc[c[i]]->ctype],
+             n->npc[c[i]]->symbol,
+             abs(n->pos[c[i]][dim_y] - world.pc.pos[dim_y]),
+             ((n->pos[c[i]][dim_y] - world.pc.pos[dim_y]) <= 0 ?
               "North" : "South"),
-             abs(c[i]->pos[dim_x] - world.pc.pos[dim_x]),
-             ((c[i]->pos[dim_x] - world.pc.pos[dim_x]) <= 0 ?
+             abs(n->pos[c[i]][dim_x] - world.pc.pos[dim_x]),
+             ((n->pos[c[i]][dim_x] - world.pc.pos[dim_x]) <= 0 ?
               "West" : "East"));
     if (count <= 13) {
       /* Handle the non-scrolling case right here. *
@@ -324,26 +350,23 @@ static void io_list_trainers_display(Npc **c,
 
 static void io_list_trainers()
 {
-  Character **c;
-  uint32_t x, y, count;
+  uint16_t *c;
+  uint32_t i, count;
 
-  c = (Character **) malloc(world.cur_map->num_trainers * sizeof (*c));
+  count = world.cur_map->npcs.num;
+  c = (uint16_t *) malloc(count * sizeof (*c));
 
   /* Get a linear list of trainers */
-  for (count = 0, y = 1; y < MAP_Y - 1; y++) {
-    for (x = 1; x < MAP_X - 1; x++) {
-      if (world.cur_map->cmap[y][x] && world.cur_map->cmap[y][x] !=
-          &world.pc) {
-        c[count++] = world.cur_map->cmap[y][x];
-      }
-    }
+  for (i = 0; i < count; i++) {
+    c[i] = i;
   }
 
   /* Sort it by distance from PC */
+  pathfind_need(char_rival);
   qsort(c, count, sizeof (*c), compare_trainer_distance);
 
   /* Display it */
-  io_list_trainers_display((Npc **)(c), count);
+  io_list_trainers_display(c, count);
   free(c);
 
   /* And redraw the map */
@@ -368,6 +391,8 @@ void io_pokemon_center()
 
 uint32_t move_pc_dir(uint32_t input, pair_t dest)
 {
+  Character *c;
+
   dest[dim_y] = world.pc.pos[dim_y];
   dest[dim_x] = world.pc.pos[dim_x];
 
@@ -422,14 +447,12 @@ uint32_t move_pc_dir(uint32_t input, pair_t dest)
     return 1;
   }
 
-  if (world.cur_map->cmap[dest[dim_y]][dest[dim_x]]) {
-    if (dynamic_cast<Npc *>(world.cur_map->cmap[dest[dim_y]][dest[dim_x]]) &&
-        ((Npc *) world.cur_map->cmap[dest[dim_y]][dest[dim_x]])->defeated) {
+  if ((c = world.cur_map->cmap[dest[dim_y]][dest[dim_x]])) {
+    if (as_npc(c) && world.cur_map->npcs.defeated[as_npc(c)->slot]) {
       // Some kind of greeting here would be nice
       return 1;
-    } else if (dynamic_cast<Npc *>
-               (world.cur_map->cmap[dest[dim_y]][dest[dim_x]])) {
-      io_battle(world.cur_map->cmap[dest[dim_y]][dest[dim_x]]);
+    } else if (as_npc(c)) {
+      io_battle(c);
       // Not actually moving, so set dest back to PC position
       dest[dim_x] = world.pc.pos[dim_x];
       dest[dim_y] = world.pc.pos[dim_y];
@@ -1343,8 +1366,8 @@ void io_encounter_pokemon()
   
   Pokemon *p;
   
-  int md = (abs(world.cur_idx[dim_x] - (WORLD_SIZE / 2)) +
-            abs(world.cur_idx[dim_x] - (WORLD_SIZE / 2)));
+  int md = (abs(world.cur_idx[dim_x] - (world_size / 2)) +
+            abs(world.cur_idx[dim_x] - (world_size / 2)));
   int minl, maxl;
   
   if (md <= 200) {
@@ -1367,7 +1390,14 @@ void io_encounter_pokemon()
     maxl = 100;
   }
 
-  p = new Pokemon(rand() % (maxl - minl + 1) + minl);
+  p = new Pokemon(rng_rand(&world.cur_map->encounter) % (maxl - minl + 1) +
+                  minl, &world.cur_map->encounter);
+
+  if (io_headless) {
+    io_headless_stats.encounters++;
+    delete p;
+    return;
+  }
 
   //  std::cerr << *p << std::endl << std::endl;
   /*
@@ -1472,16 +1502,18 @@ void io_encounter_pokemon()
 void gen_trainer_pokemon(Npc *npc){
   int num_pokes = 0;
   int r;
+  // A copy, so the same team comes back if the map is evicted and rebuilt
+  rng_t team = npc->rng;
   do{
     num_pokes++;
-    r = rand() % 100;
+    r = rng_rand(&team) % 100;
   }while(r < 60 && num_pokes < 6);
 
   int i;
   for(i = 0; i < num_pokes; i++){
     Pokemon *p;
-    int md = (abs(world.cur_idx[dim_x] - (WORLD_SIZE / 2)) +
-              abs(world.cur_idx[dim_x] - (WORLD_SIZE / 2)));
+    int md = (abs(world.cur_idx[dim_x] - (world_size / 2)) +
+              abs(world.cur_idx[dim_x] - (world_size / 2)));
     int minl, maxl;
     
     if (md <= 200) {
@@ -1504,7 +1536,7 @@ void gen_trainer_pokemon(Npc *npc){
       maxl = 100;
     }
 
-    p = new Pokemon(rand() % (maxl - minl + 1) + minl);
+    p = new Pokemon(rng_rand(&team) % (maxl - minl + 1) + minl, &team);
     npc->pokemon[i] = p;
   }
   
@@ -1550,6 +1582,17 @@ int get_next_enemy_poke(Character *enemy){
   return alive;
 }
 
+/* Beaten trainers stop chasing the PC and just wander */
+static void io_defeat(Npc *npc)
+{
+  npc_store_t *s = &world.cur_map->npcs;
+
+  s->defeated[npc->slot] = 1;
+  if (npc->ctype == char_hiker || npc->ctype == char_rival) {
+    s->mtype[npc->slot] = move_wander;
+  }
+}
+
 void io_battle(Character *enemy)
 {
   bool fighting = true;
@@ -1574,11 +1617,17 @@ void io_battle(Character *enemy)
   // refresh();
   // getch();
   
-  npc = dynamic_cast<Npc *>(enemy);
+  npc = as_npc(enemy);
 
   if(!npc->pokemon[0]){
     gen_trainer_pokemon(npc);
   }
+  if (io_headless) {
+    io_headless_stats.battles++;
+    io_defeat(npc);
+    return;
+  }
+
   int enemy_poke = -1;
   enemy_poke = get_next_enemy_poke(enemy);
 
@@ -1603,10 +1652,7 @@ void io_battle(Character *enemy)
       } if(fight_result == 100){
         enemy_poke = get_next_enemy_poke(enemy);
         if(enemy_poke == -1){
-          npc->defeated = 1;
-          if (npc->ctype == char_hiker || npc->ctype == char_rival) {
-            npc->mtype = move_wander;
-          }
+          io_defeat(npc);
           return;
         }
       }else if(fight_result > 6){
@@ -1645,10 +1691,7 @@ void io_battle(Character *enemy)
       refresh();
 
     } else if(c == 'Q'){
-        npc->defeated = 1; //For debugging stuff
-        if (npc->ctype == char_hiker || npc->ctype == char_rival) {
-          npc->mtype = move_wander;
-        }
+        io_defeat(npc); //For debugging stuff
         clear();
         io_display();
         refresh();
@@ -1663,6 +1706,33 @@ void io_battle(Character *enemy)
   
 
 
+}
+
+/* The next script key, or a random one.  A blocked move falls back to *
+ * random ones, and after a few of those the PC waits a turn.          */
+static void io_headless_input(pair_t dest)
+{
+  static uint32_t step;
+  static rng_t r;
+  static bool seeded;
+  int i, key;
+
+  if (!seeded) {
+    rng_seed(&r, world.seed, 0, 0, rng_headless);
+    seeded = true;
+  }
+
+  for (i = 0; i < 8; i++) {
+    if (!i && io_script && *io_script) {
+      key = io_script[step++ % strlen(io_script)] - '0';
+    } else {
+      key = rng_rand(&r) % 9 + 1;
+    }
+    if (key >= 1 && key <= 9 && key != 5 && !move_pc_dir(key, dest)) {
+      return;
+    }
+  }
+  move_pc_dir(5, dest);
 }
 
 void io_handle_input(pair_t dest)
@@ -1670,6 +1740,11 @@ void io_handle_input(pair_t dest)
   uint32_t turn_not_consumed;
   int key;
 
+  if (io_headless) {
+    io_headless_input(dest);
+    return;
+  }
+
   do {
     switch (key = getch()) {
     case '7':
@@ -13,4 +13,19 @@ void io_battle(Character *enemy);
 void io_encounter_pokemon(void);
 int io_enter_bag(bool in_wild_battle);
 
+/* Nobody at the keyboard and no terminal.  io_handle_input() plays the  *
+ * PC off io_script, a string of keypad digits used round and round, or *
+ * at random without one.  Every trainer battle is won outright, wild   *
+ * Pokemon always get away, and the starter is the first one offered.  *
+ * Callers skip io_display() themselves.                                 */
+extern bool io_headless;
+extern const char *io_script;
+
+typedef struct io_headless_stats {
+  uint32_t battles;
+  uint32_t encounters;
+} io_headless_stats_t;
+
+extern io_headless_stats_t io_headless_stats;
+
 #endif
@@ -0,0 +1,1079 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#include "heap.h"
+#include "poke327.h"
+#include "mapgen.h"
+
+int32_t map_x = MAP_X, map_y = MAP_Y, world_size = WORLD_SIZE;
+
+int mapgen_set_size(int32_t x, int32_t y, int32_t world)
+{
+  if (x < MAP_MIN_X || x > MAP_MAX || y < MAP_MIN_Y || y > MAP_MAX ||
+      world < 2 || world > WORLD_MAX) {
+    return -1;
+  }
+
+  map_x = x;
+  map_y = y;
+  world_size = world;
+
+  return 0;
+}
+
+/* Flood fill frontier for smooth_height() and map_terrain().  No cell *
+ * is ever in the queue twice at once, so a ring bigger than the map    *
+ * never laps itself.  Per thread, since terrain is also generated in   *
+ * the background, and reused for every map.                            */
+typedef struct fill_queue {
+  uint32_t head, tail, size;
+  uint16_t (*pos)[num_dims];
+} fill_queue_t;
+
+static thread_local fill_queue_t fill;
+
+static inline void fill_push(fill_queue_t *q, int32_t x, int32_t y)
+{
+  q->pos[q->tail][dim_x] = x;
+  q->pos[q->tail][dim_y] = y;
+  q->tail = q->tail + 1 == q->size ? 0 : q->tail + 1;
+}
+
+static inline void fill_pop(fill_queue_t *q, int32_t *x, int32_t *y)
+{
+  *x = q->pos[q->head][dim_x];
+  *y = q->pos[q->head][dim_y];
+  q->head = q->head + 1 == q->size ? 0 : q->head + 1;
+}
+
+const char *mapgen_stage_name[num_mapgen_stages] = {
+  "height",
+  "terrain",
+  "boulders",
+  "trees",
+  "paths",
+  "buildings",
+};
+
+/* A map as it's being built: a byte a cell, and the heights that only *
+ * path building needs.  Packed into a Map once it's done.              */
+typedef struct gen_map {
+  MapArray<terrain_type_t> map;
+  MapArray<uint8_t> height;
+  int16_t n, s, e, w;
+} gen_map_t;
+
+#define heightpair(pair) (m->height[pair[dim_y]][pair[dim_x]])
+#define heightxy(x, y) (m->height[y][x])
+
+/**************************************************************************
+ * Per-thread scratch, since neighbours are generated in the background. *
+ * Sized for the map the first time a thread generates one, and kept     *
+ * until mapgen_thread_exit().                                           *
+ **************************************************************************/
+static thread_local bool scratch_ready;
+static thread_local gen_map_t gen;
+/* Heights before smoothing, and the smoothing's own scratch */
+static thread_local MapArray<uint8_t> diffused;
+static thread_local int32_t *smooth_scratch;
+static thread_local heap_pool_t path_pool;
+static thread_local MapArray<path_t> path;
+/* A* ranks, and its per-column and per-row minimum heights and sums */
+static thread_local MapArray<int64_t> astar_rank;
+static thread_local int32_t *col_min, *row_min, *col_sum, *row_sum;
+
+static void scratch_init()
+{
+  int32_t x, y;
+
+  fill.head = fill.tail = 0;
+  fill.size = map_x * map_y + 1;
+  fill.pos = (uint16_t (*)[num_dims]) malloc(fill.size * sizeof (*fill.pos));
+  gen.map.init(map_x, map_y);
+  gen.height.init(map_x, map_y);
+  diffused.init(map_x, map_y);
+  smooth_scratch = (int32_t *) malloc(SMOOTH_SCRATCH(map_x) *
+                                      sizeof (*smooth_scratch));
+  heap_pool_init(&path_pool);
+  path.init(map_x, map_y);
+  for (y = 0; y < map_y; y++) {
+    for (x = 0; x < map_x; x++) {
+      path[y][x].pos[dim_y] = y;
+      path[y][x].pos[dim_x] = x;
+    }
+  }
+  astar_rank.init(map_x, map_y);
+  col_min = (int32_t *) malloc(map_x * sizeof (*col_min));
+  row_min = (int32_t *) malloc(map_y * sizeof (*row_min));
+  col_sum = (int32_t *) malloc((map_x + 1) * sizeof (*col_sum));
+  row_sum = (int32_t *) malloc((map_y + 1) * sizeof (*row_sum));
+  scratch_ready = true;
+}
+
+void mapgen_thread_exit()
+{
+  if (!scratch_ready) {
+    return;
+  }
+
+  free(fill.pos);
+  gen.map.destroy();
+  gen.height.destroy();
+  diffused.destroy();
+  free(smooth_scratch);
+  heap_pool_destroy(&path_pool);
+  path.destroy();
+  astar_rank.destroy();
+  free(col_min);
+  free(row_min);
+  free(col_sum);
+  free(row_sum);
+  scratch_ready = false;
+}
+
+static int32_t path_cmp(const void *key, const void *with) {
+  return ((path_t *) key)->cost - ((path_t *) with)->cost;
+}
+
+template <class D>
+static inline int32_t edge_penalty(D d, int32_t x, int32_t y)
+{
+  return (x == 1 || y == 1 || x == d.x - 2 || y == d.y - 2) ? 2 : 1;
+}
+
+bool mapgen_astar;
+
+/* Readies path[] for a search out of from, with nothing reached yet */
+template <class D>
+static void path_reset(D d, pair_t from)
+{
+  path_t *p;
+  int32_t i;
+
+  for (p = path.cells, i = 0; i < d.x * d.y; i++) {
+    p[i].cost = INT_MAX;
+    p[i].hn = NULL;
+  }
+
+  p[from[dim_y] * d.x + from[dim_x]].cost = 0;
+
+  heap_pool_reset(&path_pool);
+}
+
+/* Lays path from to back to from, following path[] */
+static void carve_path(gen_map_t *m, pair_t from, pair_t to)
+{
+  path_t *p;
+  int32_t x, y;
+
+  for (x = to[dim_x], y = to[dim_y];
+       (x != from[dim_x]) || (y != from[dim_y]);
+       p = &path[y][x], x = p->from[dim_x], y = p->from[dim_y]) {
+    mapxy(x, y) = ter_path;
+    heightxy(x, y) = 0;
+  }
+}
+
+/* Returns the number of cells expanded.  Neighbours are relaxed up, *
+ * left, right, down; the heap's ties, and so the paths, depend on it. */
+template <class D>
+static uint32_t dijkstra_path(D d, gen_map_t *m, pair_t from, pair_t to)
+{
+  const int32_t step[4] = { -d.x, -1, 1, d.x };
+  const uint8_t *height;
+  path_t *base, *p, *n;
+  heap_t h;
+  int32_t x, y, i, cost;
+  uint32_t expanded;
+
+  path_reset(d, from);
+  base = path.cells;
+  height = m->height.cells;
+  heap_init_pool(&h, path_cmp, NULL, &path_pool);
+
+  for (y = 1; y < d.y - 1; y++) {
+    for (x = 1; x < d.x - 1; x++) {
+      base[y * d.x + x].hn = heap_insert(&h, base + y * d.x + x);
+    }
+  }
+
+  for (expanded = 0; (p = (path_t *) heap_remove_min(&h)); expanded++) {
+    p->hn = NULL;
+
+    if ((p->pos[dim_y] == to[dim_y]) && p->pos[dim_x] == to[dim_x]) {
+      carve_path(m, from, to);
+      heap_delete(&h);
+      return expanded + 1;
+    }
+
+    for (i = 0; i < 4; i++) {
+      n = p + step[i];
+      cost = ((p->cost + height[p - base]) *
+              edge_penalty(d, n->pos[dim_x], n->pos[dim_y]));
+      if (n->hn && n->cost > cost) {
+        n->cost = cost;
+        n->from[dim_y] = p->pos[dim_y];
+        n->from[dim_x] = p->pos[dim_x];
+        heap_decrease_key_no_replace(&h, n->hn);
+      }
+    }
+  }
+
+  return expanded;
+}
+
+/**************************************************************************
+ * A* over the same costs.  A step out of a cell costs at least the      *
+ * cell's height, since edge_penalty() only ever multiplies, and a path  *
+ * has to pass through every column between a cell and the target, and  *
+ * every row.  So the larger of the two sums of per-column and per-row   *
+ * minimum heights never overestimates what's left, and drops by no more *
+ * than a step costs, so no cell is ever expanded twice.  The last step  *
+ * is always onto a gate, an edge_penalty() cell, which multiplies      *
+ * everything before it, so every other cell's bound is scaled by that.  *
+ *                                                                        *
+ * Equal-cost paths can come out differently from dijkstra_path(), which *
+ * would change the world a seed makes, so this is only used when        *
+ * mapgen_astar is set.                                                   *
+ **************************************************************************/
+
+static int32_t astar_cmp(const void *key, const void *with)
+{
+  int64_t k, w;
+
+  k = astar_rank[((path_t *) key)->pos[dim_y]][((path_t *) key)->pos[dim_x]];
+  w = astar_rank[((path_t *) with)->pos[dim_y]][((path_t *) with)->pos[dim_x]];
+
+  return (k > w) - (k < w);
+}
+
+/* sum[i] is the total of min[] below i */
+static void min_sums(const int32_t *min, int32_t *sum, int n)
+{
+  int i;
+
+  for (sum[0] = 0, i = 0; i < n; i++) {
+    sum[i + 1] = sum[i] + min[i];
+  }
+}
+
+/* What the lines from a up to, but not including, b must at least cost */
+static inline int32_t min_between(const int32_t *sum, int a, int b)
+{
+  return a < b ? sum[b] - sum[a] : sum[a + 1] - sum[b + 1];
+}
+
+template <class D>
+static uint32_t astar_path(D d, gen_map_t *m, pair_t from, pair_t to)
+{
+  static const int8_t step[4][num_dims] = {
+    {  0, -1 }, { -1,  0 }, {  1,  0 }, {  0,  1 }
+  };
+  int32_t x, y, nx, ny, cost, guess, penalty;
+  uint32_t expanded, i;
+  path_t *base, *p, *n;
+  int64_t *rank;
+  heap_t h;
+
+  for (x = 0; x < d.x; x++) {
+    col_min[x] = 0;
+  }
+  for (y = 0; y < d.y; y++) {
+    row_min[y] = 0;
+  }
+  for (x = 1; x < d.x - 1; x++) {
+    col_min[x] = INT_MAX;
+  }
+  for (y = 1; y < d.y - 1; y++) {
+    row_min[y] = INT_MAX;
+    for (x = 1; x < d.x - 1; x++) {
+      if (m->height.cells[y * d.x + x] < row_min[y]) {
+        row_min[y] = m->height.cells[y * d.x + x];
+      }
+      if (m->height.cells[y * d.x + x] < col_min[x]) {
+        col_min[x] = m->height.cells[y * d.x + x];
+      }
+    }
+  }
+  min_sums(col_min, col_sum, d.x);
+  min_sums(row_min, row_sum, d.y);
+  penalty = edge_penalty(d, to[dim_x], to[dim_y]);
+
+  path_reset(d, from);
+  base = path.cells;
+  rank = astar_rank.cells;
+  heap_init_pool(&h, astar_cmp, NULL, &path_pool);
+
+  rank[from[dim_y] * d.x + from[dim_x]] = 0;
+  base[from[dim_y] * d.x + from[dim_x]].hn =
+    heap_insert(&h, base + from[dim_y] * d.x + from[dim_x]);
+
+  for (expanded = 0; (p = (path_t *) heap_remove_min(&h)); expanded++) {
+    p->hn = NULL;
+
+    if ((p->pos[dim_y] == to[dim_y]) && p->pos[dim_x] == to[dim_x]) {
+      carve_path(m, from, to);
+      heap_delete(&h);
+      return expanded + 1;
+    }
+
+    for (i = 0; i < 4; i++) {
+      nx = p->pos[dim_x] + step[i][dim_x];
+      ny = p->pos[dim_y] + step[i][dim_y];
+      if (nx < 1 || ny < 1 || nx > d.x - 2 || ny > d.y - 2) {
+        continue;
+      }
+      n = base + ny * d.x + nx;
+      cost = ((p->cost + m->height.cells[p - base]) *
+              edge_penalty(d, nx, ny));
+      // Already expanded, or no cheaper this way
+      if ((!n->hn && n->cost != INT_MAX) || n->cost <= cost) {
+        continue;
+      }
+
+      n->cost = cost;
+      n->from[dim_x] = p->pos[dim_x];
+      n->from[dim_y] = p->pos[dim_y];
+      if (nx == to[dim_x] && ny == to[dim_y]) {
+        rank[n - base] = cost;
+      } else {
+        guess = min_between(col_sum, nx, to[dim_x]);
+        if (min_between(row_sum, ny, to[dim_y]) > guess) {
+          guess = min_between(row_sum, ny, to[dim_y]);
+        }
+        rank[n - base] = (int64_t) penalty * ((int64_t) cost + guess);
+      }
+      if (n->hn) {
+        heap_decrease_key_no_replace(&h, n->hn);
+      } else {
+        n->hn = heap_insert(&h, n);
+      }
+    }
+  }
+
+  return expanded;
+}
+
+/* Lays a path from from to to, with whichever search is in use */
+static void find_path(gen_map_t *m, pair_t from, pair_t to,
+                      mapgen_stats_t *stats)
+{
+  uint32_t expanded;
+
+  with_dims([&](auto d) {
+    expanded = (mapgen_astar ? astar_path(d, m, from, to) :
+                               dijkstra_path(d, m, from, to));
+  });
+  if (stats) {
+    stats->paths++;
+    stats->expanded += expanded;
+  }
+}
+
+static int build_paths(gen_map_t *m, mapgen_stats_t *stats)
+{
+  pair_t from, to;
+
+  /*  printf("%d %d %d %d\n", m->n, m->s, m->e, m->w);*/
+
+  if (m->e != -1 && m->w != -1) {
+    from[dim_x] = 1;
+    to[dim_x] = map_x - 2;
+    from[dim_y] = m->w;
+    to[dim_y] = m->e;
+
+    find_path(m, from, to, stats);
+  }
+
+  if (m->n != -1 && m->s != -1) {
+    from[dim_y] = 1;
+    to[dim_y] = map_y - 2;
+    from[dim_x] = m->n;
+    to[dim_x] = m->s;
+
+    find_path(m, from, to, stats);
+  }
+
+  if (m->e == -1) {
+    if (m->s == -1) {
+      from[dim_x] = 1;
+      from[dim_y] = m->w;
+      to[dim_x] = m->n;
+      to[dim_y] = 1;
+    } else {
+      from[dim_x] = 1;
+      from[dim_y] = m->w;
+      to[dim_x] = m->s;
+      to[dim_y] = map_y - 2;
+    }
+
+    find_path(m, from, to, stats);
+  }
+
+  if (m->w == -1) {
+    if (m->s == -1) {
+      from[dim_x] = map_x - 2;
+      from[dim_y] = m->e;
+      to[dim_x] = m->n;
+      to[dim_y] = 1;
+    } else {
+      from[dim_x] = map_x - 2;
+      from[dim_y] = m->e;
+      to[dim_x] = m->s;
+      to[dim_y] = map_y - 2;
+    }
+
+    find_path(m, from, to, stats);
+  }
+
+  if (m->n == -1) {
+    if (m->e == -1) {
+      from[dim_x] = 1;
+      from[dim_y] = m->w;
+      to[dim_x] = m->s;
+      to[dim_y] = map_y - 2;
+    } else {
+      from[dim_x] = map_x - 2;
+      from[dim_y] = m->e;
+      to[dim_x] = m->s;
+      to[dim_y] = map_y - 2;
+    }
+
+    find_path(m, from, to, stats);
+  }
+
+  if (m->s == -1) {
+    if (m->e == -1) {
+      from[dim_x] = 1;
+      from[dim_y] = m->w;
+      to[dim_x] = m->n;
+      to[dim_y] = 1;
+    } else {
+      from[dim_x] = map_x - 2;
+      from[dim_y] = m->e;
+      to[dim_x] = m->n;
+      to[dim_y] = 1;
+    }
+
+    find_path(m, from, to, stats);
+  }
+
+  return 0;
+}
+
+static int gaussian[5][5] = {
+  {  1,  4,  7,  4,  1 },
+  {  4, 16, 26, 16,  4 },
+  {  7, 26, 41, 26,  7 },
+  {  4, 16, 26, 16,  4 },
+  {  1,  4,  7,  4,  1 }
+};
+
+/**************************************************************************
+ * The kernel above isn't quite separable, but it splits exactly into    *
+ * integer parts that are:                                               *
+ *                                                                        *
+ *   gaussian = a'a - 2 (row [1 4 1] + column [1 0 1]),  a = [1 4 7 4 1]  *
+ *                                                                        *
+ * so each weighted sum is a 5-tap vertical pass, a 5-tap horizontal     *
+ * pass and two 3-tap corrections on the centre row and column.  Cells   *
+ * off the edge count for nothing, both in the sum and in the total      *
+ * weight it's divided by; zero padding takes care of the sum, and the   *
+ * total weight splits the same way into a per-row and a per-column      *
+ * part.  Everything is integer until the divide, which is done in       *
+ * float: sums stay below 2^17 and weights at most 273, so the quotient  *
+ * is exact enough that truncating it gives what integer division does.  *
+ * The passes run on GCC vector types, a vector of columns at a time.    *
+ **************************************************************************/
+
+typedef int32_t smooth_vi_t __attribute__ ((vector_size (SMOOTH_LANES * 4)));
+typedef float smooth_vf_t __attribute__ ((vector_size (SMOOTH_LANES * 4)));
+typedef uint8_t smooth_vb_t __attribute__ ((vector_size (SMOOTH_LANES)));
+
+static inline smooth_vi_t smooth_load(const int32_t *p)
+{
+  smooth_vi_t v;
+
+  memcpy(&v, p, sizeof (v));
+
+  return v;
+}
+
+static inline void smooth_store(int32_t *p, smooth_vi_t v)
+{
+  memcpy(p, &v, sizeof (v));
+}
+
+/* Widens row y of in, or zeros if there isn't one, into a padded row */
+static void smooth_row(int32_t *row, const uint8_t *in, int w, int h, int y)
+{
+  smooth_vb_t b;
+  int x;
+
+  memset(row, 0, SMOOTH_STRIDE(w) * sizeof (*row));
+  if (y < 0 || y >= h) {
+    return;
+  }
+  in += (size_t) y * w;
+  for (x = 0; x + SMOOTH_LANES <= w; x += SMOOTH_LANES) {
+    memcpy(&b, in + x, sizeof (b));
+    smooth_store(row + 2 + x, __builtin_convertvector(b, smooth_vi_t));
+  }
+  for (; x < w; x++) {
+    row[2 + x] = in[x];
+  }
+}
+
+void gaussian_smooth(const uint8_t *in, uint8_t *out, int w, int h,
+                     int32_t *scratch)
+{
+  static const int a[5] = { 1, 4, 7, 4, 1 };
+  const int stride = SMOOTH_STRIDE(w);
+  int32_t *rows[5], *v, *col_sum, *col_fix, *tmp;
+  smooth_vi_t t, s;
+  smooth_vb_t b;
+  int x, y, k, row_sum, row_fix;
+
+  for (k = 0; k < 5; k++) {
+    rows[k] = scratch + k * stride;
+    smooth_row(rows[k], in, w, h, k - 2);
+  }
+  v = scratch + 5 * stride;
+  col_sum = scratch + 6 * stride;
+  col_fix = scratch + 7 * stride;
+
+  // Weight of the columns in range, for a and for [1 4 1]
+  for (x = 0; x < stride; x++) {
+    col_sum[x] = 1;
+    col_fix[x] = 0;
+  }
+  for (x = 0; x < w; x++) {
+    for (col_sum[x] = 0, k = 0; k < 5; k++) {
+      if (x + k - 2 >= 0 && x + k - 2 < w) {
+        col_sum[x] += a[k];
+      }
+    }
+    col_fix[x] = 4 + (x > 0) + (x < w - 1);
+  }
+
+  for (y = 0; y < h; y++) {
+    for (row_sum = 0, k = 0; k < 5; k++) {
+      if (y + k - 2 >= 0 && y + k - 2 < h) {
+        row_sum += a[k];
+      }
+    }
+    row_fix = (y > 0) + (y < h - 1);
+
+    for (x = 0; x < stride; x += SMOOTH_LANES) {
+      smooth_store(v + x, (smooth_load(rows[0] + x) +
+                           smooth_load(rows[1] + x) * 4 +
+                           smooth_load(rows[2] + x) * 7 +
+                           smooth_load(rows[3] + x) * 4 +
+                           smooth_load(rows[4] + x)));
+    }
+
+    for (x = 0; x < w; x += SMOOTH_LANES) {
+      t = (smooth_load(v + x) +
+           smooth_load(v + x + 1) * 4 +
+           smooth_load(v + x + 2) * 7 +
+           smooth_load(v + x + 3) * 4 +
+           smooth_load(v + x + 4) -
+           (smooth_load(rows[2] + x + 1) +
+            smooth_load(rows[2] + x + 2) * 4 +
+            smooth_load(rows[2] + x + 3)) * 2 -
+           (smooth_load(rows[1] + x + 2) +
+            smooth_load(rows[3] + x + 2)) * 2);
+      s = (smooth_load(col_sum + x) * row_sum -
+           smooth_load(col_fix + x) * 2 - row_fix * 2);
+      b = __builtin_convertvector(__builtin_convertvector(t, smooth_vf_t) /
+                                  __builtin_convertvector(s, smooth_vf_t),
+                                  smooth_vb_t);
+      memcpy(out + (size_t) y * w + x, &b,
+             w - x < SMOOTH_LANES ? w - x : SMOOTH_LANES);
+    }
+
+    tmp = rows[0];
+    rows[0] = rows[1];
+    rows[1] = rows[2];
+    rows[2] = rows[3];
+    rows[3] = rows[4];
+    rows[4] = tmp;
+    smooth_row(rows[4], in, w, h, y + 3);
+  }
+}
+
+static int smooth_height(gen_map_t *m, rng_t *r)
+{
+  MapArray<uint8_t> &height = diffused;
+  int32_t i, x, y;
+  /*  FILE *out;*/
+
+  memset(height.cells, 0, height.bytes());
+
+  /* Seed with some values */
+  for (i = 1; i < 255; i += 20) {
+    do {
+      x = rng_rand(r) % map_x;
+      y = rng_rand(r) % map_y;
+    } while (height[y][x]);
+    height[y][x] = i;
+    fill_push(&fill, x, y);
+  }
+
+  /*
+  out = fopen("seeded.pgm", "w");
+  fprintf(out, "P5\n%u %u\n255\n", map_x, map_y);
+  fwrite(height.cells, height.bytes(), 1, out);
+  fclose(out);
+  */
+  
+  /* Diffuse the vaules to fill the space */
+  while (fill.head != fill.tail) {
+    fill_pop(&fill, &x, &y);
+    i = height[y][x];
+
+    if (x - 1 >= 0 && y - 1 >= 0 && !height[y - 1][x - 1]) {
+      height[y - 1][x - 1] = i;
+      fill_push(&fill, x - 1, y - 1);
+    }
+    if (x - 1 >= 0 && !height[y][x - 1]) {
+      height[y][x - 1] = i;
+      fill_push(&fill, x - 1, y);
+    }
+    if (x - 1 >= 0 && y + 1 < map_y && !height[y + 1][x - 1]) {
+      height[y + 1][x - 1] = i;
+      fill_push(&fill, x - 1, y + 1);
+    }
+    if (y - 1 >= 0 && !height[y - 1][x]) {
+      height[y - 1][x] = i;
+      fill_push(&fill, x, y - 1);
+    }
+    if (y + 1 < map_y && !height[y + 1][x]) {
+      height[y + 1][x] = i;
+      fill_push(&fill, x, y + 1);
+    }
+    if (x + 1 < map_x && y - 1 >= 0 && !height[y - 1][x + 1]) {
+      height[y - 1][x + 1] = i;
+      fill_push(&fill, x + 1, y - 1);
+    }
+    if (x + 1 < map_x && !height[y][x + 1]) {
+      height[y][x + 1] = i;
+      fill_push(&fill, x + 1, y);
+    }
+    if (x + 1 < map_x && y + 1 < map_y && !height[y + 1][x + 1]) {
+      height[y + 1][x + 1] = i;
+      fill_push(&fill, x + 1, y + 1);
+    }
+  }
+
+  /* And smooth it a bit with a gaussian convolution.  This used to be *
+   * done twice, but both passes read height, so once is the same.     */
+  gaussian_smooth(height.cells, m->height.cells, map_x, map_y,
+                  smooth_scratch);
+
+  /*
+  out = fopen("diffused.pgm", "w");
+  fprintf(out, "P5\n%u %u\n255\n", map_x, map_y);
+  fwrite(height.cells, height.bytes(), 1, out);
+  fclose(out);
+
+  out = fopen("smoothed.pgm", "w");
+  fprintf(out, "P5\n%u %u\n255\n", map_x, map_y);
+  fwrite(m->height.cells, m->height.bytes(), 1, out);
+  fclose(out);
+  */
+
+  return 0;
+}
+
+/* A building's 2x2 at p sits beside a path, off the path, and clear *
+ * of the other building.                                            */
+static bool building_fits(gen_map_t *m, pair_t p)
+{
+  return ((((mapxy(p[dim_x] - 1, p[dim_y]    ) == ter_path)     &&
+            (mapxy(p[dim_x] - 1, p[dim_y] + 1) == ter_path))    ||
+           ((mapxy(p[dim_x] + 2, p[dim_y]    ) == ter_path)     &&
+            (mapxy(p[dim_x] + 2, p[dim_y] + 1) == ter_path))    ||
+           ((mapxy(p[dim_x]    , p[dim_y] - 1) == ter_path)     &&
+            (mapxy(p[dim_x] + 1, p[dim_y] - 1) == ter_path))    ||
+           ((mapxy(p[dim_x]    , p[dim_y] + 2) == ter_path)     &&
+            (mapxy(p[dim_x] + 1, p[dim_y] + 2) == ter_path)))   &&
+          (((mapxy(p[dim_x]    , p[dim_y]    ) != ter_mart)     &&
+            (mapxy(p[dim_x]    , p[dim_y]    ) != ter_center)   &&
+            (mapxy(p[dim_x] + 1, p[dim_y]    ) != ter_mart)     &&
+            (mapxy(p[dim_x] + 1, p[dim_y]    ) != ter_center)   &&
+            (mapxy(p[dim_x]    , p[dim_y] + 1) != ter_mart)     &&
+            (mapxy(p[dim_x]    , p[dim_y] + 1) != ter_center)   &&
+            (mapxy(p[dim_x] + 1, p[dim_y] + 1) != ter_mart)     &&
+            (mapxy(p[dim_x] + 1, p[dim_y] + 1) != ter_center))) &&
+          (((mapxy(p[dim_x]    , p[dim_y]    ) != ter_path)     &&
+            (mapxy(p[dim_x] + 1, p[dim_y]    ) != ter_path)     &&
+            (mapxy(p[dim_x]    , p[dim_y] + 1) != ter_path)     &&
+            (mapxy(p[dim_x] + 1, p[dim_y] + 1) != ter_path))));
+}
+
+/* Random spots first, as ever.  On short maps there are only a couple *
+ * of rows to pick from and the paths can block all of them, so after  *
+ * BUILDING_TRIES misses every spot is checked in turn, and if none    *
+ * fits the map goes without.  Returns false in that case.             */
+#define BUILDING_TRIES 10000
+
+static bool find_building_location(gen_map_t *m, pair_t p, rng_t *r)
+{
+  int i;
+
+  for (i = 0; i < BUILDING_TRIES; i++) {
+    p[dim_x] = rng_rand(r) % (map_x - 5) + 3;
+    p[dim_y] = rng_rand(r) % (map_y - 10) + 5;
+
+    if (building_fits(m, p)) {
+      return true;
+    }
+  }
+
+  for (p[dim_y] = 5; p[dim_y] < map_y - 5; p[dim_y]++) {
+    for (p[dim_x] = 3; p[dim_x] < map_x - 2; p[dim_x]++) {
+      if (building_fits(m, p)) {
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+static int place_pokemart(gen_map_t *m, rng_t *r)
+{
+  pair_t p;
+
+  if (!find_building_location(m, p, r)) {
+    return 1;
+  }
+
+  mapxy(p[dim_x]    , p[dim_y]    ) = ter_mart;
+  mapxy(p[dim_x] + 1, p[dim_y]    ) = ter_mart;
+  mapxy(p[dim_x]    , p[dim_y] + 1) = ter_mart;
+  mapxy(p[dim_x] + 1, p[dim_y] + 1) = ter_mart;
+
+  return 0;
+}
+
+static int place_center(gen_map_t *m, rng_t *r)
+{  pair_t p;
+
+  if (!find_building_location(m, p, r)) {
+    return 1;
+  }
+
+  mapxy(p[dim_x]    , p[dim_y]    ) = ter_center;
+  mapxy(p[dim_x] + 1, p[dim_y]    ) = ter_center;
+  mapxy(p[dim_x]    , p[dim_y] + 1) = ter_center;
+  mapxy(p[dim_x] + 1, p[dim_y] + 1) = ter_center;
+
+  return 0;
+}
+
+static int map_terrain(gen_map_t *m, int16_t n, int16_t s, int16_t e,
+                       int16_t w, rng_t *r)
+{
+  int32_t i, x, y;
+  //  FILE *out;
+  int num_grass, num_clearing, num_mountain, num_forest, num_total;
+  terrain_type_t type;
+  int added_current = 0;
+  
+  num_grass = rng_rand(r) % 4 + 2;
+  num_clearing = rng_rand(r) % 4 + 2;
+  num_mountain = rng_rand(r) % 2 + 1;
+  num_forest = rng_rand(r) % 2 + 1;
+  num_total = num_grass + num_clearing + num_mountain + num_forest;
+
+  memset(m->map.cells, 0, m->map.bytes());
+
+  /* Seed with some values */
+  for (i = 0; i < num_total; i++) {
+    do {
+      x = rng_rand(r) % map_x;
+      y = rng_rand(r) % map_y;
+    } while (m->map[y][x]);
+    if (i == 0) {
+      type = ter_grass;
+    } else if (i == num_grass) {
+      type = ter_clearing;
+    } else if (i == num_grass + num_clearing) {
+      type = ter_mountain;
+    } else if (i == num_grass + num_clearing + num_mountain) {
+      type = ter_forest;
+    }
+    m->map[y][x] = type;
+    fill_push(&fill, x, y);
+  }
+
+  /*
+  out = fopen("seeded.pgm", "w");
+  fprintf(out, "P5\n%u %u\n255\n", map_x, map_y);
+  fwrite(m->map.cells, m->map.bytes(), 1, out);
+  fclose(out);
+  */
+
+  /* Diffuse the vaules to fill the space */
+  while (fill.head != fill.tail) {
+    fill_pop(&fill, &x, &y);
+    i = m->map[y][x];
+    
+    if (x - 1 >= 0 && !m->map[y][x - 1]) {
+      if ((rng_rand(r) % 100) < 80) {
+        m->map[y][x - 1] = (terrain_type_t) i;
+        fill_push(&fill, x - 1, y);
+      } else if (!added_current) {
+        added_current = 1;
+        m->map[y][x] = (terrain_type_t) i;
+        fill_push(&fill, x, y);
+      }
+    }
+
+    if (y - 1 >= 0 && !m->map[y - 1][x]) {
+      if ((rng_rand(r) % 100) < 20) {
+        m->map[y - 1][x] = (terrain_type_t) i;
+        fill_push(&fill, x, y - 1);
+      } else if (!added_current) {
+        added_current = 1;
+        m->map[y][x] = (terrain_type_t) i;
+        fill_push(&fill, x, y);
+      }
+    }
+
+    if (y + 1 < map_y && !m->map[y + 1][x]) {
+      if ((rng_rand(r) % 100) < 20) {
+        m->map[y + 1][x] = (terrain_type_t) i;
+        fill_push(&fill, x, y + 1);
+      } else if (!added_current) {
+        added_current = 1;
+        m->map[y][x] = (terrain_type_t) i;
+        fill_push(&fill, x, y);
+      }
+    }
+
+    if (x + 1 < map_x && !m->map[y][x + 1]) {
+      if ((rng_rand(r) % 100) < 80) {
+        m->map[y][x + 1] = (terrain_type_t) i;
+        fill_push(&fill, x + 1, y);
+      } else if (!added_current) {
+        added_current = 1;
+        m->map[y][x] = (terrain_type_t) i;
+        fill_push(&fill, x, y);
+      }
+    }
+
+    added_current = 0;
+  }
+
+  /*
+  out = fopen("diffused.pgm", "w");
+  fprintf(out, "P5\n%u %u\n255\n", map_x, map_y);
+  fwrite(m->map.cells, m->map.bytes(), 1, out);
+  fclose(out);
+  */
+  
+  for (y = 0; y < map_y; y++) {
+    for (x = 0; x < map_x; x++) {
+      if (y == 0 || y == map_y - 1 ||
+          x == 0 || x == map_x - 1) {
+        mapxy(x, y) = ter_boulder;
+      }
+    }
+  }
+
+  m->n = n;
+  m->s = s;
+  m->e = e;
+  m->w = w;
+
+  if (n != -1) {
+    mapxy(n,         0        ) = ter_exit;
+    mapxy(n,         1        ) = ter_path;
+  }
+  if (s != -1) {
+    mapxy(s,         map_y - 1) = ter_exit;
+    mapxy(s,         map_y - 2) = ter_path;
+  }
+  if (w != -1) {
+    mapxy(0,         w        ) = ter_exit;
+    mapxy(1,         w        ) = ter_path;
+  }
+  if (e != -1) {
+    mapxy(map_x - 1, e        ) = ter_exit;
+    mapxy(map_x - 2, e        ) = ter_path;
+  }
+
+  return 0;
+}
+
+static int place_boulders(gen_map_t *m, rng_t *r)
+{
+  int i;
+  int x, y;
+
+  for (i = 0; i < MIN_BOULDERS || rng_rand(r) % 100 < BOULDER_PROB; i++) {
+    y = rng_rand(r) % (map_y - 2) + 1;
+    x = rng_rand(r) % (map_x - 2) + 1;
+    if (m->map[y][x] != ter_forest && m->map[y][x] != ter_path) {
+      m->map[y][x] = ter_boulder;
+    }
+  }
+
+  return 0;
+}
+
+static int place_trees(gen_map_t *m, rng_t *r)
+{
+  int i;
+  int x, y;
+  
+  for (i = 0; i < MIN_TREES || rng_rand(r) % 100 < TREE_PROB; i++) {
+    y = rng_rand(r) % (map_y - 2) + 1;
+    x = rng_rand(r) % (map_x - 2) + 1;
+    if (m->map[y][x] != ter_mountain && m->map[y][x] != ter_path) {
+      m->map[y][x] = ter_tree;
+    }
+  }
+
+  return 0;
+}
+
+void gaussian_smooth_reference(const uint8_t *in, uint8_t *out, int w, int h)
+{
+  int32_t x, y, s, t, p, q;
+
+  for (y = 0; y < h; y++) {
+    for (x = 0; x < w; x++) {
+      for (s = t = p = 0; p < 5; p++) {
+        for (q = 0; q < 5; q++) {
+          if (y + (p - 2) >= 0 && y + (p - 2) < h &&
+              x + (q - 2) >= 0 && x + (q - 2) < w) {
+            s += gaussian[p][q];
+            t += in[(y + (p - 2)) * w + x + (q - 2)] * gaussian[p][q];
+          }
+        }
+      }
+      out[y * w + x] = t / s;
+    }
+  }
+}
+
+/* The gate in the edge south of (x, y) (dim_y) or east of it (dim_x). *
+ * Both maps on an edge ask for the same one, so gates line up without *
+ * either map needing the other to exist first.                        */
+static int16_t world_gate(uint32_t seed, int16_t x, int16_t y, dim_t d)
+{
+  rng_t r;
+
+  if (d == dim_y) {
+    rng_seed(&r, seed, x, y, rng_gate_s);
+    return 3 + rng_rand(&r) % (map_x - 6);
+  }
+
+  rng_seed(&r, seed, x, y, rng_gate_e);
+  return 3 + rng_rand(&r) % (map_y - 6);
+}
+
+/* Adds the time since *last to stage, and moves *last up to now */
+static void lap(mapgen_stats_t *stats, mapgen_stage_t stage,
+                struct timespec *last)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  stats->stage[stage] += ((t.tv_sec - last->tv_sec) +
+                          (t.tv_nsec - last->tv_nsec) / 1e9);
+  *last = t;
+}
+
+/* Packs what was built into a new Map, with nobody on it yet */
+static Map *pack_map(const gen_map_t *g)
+{
+  uint8_t *row;
+  Map *m;
+  int x, y;
+
+  m = map_alloc();
+  for (y = 0; y < map_y; y++) {
+    row = m->map.packed + (size_t) y * m->map.stride;
+    for (x = 0; x + 1 < map_x; x += 2) {
+      row[x / 2] = g->map[y][x] | (g->map[y][x + 1] << 4);
+    }
+    if (x < map_x) {
+      row[x / 2] = g->map[y][x];
+    }
+  }
+  m->n = g->n;
+  m->s = g->s;
+  m->e = g->e;
+  m->w = g->w;
+
+  return m;
+}
+
+Map *generate_map(uint32_t seed, int16_t x, int16_t y, mapgen_stats_t *stats)
+{
+  gen_map_t *m = &gen;
+  struct timespec t;
+  int d, p;
+  rng_t r;
+
+  if (!scratch_ready) {
+    scratch_init();
+  }
+  if (stats) {
+    clock_gettime(CLOCK_MONOTONIC, &t);
+  }
+
+  rng_seed(&r, seed, x, y, rng_terrain);
+
+  smooth_height(m, &r);
+  if (stats) {
+    lap(stats, mapgen_height, &t);
+  }
+
+  map_terrain(m,
+              y ? world_gate(seed, x, y - 1, dim_y) : -1,
+              y < world_size - 1 ? world_gate(seed, x, y, dim_y) : -1,
+              x < world_size - 1 ? world_gate(seed, x, y, dim_x) : -1,
+              x ? world_gate(seed, x - 1, y, dim_x) : -1,
+              &r);
+  if (stats) {
+    lap(stats, mapgen_terrain, &t);
+  }
+
+  place_boulders(m, &r);
+  if (stats) {
+    lap(stats, mapgen_boulders, &t);
+  }
+  place_trees(m, &r);
+  if (stats) {
+    lap(stats, mapgen_trees, &t);
+  }
+  build_paths(m, stats);
+  if (stats) {
+    lap(stats, mapgen_paths, &t);
+  }
+  d = (abs(x - (world_size / 2)) +
+       abs(y - (world_size / 2)));
+  p = d > 200 ? 5 : (50 - ((45 * d) / 200));
+  //  printf("d=%d, p=%d\n", d, p);
+  if ((rng_rand(&r) % 100) < p || !d) {
+    place_pokemart(m, &r);
+  }
+  if ((rng_rand(&r) % 100) < p || !d) {
+    place_center(m, &r);
+  }
+  if (stats) {
+    lap(stats, mapgen_buildings, &t);
+  }
+
+  return pack_map(m);
+}
+
@@ -0,0 +1,69 @@
+#ifndef MAPGEN_H
+# define MAPGEN_H
+
+# include <stdint.h>
+
+class Map;
+
+typedef enum mapgen_stage {
+  mapgen_height,
+  mapgen_terrain,
+  mapgen_boulders,
+  mapgen_trees,
+  mapgen_paths,
+  mapgen_buildings,
+  num_mapgen_stages
+} mapgen_stage_t;
+
+extern const char *mapgen_stage_name[num_mapgen_stages];
+
+/* Added to over every map generated: seconds spent in each stage, *
+ * and paths laid and the cells searched to lay them.               */
+typedef struct mapgen_stats {
+  double stage[num_mapgen_stages];
+  uint32_t paths;
+  uint64_t expanded;
+} mapgen_stats_t;
+
+/* Smallest map that still has room for gates and buildings (though a *
+ * short one may have to go without; see find_building_location()),  *
+ * and the largest whose distances and fill queue stay in range.      */
+# define MAP_MIN_X 20
+# define MAP_MIN_Y 12
+# define MAP_MAX   2048
+# define WORLD_MAX 32767
+
+/* Sets map_x, map_y and world_size; nonzero if any is out of range. *
+ * Only before the first map is generated, on any thread.             */
+int mapgen_set_size(int32_t x, int32_t y, int32_t world);
+
+/* Lay paths with A* rather than Dijkstra's.  Much less searching, but *
+ * ties can break differently, so the same seed makes a slightly       *
+ * different world.  Set it before generating anything.                */
+extern bool mapgen_astar;
+
+/* Everything about a map that doesn't depend on who's on it.  Only   *
+ * reads seed and (x, y), so it's safe on any thread, and a map comes *
+ * out the same whenever and however it's reached.  stats may be NULL. */
+Map *generate_map(uint32_t seed, int16_t x, int16_t y, mapgen_stats_t *stats);
+
+/* Frees a thread's generator scratch; call before it exits */
+void mapgen_thread_exit();
+
+# define SMOOTH_LANES 4
+
+/* Row stride in the smoothing scratch: two zero columns on the left, *
+ * and enough on the right for the last vector's horizontal taps.     */
+# define SMOOTH_STRIDE(w)                                               \
+  (((w) + SMOOTH_LANES - 1) / SMOOTH_LANES * SMOOTH_LANES + 2 * SMOOTH_LANES)
+/* Five input rows, the vertical pass and the two column weights */
+# define SMOOTH_SCRATCH(w) (8 * SMOOTH_STRIDE(w))
+
+/* Convolves the w by h image in with the smoothing kernel into out. *
+ * scratch holds SMOOTH_SCRATCH(w) entries.                          */
+void gaussian_smooth(const uint8_t *in, uint8_t *out, int w, int h,
+                     int32_t *scratch);
+/* The original scalar convolution, generalized to w by h */
+void gaussian_smooth_reference(const uint8_t *in, uint8_t *out, int w, int h);
+
+#endif
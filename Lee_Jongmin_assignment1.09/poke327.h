@@ -2,17 +2,33 @@
 # define POKE327_H
 
 # include <stdlib.h>
+# include <string.h>
 # include <assert.h>
 
 # include "heap.h"
+# include "rng.h"
 # include "character.h"
 # include "pokemon.h"
 
+# ifdef COUNT_ALLOCS
+/* Built with -DCOUNT_ALLOCS (make COUNT_ALLOCS=1), --bench-maps reports *
+ * allocations per map.  Per thread, so the background map generator    *
+ * doesn't disturb the main thread's count.                             */
+inline thread_local uint64_t malloc_count;
+
 #define malloc(size) ({          \
   void *_tmp;                    \
+  malloc_count++;                \
   assert((_tmp = malloc(size))); \
   _tmp;                          \
 })
+# else
+#define malloc(size) ({          \
+  void *_tmp;                    \
+  assert((_tmp = malloc(size))); \
+  _tmp;                          \
+})
+# endif
 
 /* Returns true if random float in [0,1] is less than *
  * numerator/denominator.  Uses only integer math.    */
@@ -38,21 +54,75 @@ typedef enum item {
 
 typedef int16_t pair_t[num_dims];
 
-#define MAP_X              80
+#define MAP_X              80  /* Default map size; also the view's */
 #define MAP_Y              21
 #define MIN_TREES          10
 #define MIN_BOULDERS       10
 #define TREE_PROB          95
 #define BOULDER_PROB       95
-#define WORLD_SIZE         401
+#define WORLD_SIZE         401 /* Default */
+#define WORLD_CHUNK        16
+#define MAP_BUDGET         64  /* MB of resident maps; see world_trim() */
 #define MIN_TRAINERS       7   
 #define ADD_TRAINER_PROB   50
 #define ENCOUNTER_PROB     10
 
 #define mappair(pair) (m->map[pair[dim_y]][pair[dim_x]])
 #define mapxy(x, y) (m->map[y][x])
-#define heightpair(pair) (m->height[pair[dim_y]][pair[dim_x]])
-#define heightxy(x, y) (m->height[y][x])
+
+/* The size of every map, and of the world, in maps.  MAP_X x MAP_Y  *
+ * and WORLD_SIZE unless set otherwise at startup, before any map is *
+ * made; see mapgen_set_size().                                      */
+extern int32_t map_x, map_y, world_size;
+
+/**************************************************************************
+ * Map size for code that's specialized on it.  fixed_dims is the        *
+ * default, known at compile time, so row strides and bounds fold into   *
+ * constants; runtime_dims is any other size.  with_dims() calls f with  *
+ * whichever one fits, so a hot loop is written once as a template on    *
+ * its dims and the common case pays nothing for sizes being variable.  *
+ **************************************************************************/
+struct fixed_dims {
+  static constexpr int32_t x = MAP_X, y = MAP_Y;
+};
+
+struct runtime_dims {
+  int32_t x, y;
+};
+
+template <class F>
+static inline void with_dims(F f)
+{
+  if (map_x == MAP_X && map_y == MAP_Y) {
+    f(fixed_dims());
+  } else {
+    f(runtime_dims { map_x, map_y });
+  }
+}
+
+/* A map-sized array, row-major in one block, that reads and assigns *
+ * [y][x] like the fixed arrays it replaced.                          */
+template <class T>
+class MapArray {
+ public:
+  T *cells;
+  int32_t w, h;
+
+  T *operator[](int y) const { return cells + (size_t) y * w; }
+
+  void init(int32_t width, int32_t height)
+  {
+    w = width;
+    h = height;
+    cells = (T *) malloc(bytes());
+  }
+  void destroy()
+  {
+    free(cells);
+    cells = NULL;
+  }
+  size_t bytes() const { return (size_t) w * h * sizeof (T); }
+};
 
 typedef enum __attribute__ ((__packed__)) terrain_type {
   ter_boulder,
@@ -76,7 +146,6 @@ typedef enum __attribute__ ((__packed__)) movement_type {
   move_wander,
   move_sentry,
   move_walk,
-  move_pc,
   num_movement_types
 } movement_type_t;
 
@@ -90,59 +159,331 @@ typedef enum __attribute__ ((__packed__)) character_type {
 
 class Character;
 
+/* Terrain at four bits a cell, two cells to a byte, low nibble first, *
+ * each row starting on a byte.  m->map[y][x] reads and assigns like   *
+ * the terrain_type_t array it replaced, so mapxy() and mappair() work *
+ * as they always have.  packed points just past the Map; see          *
+ * map_alloc().                                                        */
+class TerrainGrid {
+ public:
+  uint8_t *packed;
+  int32_t stride;
+
+  class Cell {
+    uint8_t *b;
+    int shift;
+   public:
+    Cell(uint8_t *b, int shift) : b(b), shift(shift) {}
+    operator terrain_type_t() const
+    {
+      return (terrain_type_t) ((*b >> shift) & 0xf);
+    }
+    Cell &operator=(terrain_type_t t)
+    {
+      *b = (*b & ~(0xf << shift)) | (t << shift);
+      return *this;
+    }
+    Cell &operator=(const Cell &c)
+    {
+      return *this = (terrain_type_t) c;
+    }
+  };
+
+  class Row {
+    uint8_t *b;
+   public:
+    Row(uint8_t *b) : b(b) {}
+    Cell operator[](int x) const { return Cell(b + (x >> 1), (x & 1) << 2); }
+  };
+
+  Row operator[](int y) { return Row(packed + (size_t) y * stride); }
+
+  /* Cell (x, y), for code specialized on the map size */
+  template <class D>
+  terrain_type_t at(D d, int32_t x, int32_t y) const
+  {
+    return (terrain_type_t) ((packed[(size_t) y * ((d.x + 1) / 2) + (x >> 1)] >>
+                              ((x & 1) << 2)) & 0xf);
+  }
+
+  static size_t bytes() { return (size_t) map_y * ((map_x + 1) / 2); }
+};
+
+/* Who's standing where.  Only a handful of cells are ever occupied, so  *
+ * instead of a pointer per cell there's a bit per cell, and a list of   *
+ * the occupied ones that's only searched when the bit is set.           *
+ * m->cmap[y][x] reads and assigns like the pointer grid it replaced.    */
+typedef struct occupant {
+  uint16_t x, y;
+  Character *c;
+} occupant_t;
+
+class Occupants {
+ public:
+  /* Also just past the Map, after the terrain */
+  uint8_t *bits;
+  occupant_t *list;
+  uint16_t num, size;
+
+  class Cell {
+    Occupants *o;
+    int x, y;
+   public:
+    Cell(Occupants *o, int x, int y) : o(o), x(x), y(y) {}
+    operator Character *() const { return o->get(x, y); }
+    Character *operator->() const { return o->get(x, y); }
+    Cell &operator=(Character *c)
+    {
+      o->set(x, y, c);
+      return *this;
+    }
+    Cell &operator=(const Cell &c)
+    {
+      return *this = (Character *) c;
+    }
+  };
+
+  class Row {
+    Occupants *o;
+    int y;
+   public:
+    Row(Occupants *o, int y) : o(o), y(y) {}
+    Cell operator[](int x) const { return Cell(o, x, y); }
+  };
+
+  Row operator[](int y) { return Row(this, y); }
+
+  /* Empty, and allocates nothing until someone stands somewhere */
+  void init()
+  {
+    memset(bits, 0, bytes());
+    list = NULL;
+    num = size = 0;
+  }
+  void destroy() { free(list); }
+
+  Character *get(int x, int y) const
+  {
+    int i = y * map_x + x;
+    uint16_t j;
+
+    if (!(bits[i / 8] & (1 << (i % 8)))) {
+      return NULL;
+    }
+    for (j = 0; list[j].x != x || list[j].y != y; j++)
+      ;
+    return list[j].c;
+  }
+  void set(int x, int y, Character *c);
+
+  static size_t bytes() { return ((size_t) map_x * map_y + 7) / 8; }
+};
+
+/* Turn order, as a timing wheel.  Each slot is one tick of the block of *
+ * TURN_SLOTS ticks that now falls in; anyone due in a later block waits  *
+ * on later until theirs comes up.  Slots and later are circular lists,  *
+ * by their tails, threaded through the characters themselves, so        *
+ * scheduling never allocates.  See turn_schedule().                     */
+# define TURN_SLOTS 128
+
+typedef struct turn_queue {
+  Character *slot[TURN_SLOTS];
+  Character *later;
+  uint64_t busy[TURN_SLOTS / 64];
+  int32_t now;
+  uint32_t size;
+} turn_queue_t;
+
+class Npc;
+
+/* Trainers in a chunk sit together, and never move once placed */
+# define NPC_CHUNK 16
+
+struct npc_chunk;
+
+/* A map's trainers.  What their turns and the trainer lists read is     *
+ * kept as an array per field, indexed by the trainer's slot, so a      *
+ * sweep over every trainer reads only what it needs, contiguously.     *
+ * The Npc holds the rest: its Pokemon, its stream and what the turn    *
+ * queue needs, and it's what the occupancy grid points to.  Npcs come  *
+ * out of chunks the store owns.                                        */
+typedef struct npc_store {
+  pair_t *pos;
+  int8_t (*dir)[num_dims];
+  movement_type_t *mtype;
+  uint8_t *defeated;
+  Npc **npc;
+  struct npc_chunk *chunks;
+  uint16_t num, alloc;
+} npc_store_t;
+
+struct map_sim;
+
 class Map {
  public:
-  terrain_type_t map[MAP_Y][MAP_X];
-  uint8_t height[MAP_Y][MAP_X];
-  Character *cmap[MAP_Y][MAP_X];
-  heap_t turn;
+  TerrainGrid map;
+  Occupants cmap;
+  turn_queue_t turn;
+  npc_store_t npcs;
+  /* Wild Pokemon met here */
+  rng_t encounter;
   int32_t num_trainers;
-  int8_t n, s, e, w;
+  int16_t n, s, e, w;
+  /* Where it is, and its place in the world's LRU list */
+  int16_t x, y;
+  Map *lru_prev, *lru_next;
+  /* Its trainers' own distance maps and stream, for when they move *
+   * with the PC elsewhere; NULL unless the world is living.  See   *
+   * worldsim.h.                                                    */
+  struct map_sim *sim;
 };
 
-/* Here instead of character.h to abvoid including character.h */
+/* What a trainer's turn reads besides its map's npc_store_t.  On the  *
+ * PC's map, that's the world's distance maps and rand().  Off screen, *
+ * it's the map's own, so maps can take turns on any thread at once;    *
+ * hikers and rivals make for where the PC was last seen instead.       */
+typedef struct move_ctx {
+  Map *m;
+  MapArray<int> *hiker_dist, *rival_dist;
+  rng_t *rng;
+  bool offscreen;
+} move_ctx_t;
+
+static inline int move_rand(move_ctx_t *x)
+{
+  return x->offscreen ? rng_rand(x->rng) : rand();
+}
+
+/* Here instead of character.h to abvoid including character.h.  No    *
+ * virtuals: what a character is is a tag, and a trainer's movement    *
+ * type is in its map's npc_store_t, so taking a turn is a table       *
+ * lookup.                                                             */
 class Character {
  public:
-  pair_t pos;
   char symbol;
+  character_type_t ctype;
   int next_turn;
+  /* Next in its turn_queue_t list */
+  Character *turn_next;
   Pokemon *pokemon[6];
   int bag[3];
-
-  virtual ~Character() {}
 };
 
+/* A trainer's position is in its map's npc_store_t; the PC's is here */
 class Pc : public Character {
  public:
+  pair_t pos;
+
+  Pc() { ctype = char_pc; }
 };
 
 class Npc : public Character {
  public:
+  /* Its index in the map's npc_store_t */
+  uint16_t slot;
+  /* For this trainer's Pokemon */
+  rng_t rng;
+};
+
+struct npc_chunk {
+  struct npc_chunk *next;
+  Npc npc[NPC_CHUNK];
+};
+
+/* c as a trainer, or NULL if it's the PC */
+static inline Npc *as_npc(Character *c)
+{
+  return c->ctype == char_pc ? NULL : static_cast<Npc *>(c);
+}
+
+/* All that's kept of an evicted map.  Terrain comes back from the seed; *
+ * trainers are what changes once a map exists, so they're saved as is. */
+typedef struct npc_delta {
+  uint16_t x, y;
   character_type_t ctype;
   movement_type_t mtype;
-  int defeated;
-  pair_t dir;
-};
+  int8_t dir[num_dims];
+  uint8_t defeated;
+  char symbol;
+  int32_t next_turn;
+  rng_t rng;
+} npc_delta_t;
+
+typedef struct map_delta {
+  rng_t encounter;
+  rng_t offscreen;
+  int32_t num_trainers;
+  uint32_t num_npcs;
+  npc_delta_t npc[];
+} map_delta_t;
+
+/* The world is sparse: maps are grouped into WORLD_CHUNK x WORLD_CHUNK *
+ * chunks, and only chunks holding a generated map exist, in an open-   *
+ * addressed hash table keyed on chunk coordinates.                     */
+typedef struct world_chunk {
+  int16_t x, y;
+  Map *map[WORLD_CHUNK][WORLD_CHUNK];
+  map_delta_t *delta[WORLD_CHUNK][WORLD_CHUNK];
+} world_chunk_t;
+
+typedef struct world_store {
+  world_chunk_t **table;
+  uint32_t size;
+  uint32_t num_chunks;
+  uint32_t num_maps;
+  uint32_t num_evicted;
+  /* Resident maps, most recently visited first */
+  Map *lru_head, *lru_tail;
+  size_t bytes;
+} world_store_t;
+
+/* Outlives the world, so it can be printed after teardown */
+typedef struct world_stats {
+  uint32_t generated;
+  uint32_t hits;
+  uint32_t rebuilt;
+  uint32_t evictions;
+  uint32_t resident;
+  uint32_t evicted;
+} world_stats_t;
 
 class World {
  public:
-  Map *world[WORLD_SIZE][WORLD_SIZE];
+  world_store_t maps;
+  /* Bytes of resident maps allowed before the coldest are evicted */
+  size_t map_budget;
+  world_stats_t map_stats;
   pair_t cur_idx;
   Map *cur_map;
   /* Please distance maps in world, not map, since *
    * we only need one pair at any given time.      */
-  int hiker_dist[MAP_Y][MAP_X];
-  int rival_dist[MAP_Y][MAP_X];
+  MapArray<int> hiker_dist;
+  MapArray<int> rival_dist;
   Pc pc;
+  /* Drawn from rand() at startup; every map is a function of this */
+  uint32_t seed;
   int quit;
 };
 
 extern const char *char_type_name[num_character_types];
 extern int32_t move_cost[num_character_types][num_terrain_types];
-extern void (*move_func[num_movement_types])(Character *, pair_t);
+/* Each takes a turn for trainer i of x's map */
+extern void (*move_func[num_movement_types])(move_ctx_t *x, int i,
+                                             pair_t dest);
+/* The turns of a chain of trainers on x's map from turn_pop_due(), all *
+ * due now, in order.  Returns how many there were.                     */
+uint32_t take_npc_turns(move_ctx_t *x, Character *c);
+
+/* Here instead of character.h because it needs character_type_t.  Makes *
+ * sure the hiker or rival distance map is current before it's read.    */
+void pathfind_need(character_type_t ct);
+/* Both distance maps on m from src, into the caller's arrays.  Shares *
+ * nothing with pathfind(), so it's safe on any thread.                */
+void pathfind_from(Map *m, pair_t src, MapArray<int> &hiker,
+                   MapArray<int> &rival);
 
-/* Even unallocated, a WORLD_SIZE x WORLD_SIZE array of pointers is a very *
- * large thing to put on the stack.  To avoid that, world is a global.     */
+/* The distance maps alone are too large to want on the stack, *
+ * and everything needs the world anyway, so world is a global. */
 extern World world;
 
 extern pair_t all_dirs[8];
@@ -155,11 +496,34 @@ extern pair_t all_dirs[8];
 
 typedef struct path {
   heap_node_t *hn;
-  uint8_t pos[2];
-  uint8_t from[2];
+  uint16_t pos[2];
+  uint16_t from[2];
   int32_t cost;
 } path_t;
 
+/* A Map and its terrain and occupancy grids, all in one block */
+static inline size_t map_alloc_size()
+{
+  return sizeof (Map) + TerrainGrid::bytes() + Occupants::bytes();
+}
+
+/* A Map with nobody on it.  Its grids come in the same block, so they *
+ * go when it's freed.  Terrain is left uninitialized.                 */
+static inline Map *map_alloc()
+{
+  Map *m;
+
+  m = (Map *) malloc(map_alloc_size());
+  m->map.packed = (uint8_t *) (m + 1);
+  m->map.stride = (map_x + 1) / 2;
+  m->cmap.bits = m->map.packed + TerrainGrid::bytes();
+  m->cmap.init();
+
+  return m;
+}
+
 int new_map(int teleport);
+/* NULL if the map at (x, y) hasn't been generated or is off the world */
+Map *world_map(int16_t x, int16_t y);
 
 #endif
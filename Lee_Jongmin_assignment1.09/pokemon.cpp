@@ -4,64 +4,16 @@
 #include "pokemon.h"
 #include "db_parse.h"
 
-static int compare_move(const void *v1, const void *v2)
-{
-  return ((levelup_move *) v1)->level - ((levelup_move *) v2)->level;
-}
-
-Pokemon::Pokemon(int level) : level(level)
+Pokemon::Pokemon(int level, rng_t *r) : level(level)
 {
   pokemon_species_db *s;
   unsigned i, j;
-  bool found;
 
   // Subtract 1 because array is 1-indexed
-  pokemon_species_index = rand() % ((sizeof (species) /
-                                     sizeof (species[0])) - 1);
+  pokemon_species_index = rng_rand(r) % (num_species - 1);
   s = species + pokemon_species_index;
   
-  if (!s->levelup_moves) {
-    // We have never generated a pokemon of this species before, so we
-    // need to find it's level-up moveset and save it for next time.
-    for (s->num_levelup_moves = 0, i = 1;
-         i < (sizeof (pokemon_moves) / sizeof (pokemon_moves[0]));
-         i++) {
-      if (s->id == pokemon_moves[i].pokemon_id &&
-          pokemon_moves[i].pokemon_move_method_id == 1) {
-        for (found = false, j = 0; !found && j < s->num_levelup_moves; j++) {
-          if (s->levelup_moves[j].move == pokemon_moves[i].move_id) {
-            found = true;
-          }
-        }
-        if (!found) {
-          s->num_levelup_moves++;
-          s->levelup_moves = ((levelup_move *)
-                              realloc(s->levelup_moves,
-                                      (s->num_levelup_moves *
-                                       sizeof (*s->levelup_moves))));
-          s->levelup_moves[s->num_levelup_moves - 1].level =
-            pokemon_moves[i].level;
-          s->levelup_moves[s->num_levelup_moves - 1].move =
-            pokemon_moves[i].move_id;
-        }
-      }
-    }
-    // s->levelup_moves now contains all of the moves this species can learn
-    // through leveling up.  Now we'll sort it by level to make that process
-    // simpler.
-    qsort(s->levelup_moves, s->num_levelup_moves,
-          sizeof (*s->levelup_moves), compare_move);
-
-    // Also initialize base stats while we're here
-    s->base_stat[0] = pokemon_stats[pokemon_species_index * 6 - 5].base_stat;
-    s->base_stat[1] = pokemon_stats[pokemon_species_index * 6 - 4].base_stat;
-    s->base_stat[2] = pokemon_stats[pokemon_species_index * 6 - 3].base_stat;
-    s->base_stat[3] = pokemon_stats[pokemon_species_index * 6 - 2].base_stat;
-    s->base_stat[4] = pokemon_stats[pokemon_species_index * 6 - 1].base_stat;
-    s->base_stat[5] = pokemon_stats[pokemon_species_index * 6 - 0].base_stat;
-  }
-
-  // Get pokemon's move(s).
+  // Get pokemon's move(s).  levelup_moves is sorted by level.
   for (i = 0;
        i < s->num_levelup_moves && s->levelup_moves[i].level <= level;
        i++)
@@ -71,10 +23,10 @@ Pokemon::Pokemon(int level) : level(level)
   move_index[0] = move_index[1] = move_index[2] = move_index[3] = 0;
   // I don't think 0 moves is possible, but account for it to be safe
   if (i) {
-    move_index[0] = s->levelup_moves[rand() % i].move;
+    move_index[0] = s->levelup_moves[rng_rand(r) % i].move;
     if (i != 1) {
       do {
-        j = rand() % i;
+        j = rng_rand(r) % i;
       } while (s->levelup_moves[j].move == move_index[0]);
       move_index[1] = s->levelup_moves[j].move;
     }
@@ -82,15 +34,15 @@ Pokemon::Pokemon(int level) : level(level)
 
   // Calculate IVs
   for (i = 0; i < 6; i++) {
-    IV[i] = rand() & 0xf;
+    IV[i] = rng_rand(r) & 0xf;
     effective_stat[i] = 5 + ((s->base_stat[i] + IV[i]) * 2 * level) / 100;
     if (i == 0) { // HP
       effective_stat[i] += 5 + level;
     }
   }
 
-  shiny = ((rand() & 0x1fff) ? false : true);
-  gender = ((rand() & 0x1fff) ? gender_female : gender_male);
+  shiny = ((rng_rand(r) & 0x1fff) ? false : true);
+  gender = ((rng_rand(r) & 0x1fff) ? gender_female : gender_male);
   cur_hp = effective_stat[stat_hp];
 }
 
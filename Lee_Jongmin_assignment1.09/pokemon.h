@@ -3,6 +3,8 @@
 
 # include <iostream>
 
+# include "rng.h"
+
 enum pokemon_stat {
   stat_hp,
   stat_atk,
@@ -28,7 +30,7 @@ class Pokemon {
   bool shiny;
   pokemon_gender gender;
  public:
-  Pokemon(int level);
+  Pokemon(int level, rng_t *r);
   const char *get_species() const;
   int get_hp() const;
   int get_atk() const;
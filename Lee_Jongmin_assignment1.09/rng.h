@@ -0,0 +1,58 @@
+#ifndef RNG_H
+# define RNG_H
+
+# include <stdint.h>
+
+/* Everything a map holds is drawn from streams instead of rand().  A    *
+ * stream is seeded from the world seed, a map's coordinates and what    *
+ * it's for, so a map comes out the same whatever order, or thread, it's *
+ * made in, and one map's draws never shift another's.  It's SplitMix64, *
+ * which is counter based: the nth draw is a hash of key + n * gamma, so  *
+ * seeding costs two mixes and a stream is a single word.  rng_rand() has *
+ * the same range as rand().                                              */
+typedef enum rng_stream {
+  rng_terrain,
+  rng_gate_s,
+  rng_gate_e,
+  rng_characters,
+  rng_encounter,
+  rng_starter,
+  rng_headless,
+  rng_offscreen
+} rng_stream_t;
+
+typedef struct rng {
+  uint64_t s;
+} rng_t;
+
+# define RNG_GAMMA 0x9e3779b97f4a7c15ULL
+
+static inline uint64_t rng_mix(uint64_t z)
+{
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+  return z ^ (z >> 31);
+}
+
+static inline void rng_seed(rng_t *r, uint32_t seed, int16_t x, int16_t y,
+                            rng_stream_t stream)
+{
+  r->s = rng_mix(((uint64_t) seed << 32) |
+                 ((uint64_t) (uint16_t) x << 16) | (uint16_t) y);
+  r->s = rng_mix(r->s + stream);
+}
+
+static inline int rng_rand(rng_t *r)
+{
+  return (int) (rng_mix(r->s += RNG_GAMMA) >> 33);
+}
+
+/* Seeds child from the next draw of parent, for things like a trainer *
+ * that need a stream of their own but are made from a map's stream.   */
+static inline void rng_split(rng_t *child, rng_t *parent)
+{
+  child->s = rng_mix(rng_mix(parent->s += RNG_GAMMA) ^ RNG_GAMMA);
+}
+
+#endif
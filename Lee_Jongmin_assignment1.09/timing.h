@@ -0,0 +1,17 @@
+#ifndef TIMING_H
+# define TIMING_H
+
+# include <time.h>
+
+/* Seconds on the monotonic clock, for the benches and stats.  Inline, *
+ * and plain C, so heap.c's test driver can share it.                  */
+static inline double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#endif
@@ -0,0 +1,286 @@
+#include <stdint.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+#include "poke327.h"
+#include "character.h"
+#include "worldsim.h"
+#include "timing.h"
+
+int32_t world_sim_radius;
+unsigned world_sim_threads = 1;
+world_sim_stats_t world_sim_stats;
+
+/* World time, and what it was at the last step */
+static uint64_t sim_clock, sim_last;
+
+/**************************************************************************
+ * The executor.  Each thread has a deque of maps.  A step deals the maps *
+ * out round robin, then every thread, the main one included, takes from *
+ * the back of its own until it's empty and then steals from the front   *
+ * of the others'.  No task makes more, so once a thread finds them all  *
+ * empty its part of the step is done.  Maps differ a lot in how many     *
+ * trainers they have and how far behind they are, which is what the     *
+ * stealing evens out.  Workers sleep between steps.                      *
+ **************************************************************************/
+
+typedef struct sim_deque {
+  std::mutex lock;
+  std::vector<Map *> maps;
+  uint32_t head;
+} sim_deque_t;
+
+static struct {
+  std::vector<std::thread> pool;
+  std::mutex lock;
+  std::condition_variable work, done;
+  /* Bumped for each step the workers are woken for */
+  uint32_t round;
+  unsigned running;
+  bool quit;
+  sim_deque_t *deque;
+  /* Per thread, so counting doesn't contend; summed after each step */
+  world_sim_stats_t *stats;
+} sim;
+
+void map_sim_new(Map *m)
+{
+  map_sim_t *s;
+
+  s = (map_sim_t *) malloc(sizeof (*s));
+  s->hiker_dist.init(map_x, map_y);
+  s->rival_dist.init(map_x, map_y);
+  s->stale = true;
+  s->until = 0;
+  s->clock = 0;
+  s->step = 0;
+  rng_seed(&s->rng, world.seed, m->x, m->y, rng_offscreen);
+  m->sim = s;
+}
+
+void map_sim_delete(Map *m)
+{
+  if (m->sim) {
+    m->sim->hiker_dist.destroy();
+    m->sim->rival_dist.destroy();
+    free(m->sim);
+    m->sim = NULL;
+  }
+}
+
+size_t map_sim_bytes()
+{
+  return sizeof (map_sim_t) + 2 * (size_t) map_x * map_y * sizeof (int);
+}
+
+/* Takes m's turns up to its until */
+static void sim_map(Map *m, world_sim_stats_t *st)
+{
+  map_sim_t *s = m->sim;
+  move_ctx_t x = { m, &s->hiker_dist, &s->rival_dist, &s->rng, true };
+  Character *c;
+
+  if (s->stale) {
+    pathfind_from(m, s->pc_left, s->hiker_dist, s->rival_dist);
+    s->stale = false;
+  }
+
+  while ((c = turn_peek(&m->turn)) && c->next_turn < s->until) {
+    c = turn_pop_due(&m->turn);
+    st->turns += take_npc_turns(&x, c);
+    turn_schedule_chain(&m->turn, c);
+  }
+  st->maps++;
+}
+
+static Map *sim_take(unsigned self)
+{
+  sim_deque_t *d;
+  unsigned i;
+  Map *m;
+
+  d = sim.deque + self;
+  {
+    std::lock_guard<std::mutex> l(d->lock);
+    if (d->head < d->maps.size()) {
+      m = d->maps.back();
+      d->maps.pop_back();
+      return m;
+    }
+  }
+
+  for (i = 1; i < world_sim_threads; i++) {
+    d = sim.deque + (self + i) % world_sim_threads;
+    std::lock_guard<std::mutex> l(d->lock);
+    if (d->head < d->maps.size()) {
+      sim.stats[self].steals++;
+      return d->maps[d->head++];
+    }
+  }
+
+  return NULL;
+}
+
+static void sim_drain(unsigned self)
+{
+  Map *m;
+
+  while ((m = sim_take(self))) {
+    sim_map(m, sim.stats + self);
+  }
+}
+
+static void sim_worker(unsigned self)
+{
+  std::unique_lock<std::mutex> l(sim.lock);
+  uint32_t seen = 0;
+
+  for (;;) {
+    sim.work.wait(l, [&] { return sim.quit || sim.round != seen; });
+    if (sim.quit) {
+      break;
+    }
+    seen = sim.round;
+    l.unlock();
+    sim_drain(self);
+    l.lock();
+    if (!--sim.running) {
+      sim.done.notify_one();
+    }
+  }
+}
+
+void world_sim_start()
+{
+  unsigned i;
+
+  if (!world_sim_threads) {
+    world_sim_threads = 1;
+  }
+  sim_clock = sim_last = 0;
+  memset(&world_sim_stats, 0, sizeof (world_sim_stats));
+  sim.deque = new sim_deque_t[world_sim_threads];
+  sim.stats = new world_sim_stats_t[world_sim_threads]();
+  sim.round = 0;
+  sim.running = 0;
+  sim.quit = false;
+  for (i = 1; i < world_sim_threads; i++) {
+    sim.pool.push_back(std::thread(sim_worker, i));
+  }
+}
+
+void world_sim_stop()
+{
+  unsigned i;
+
+  {
+    std::lock_guard<std::mutex> l(sim.lock);
+    sim.quit = true;
+  }
+  sim.work.notify_all();
+  for (i = 0; i < sim.pool.size(); i++) {
+    sim.pool[i].join();
+  }
+  sim.pool.clear();
+
+  delete [] sim.deque;
+  delete [] sim.stats;
+  sim.deque = NULL;
+  sim.stats = NULL;
+}
+
+/* Gives every resident map in range but the PC's the time since the *
+ * last step, or since the PC left it, and runs them all.  A map that *
+ * was out of range at the last step has been frozen, so it only gets *
+ * the time since then.                                               */
+static void world_sim_step()
+{
+  world_sim_stats_t *st;
+  uint32_t step, n;
+  unsigned i;
+  double t;
+  Map *m;
+
+  t = now();
+  step = ++world_sim_stats.steps;
+  for (n = 0, m = world.maps.lru_head; m; m = m->lru_next) {
+    if (m == world.cur_map || !m->sim ||
+        abs(m->x - world.cur_idx[dim_x]) > world_sim_radius ||
+        abs(m->y - world.cur_idx[dim_y]) > world_sim_radius) {
+      continue;
+    }
+    if (m->sim->step + 1 != step) {
+      m->sim->clock = sim_last;
+    }
+    m->sim->until += sim_clock - m->sim->clock;
+    world_sim_stats.map_ticks += sim_clock - m->sim->clock;
+    m->sim->clock = sim_clock;
+    m->sim->step = step;
+    sim.deque[n++ % world_sim_threads].maps.push_back(m);
+  }
+  sim_last = sim_clock;
+
+  if (n) {
+    // Not worth waking anyone for a single map
+    if (n > 1 && world_sim_threads > 1) {
+      {
+        std::lock_guard<std::mutex> l(sim.lock);
+        sim.round++;
+        sim.running = world_sim_threads - 1;
+      }
+      sim.work.notify_all();
+    }
+    sim_drain(0);
+    if (n > 1 && world_sim_threads > 1) {
+      std::unique_lock<std::mutex> l(sim.lock);
+      sim.done.wait(l, [] { return !sim.running; });
+    }
+
+    for (i = 0; i < world_sim_threads; i++) {
+      st = sim.stats + i;
+      world_sim_stats.maps += st->maps;
+      world_sim_stats.turns += st->turns;
+      world_sim_stats.steals += st->steals;
+      memset(st, 0, sizeof (*st));
+      sim.deque[i].maps.clear();
+      sim.deque[i].head = 0;
+    }
+  }
+  world_sim_stats.seconds += now() - t;
+}
+
+void world_sim_leave(Map *m)
+{
+  map_sim_t *s;
+
+  if (!world_sim_radius || !(s = m->sim)) {
+    return;
+  }
+
+  if (s->pc_left[dim_x] != world.pc.pos[dim_x] ||
+      s->pc_left[dim_y] != world.pc.pos[dim_y]) {
+    s->pc_left[dim_x] = world.pc.pos[dim_x];
+    s->pc_left[dim_y] = world.pc.pos[dim_y];
+    s->stale = true;
+  }
+  // It's been moving all along, so it counts as run at the last step
+  s->until = m->turn.now;
+  s->clock = sim_clock;
+  s->step = world_sim_stats.steps;
+
+  world_sim_step();
+}
+
+void world_sim_pass(int32_t ticks)
+{
+  if (!world_sim_radius) {
+    return;
+  }
+
+  sim_clock += ticks;
+  if (sim_clock - sim_last >= WORLD_SIM_STEP) {
+    world_sim_step();
+  }
+}
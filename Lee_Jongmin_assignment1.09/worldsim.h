@@ -0,0 +1,67 @@
+#ifndef WORLDSIM_H
+# define WORLDSIM_H
+
+# include <stdint.h>
+
+# include "poke327.h"
+
+/**************************************************************************
+ * The living world.  Trainers on resident maps within world_sim_radius  *
+ * maps of the PC's (counting diagonals as one) go on taking turns while *
+ * the PC is elsewhere; everything further out stays as it was left.    *
+ * World time is what the PC spends moving.  Every WORLD_SIM_STEP ticks  *
+ * of it, and whenever the PC changes maps, each map in range is given   *
+ * the ticks that have passed and they're all run at once, a map to a    *
+ * task, on world_sim_threads threads.  A map's turns depend only on the *
+ * map, so it comes out the same however they're shared out.             *
+ **************************************************************************/
+
+# define WORLD_SIM_STEP 500
+
+/* 0, the default, freezes every map the PC isn't on */
+extern int32_t world_sim_radius;
+/* Including the main thread, which works too.  Set before init_world() */
+extern unsigned world_sim_threads;
+
+/* A map's own state for going on without the PC.  Hikers and rivals  *
+ * make for where the PC last stood, by distance maps that are made on *
+ * whichever thread first runs the map after the PC leaves it.         */
+typedef struct map_sim {
+  MapArray<int> hiker_dist, rival_dist;
+  pair_t pc_left;
+  bool stale;
+  /* Turns are taken up to, but not including, this tick of its own */
+  int32_t until;
+  /* The world time it's caught up to, and the last step that ran it */
+  uint64_t clock;
+  uint32_t step;
+  rng_t rng;
+} map_sim_t;
+
+/* Over every step; seconds is the wall time spent in them */
+typedef struct world_sim_stats {
+  uint32_t steps;
+  uint64_t map_ticks;
+  uint64_t maps;
+  uint64_t turns;
+  uint64_t steals;
+  double seconds;
+} world_sim_stats_t;
+
+extern world_sim_stats_t world_sim_stats;
+
+void world_sim_start();
+void world_sim_stop();
+
+/* Gives a newly resident m its state, seeded from its coordinates */
+void map_sim_new(Map *m);
+void map_sim_delete(Map *m);
+size_t map_sim_bytes();
+
+/* The PC is leaving m.  Catches up every map in range of where it's *
+ * going, so the one it arrives on is current.                       */
+void world_sim_leave(Map *m);
+/* ticks of world time have passed; runs a step when enough have */
+void world_sim_pass(int32_t ticks);
+
+#endif